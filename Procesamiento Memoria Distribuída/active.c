@@ -0,0 +1,321 @@
+/* Skipping of the quiescent regions for heat equation solver
+ *
+ * With the option -a tolerance the local domain is divided into tiles of
+ * ACTIVE_TILE x ACTIVE_TILE points. Every ACTIVE_CHECK steps the largest
+ * change of each updated tile is measured, and a tile whose change falls
+ * below the tolerance becomes quiescent: at the next step its values are
+ * copied once from prev to curr, so that both fields hold the same
+ * values, and after that the tile is skipped until it is woken up. A
+ * quiescent tile is woken up, and updated again, when one of its eight
+ * neighbouring tiles changed by at least the tolerance, or when the ghost
+ * values next to it, received from another rank, changed by at least the
+ * tolerance since the previous step. Between the checks an active tile
+ * counts as changing by its last measured change, and a tile woken up as
+ * changing by an unknown amount. The changes below the tolerance of the
+ * skipped tiles are lost, so the result is an approximation whose error
+ * grows with the tolerance.
+ *
+ * The kernels lose much of their speed on rows as short as a tile, so
+ * each row is updated in runs over the consecutive active tiles. At the
+ * check steps the change of every tile is then taken from the part of the
+ * run inside it. A thread updates all the rows of a row of tiles, so the
+ * changes of a tile are gathered by a single thread. The tiles away from
+ * the ghost layers are handled while the halo is exchanged and those next
+ * to them after it has arrived.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Side of the tiles in points */
+#define ACTIVE_TILE 32
+
+/* Steps between the measurements of the change of the tiles */
+#define ACTIVE_CHECK 2
+
+/* States of a tile */
+#define TILE_ACTIVE 0
+#define TILE_FREEZING 1         /* Quiescent, curr not yet copied */
+#define TILE_FROZEN 2           /* Quiescent, curr and prev equal */
+
+static int tx, ty;              /* Tiles in each direction */
+static char *state;             /* State of each tile */
+static double *change, *last;   /* Change of each tile in this and in the
+                                 * previous step, 0 if skipped */
+static double threshold;
+static int steps;               /* Steps since the setup */
+static long counts[4];          /* Points updated and skipped in the last
+                                 * step and since the setup */
+
+/* Prepare the tiles of the local domain of temperature, all active */
+void active_setup(field *temperature, double tolerance)
+{
+    int n;
+
+    tx = (temperature->nx + ACTIVE_TILE - 1) / ACTIVE_TILE;
+    ty = (temperature->ny + ACTIVE_TILE - 1) / ACTIVE_TILE;
+    n = tx * ty;
+    state = calloc(n, sizeof(char));
+    change = malloc(n * sizeof(double));
+    last = malloc(n * sizeof(double));
+    for (n = 0; n < tx * ty; n++)
+        change[n] = last[n] = HUGE_VAL;
+    threshold = tolerance;
+    steps = 0;
+    memset(counts, 0, sizeof(counts));
+}
+
+void active_free(void)
+{
+    free(state);
+    free(change);
+    free(last);
+}
+
+/* Rows [r[0], r[1]) and columns [r[2], r[3]) of the tile ti, tj in the
+ * local array of f */
+static void tile_range(field *f, int ti, int tj, int *r)
+{
+    r[0] = f->nghost + ti * ACTIVE_TILE;
+    r[1] = r[0] + ACTIVE_TILE < f->nx + f->nghost ? r[0] + ACTIVE_TILE
+                                                 : f->nx + f->nghost;
+    r[2] = f->nghost + tj * ACTIVE_TILE;
+    r[3] = r[2] + ACTIVE_TILE < f->ny + f->nghost ? r[2] + ACTIVE_TILE
+                                                 : f->ny + f->nghost;
+}
+
+/* Whether the tile ti, tj is next to the ghost layers */
+static inline int edge_tile(int ti, int tj)
+{
+    return ti == 0 || ti == tx - 1 || tj == 0 || tj == ty - 1;
+}
+
+/* Largest change of the ghost values next to the tile ti, tj between
+ * prev, received in this step, and curr, received in the previous one.
+ * Only the sides with a neighbouring rank are checked, the boundary
+ * values do not change. */
+static double ghost_change(field *curr, field *prev, int ti, int tj,
+                           parallel_data *parallel)
+{
+    int r[4], i, j, width = curr->pitch;
+    double d = 0.0;
+
+    tile_range(curr, ti, tj, r);
+    if (ti == 0 && parallel->nup != MPI_PROC_NULL)
+        for (j = r[2]; j < r[3]; j++)
+            d = fmax(d, fabs(prev->data[idx(r[0] - 1, j, width)] -
+                             curr->data[idx(r[0] - 1, j, width)]));
+    if (ti == tx - 1 && parallel->ndown != MPI_PROC_NULL)
+        for (j = r[2]; j < r[3]; j++)
+            d = fmax(d, fabs(prev->data[idx(r[1], j, width)] -
+                             curr->data[idx(r[1], j, width)]));
+    if (tj == 0 && parallel->nleft != MPI_PROC_NULL)
+        for (i = r[0]; i < r[1]; i++)
+            d = fmax(d, fabs(prev->data[idx(i, r[2] - 1, width)] -
+                             curr->data[idx(i, r[2] - 1, width)]));
+    if (tj == ty - 1 && parallel->nright != MPI_PROC_NULL)
+        for (i = r[0]; i < r[1]; i++)
+            d = fmax(d, fabs(prev->data[idx(i, r[3], width)] -
+                             curr->data[idx(i, r[3], width)]));
+    return d;
+}
+
+/* Wake up the tile t if one of its neighbours changed enough in the
+ * previous step, or else copy or skip it. At a check step the change of
+ * an active tile is measured from zero. Returns the number of points to
+ * update in the tile. */
+static int prepare_tile(field *curr, field *prev, int ti, int tj, int check)
+{
+    int t = ti * ty + tj, r[4], i, p, q, width;
+
+    change[t] = last[t];
+    if (state[t] != TILE_ACTIVE) {
+        for (p = ti - 1; p <= ti + 1; p++)
+            for (q = tj - 1; q <= tj + 1; q++)
+                if (p >= 0 && p < tx && q >= 0 && q < ty &&
+                    last[p * ty + q] >= threshold)
+                    state[t] = TILE_ACTIVE;
+        change[t] = state[t] == TILE_ACTIVE ? HUGE_VAL : 0.0;
+    }
+    if (check && state[t] == TILE_ACTIVE)
+        change[t] = 0.0;
+
+    tile_range(curr, ti, tj, r);
+    if (state[t] == TILE_FREEZING) {
+        width = curr->pitch;
+        for (i = r[0]; i < r[1]; i++)
+            memcpy(&curr->data[idx(i, r[2], width)],
+                   &prev->data[idx(i, r[2], width)],
+                   (r[3] - r[2]) * sizeof(real));
+        state[t] = TILE_FROZEN;
+    }
+    if (state[t] == TILE_FROZEN)
+        return 0;
+    return (r[1] - r[0]) * (r[3] - r[2]);
+}
+
+/* Raise the change of the tiles to the largest change of the points
+ * j0 <= j < j1 of the row i, just updated */
+static void measure_row(field *curr, field *prev, int i, int j0, int j1)
+{
+    int j, b, t, width = curr->pitch;
+    const real *c = &curr->data[idx(i, 0, width)];
+    const real *p = &prev->data[idx(i, 0, width)];
+    double d, v;
+
+    t = (i - 1) / ACTIVE_TILE * ty + (j0 - 1) / ACTIVE_TILE;
+    for (; j0 < j1; j0 = b, t++) {
+        b = 1 + ((j0 - 1) / ACTIVE_TILE + 1) * ACTIVE_TILE;
+        if (b > j1)
+            b = j1;
+        d = 0.0;
+        /* A comparison, fmax is a library call without -ffast-math */
+        #pragma omp simd reduction(max:d) private(v)
+        for (j = j0; j < b; j++) {
+            v = fabs((double) c[j] - p[j]);
+            d = v > d ? v : d;
+        }
+        if (d > change[t])
+            change[t] = d;
+    }
+}
+
+/* Update the points of the rows [r[0], r[1]) and the columns [r[2], r[3])
+ * of f that lie also in [lo, hi) in both directions, and measure their
+ * change if measure */
+static void update_rect(field *curr, field *prev, double cx, double cy,
+                        const int *r, int lo[2], int hi[2], int measure)
+{
+    int i, i0, i1, j0, j1, width = curr->pitch;
+
+    i0 = r[0] > lo[0] ? r[0] : lo[0];
+    i1 = r[1] < hi[0] ? r[1] : hi[0];
+    j0 = r[2] > lo[1] ? r[2] : lo[1];
+    j1 = r[3] < hi[1] ? r[3] : hi[1];
+    for (i = i0; i < i1 && j0 < j1; i++) {
+        evolve_row(&curr->data[idx(i, j0, width)],
+                   &prev->data[idx(i, j0, width)], width, j1 - j0, cx, cy);
+        if (measure)
+            measure_row(curr, prev, i, j0, j1);
+    }
+}
+
+/* Update the points j0 <= j < j1 of the row i in runs over the
+ * consecutive active tiles, and measure their change if measure */
+static void update_runs(field *curr, field *prev, double cx, double cy,
+                        int i, int j0, int j1, int measure)
+{
+    int ti, tj, t0, a, b, width = curr->pitch;
+
+    ti = (i - 1) / ACTIVE_TILE;
+    for (tj = (j0 - 1) / ACTIVE_TILE; tj <= (j1 - 2) / ACTIVE_TILE; tj++) {
+        if (state[ti * ty + tj] != TILE_ACTIVE)
+            continue;
+        t0 = tj;
+        while (tj < (j1 - 2) / ACTIVE_TILE &&
+               state[ti * ty + tj + 1] == TILE_ACTIVE)
+            tj++;
+        a = 1 + t0 * ACTIVE_TILE > j0 ? 1 + t0 * ACTIVE_TILE : j0;
+        b = 1 + (tj + 1) * ACTIVE_TILE < j1 ? 1 + (tj + 1) * ACTIVE_TILE
+                                            : j1;
+        evolve_row(&curr->data[idx(i, a, width)],
+                   &prev->data[idx(i, a, width)], width, b - a, cx, cy);
+        if (measure)
+            measure_row(curr, prev, i, a, b);
+    }
+}
+
+/* First and last row of the row of tiles ti that lie in [i0, i1) */
+static inline void tile_rows(int ti, int i0, int i1, int *r)
+{
+    r[0] = 1 + ti * ACTIVE_TILE > i0 ? 1 + ti * ACTIVE_TILE : i0;
+    r[1] = 1 + (ti + 1) * ACTIVE_TILE < i1 ? 1 + (ti + 1) * ACTIVE_TILE
+                                          : i1;
+}
+
+/* Advance the tiles of the local domain by one step. The points away
+ * from the ghost layers are updated while the halo of prev is
+ * exchanged. */
+void evolve_active(field *curr, field *prev, double a, double dt,
+                   parallel_data *parallel)
+{
+    double cx, cy, *tmp;
+    long updated = 0;
+    int t, ti, i, r[4], check, nx = curr->nx, ny = curr->ny;
+    int lo[2] = {2, 2}, hi[2] = {nx, ny};
+
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    tmp = last;
+    last = change;
+    change = tmp;
+    check = steps++ % ACTIVE_CHECK == 0;
+
+    exchange_init(prev, parallel);
+    #pragma omp parallel for schedule(static) reduction(+:updated)
+    for (t = 0; t < tx * ty; t++)
+        updated += prepare_tile(curr, prev, t / ty, t % ty, check);
+    #pragma omp parallel for schedule(static) private(i, r)
+    for (ti = 0; ti < tx; ti++) {
+        tile_rows(ti, 2, nx, r);
+        for (i = r[0]; i < r[1]; i++)
+            update_runs(curr, prev, cx, cy, i, 2, ny, check);
+    }
+    exchange_finalize(parallel);
+
+    /* Wake up the tiles whose halo changed enough */
+    #pragma omp parallel for schedule(dynamic) private(r) \
+        reduction(+:updated)
+    for (t = 0; t < tx * ty; t++) {
+        if (state[t] == TILE_ACTIVE || !edge_tile(t / ty, t % ty) ||
+            ghost_change(curr, prev, t / ty, t % ty, parallel) < threshold)
+            continue;
+        state[t] = TILE_ACTIVE;
+        change[t] = check ? 0.0 : HUGE_VAL;
+        tile_range(curr, t / ty, t % ty, r);
+        updated += (r[1] - r[0]) * (r[3] - r[2]);
+        update_rect(curr, prev, cx, cy, r, lo, hi, check);
+    }
+
+    /* The rows and the columns next to the ghost layers */
+    update_runs(curr, prev, cx, cy, 1, 1, ny + 1, check);
+    if (nx > 1)
+        update_runs(curr, prev, cx, cy, nx, 1, ny + 1, check);
+    #pragma omp parallel for schedule(static) private(i, r)
+    for (ti = 0; ti < tx; ti++) {
+        tile_rows(ti, 2, nx, r);
+        for (i = r[0]; i < r[1]; i++) {
+            update_runs(curr, prev, cx, cy, i, 1, 2, check);
+            if (ny > 1)
+                update_runs(curr, prev, cx, cy, i, ny, ny + 1, check);
+        }
+    }
+
+    if (check) {
+        for (t = 0; t < tx * ty; t++)
+            if (state[t] == TILE_ACTIVE && change[t] < threshold)
+                state[t] = TILE_FREEZING;
+    }
+    counts[0] = updated;
+    counts[1] = (long) nx * ny - updated;
+    counts[2] += counts[0];
+    counts[3] += counts[1];
+}
+
+/* Fraction of the point updates of all the ranks that was skipped, in
+ * the last step if step or else since the setup */
+double skipped_fraction(int step, parallel_data *parallel)
+{
+    long total[2];
+
+    MPI_Allreduce(step ? &counts[0] : &counts[2], total, 2, MPI_LONG,
+                  MPI_SUM, parallel->comm);
+    if (total[0] + total[1] == 0)
+        return 0.0;
+    return (double) total[1] / (total[0] + total[1]);
+}
@@ -0,0 +1,866 @@
+/* Adaptive mesh refinement for heat equation solver
+ *
+ * With the option -A gradient the field is advanced on two levels. The
+ * coarse level covers the whole domain with every second point of the
+ * grid: for a grid of nx x ny points, both odd, it has (nx - 1) / 2 x
+ * (ny - 1) / 2 points, and the coarse point I coincides with the fine
+ * point 2 I + 1, also for the boundary values at -1 and nx. It is
+ * distributed on the Cartesian grid of the ranks like the distributed
+ * levels of the multigrid solver. The coarse level is divided into patches
+ * of AMR_PATCH x AMR_PATCH points. The patches where the difference of
+ * neighbouring coarse values reaches gradient times the range of the
+ * field, the largest minus the smallest coarse value boundary values
+ * included, and the patches next to them, are refined: they hold the fine
+ * points of their area in fields of the usual layout with one ghost layer.
+ * The gradient is thus a fraction of the range, independent of the
+ * temperature scale, and useful values lie between about 0.01 and 0.1.
+ * With smaller ones all the patches are refined, and with the coarse
+ * level and the transfers between the levels that costs more than the
+ * uniform grid. The refinement pays off when a small share of the field is
+ * refined: with the generated disc on 3201 x 3201 points and 400 steps,
+ * -A 0.02 updates 17% of the points of the uniform grid, runs 1.8 times
+ * faster on one rank and differs from the uniform grid by at most 0.017
+ * (of a range of 80), while from 0.05 on the edge of the disc is left
+ * coarse and the error grows to 0.8. bench/amr.sh measures this.
+ *
+ * A coarse step of AMR_SUBCYCLE dt, stable as the spacing is doubled, is
+ * followed by AMR_SUBCYCLE steps of dt of the patches, shared among the
+ * OpenMP threads. The ghost values of
+ * a patch come from the neighbouring patch where that is refined,
+ * elsewhere they are interpolated bilinearly in space and linearly in time
+ * between the coarse values before and after the coarse step. The coarse
+ * points under the patches then take the fine values; the flux through
+ * the coarse-fine interfaces is not corrected. The patches are flagged
+ * again every AMR_REGRID coarse steps and the refined ones are dealt to
+ * the ranks in equal contiguous shares in row-major order. New patches are
+ * interpolated from the coarse level, the others keep their fine values.
+ *
+ * The values move between the coarse blocks, the patches and the uniform
+ * field in lists of rectangles that every rank derives from the same
+ * global layout, and each list is carried out with one MPI_Alltoallv. For
+ * write_field and the checkpoints the uniform field is interpolated from
+ * the coarse level and the patches are copied over it. With gradient 0
+ * all the patches are refined and the result is that of the uniform grid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+#define AMR_PATCH 16           /* Coarse points per side of a patch */
+#define AMR_SUBCYCLE 4         /* Fine steps per coarse step */
+#define AMR_REGRID 4           /* Coarse steps between the regrids */
+
+/* Refined patch */
+typedef struct {
+    int id;                    /* Index of the patch, row-major */
+    int ci0, ci1, cj0, cj1;    /* Coarse points [ci0, ci1) x [cj0, cj1) */
+    int fi0, fi1, fj0, fj1;    /* Fine points [fi0, fi1) x [fj0, fj1) */
+    field curr, prev;          /* Fine values with one ghost layer */
+    real *cold, *cnew;         /* Coarse points [ci0 - 1, ci1 + 1) x
+                                * [cj0 - 1, cj1 + 1) before and after the
+                                * coarse step */
+} patch;
+
+/* Rectangle of points moved between two ranks */
+typedef struct {
+    int peer;                  /* Rank it is sent to or received from */
+    int slot;                  /* Patch on this rank, -1 for a field */
+    int i0, i1, j0, j1;        /* Global indices at the destination */
+} piece;
+
+/* Pieces moved together. The destination point I takes the source point
+ * scale * I + scale - 1, which is the fine point of the coarse point I
+ * with scale 2. */
+typedef struct {
+    piece *send, *recv;
+    int nsend, nrecv, maxsend, maxrecv;
+    int scale;
+} transfer;
+
+/* Local array with the global indices of its first element */
+typedef struct {
+    real *data;
+    int i0, j0, width;
+} view;
+
+static parallel_data *world;   /* Decomposition of the uniform field */
+static parallel_data cpar;     /* Datatypes of the coarse level */
+static int nb[4];              /* Neighbours up, down, left and right */
+static field *uniform;         /* Field of the output */
+static field coarse, cnext;    /* Coarse level and its next step */
+static int nxf, nyf, nxc, nyc; /* Global fine and coarse dimensions */
+static int npx, npy;           /* Patches in each direction */
+static int *cblock, *fblock;   /* Inner coarse and fine blocks of the
+                                * ranks, i0, i1, j0 and j1 each */
+static int *owner, *slot;      /* Rank and slot of the refined patches,
+                                * -1 for the others */
+static patch *patches, *retired; /* Patches of this rank, the old ones
+                                  * during a regrid */
+static int npatches, nretired;
+static real *ubuf;             /* Coarse values under the uniform block */
+static int ub[4];              /* and their global indices */
+static transfer fetch, ghosts, inject; /* Coarse values of the patches,
+                                        * ghost values from the refined
+                                        * neighbours and fine values of
+                                        * the coarse points */
+static real *tbuf;             /* Send and receive buffers of the
+                                * transfers, kept between them so that
+                                * their pages are not faulted in again */
+static size_t tbuf_size;
+
+static inline int imin(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static inline int imax(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+/* Floor of x / 2 */
+static inline int half(int x)
+{
+    return x >= 0 ? x / 2 : -((1 - x) / 2);
+}
+
+/* Views of the arrays, by the slot of the patch */
+static view coarse_view(int s)
+{
+    view v = {coarse.data, coarse.x0 - 1, coarse.y0 - 1, coarse.ny + 2};
+    return v;
+}
+
+static view uniform_view(int s)
+{
+    int g = uniform->nghost;
+    view v = {uniform->data, uniform->x0 - g, uniform->y0 - g,
+              uniform->pitch};
+    return v;
+}
+
+static view fine_view(int s)
+{
+    patch *p = &patches[s];
+    view v = {p->prev.data, p->fi0 - 1, p->fj0 - 1, p->prev.ny + 2};
+    return v;
+}
+
+static view retired_view(int s)
+{
+    patch *p = &retired[s];
+    view v = {p->prev.data, p->fi0 - 1, p->fj0 - 1, p->prev.ny + 2};
+    return v;
+}
+
+static view cold_view(int s)
+{
+    patch *p = &patches[s];
+    view v = {p->cold, p->ci0 - 1, p->cj0 - 1, p->cj1 - p->cj0 + 2};
+    return v;
+}
+
+static view cnew_view(int s)
+{
+    patch *p = &patches[s];
+    view v = {p->cnew, p->ci0 - 1, p->cj0 - 1, p->cj1 - p->cj0 + 2};
+    return v;
+}
+
+static view ubuf_view(int s)
+{
+    view v = {ubuf, ub[0], ub[2], ub[3] - ub[2]};
+    return v;
+}
+
+/* Coarse and fine points of the patch id, c and f hold i0, i1, j0, j1 */
+static void patch_area(int id, int *c, int *f)
+{
+    c[0] = id / npy * AMR_PATCH;
+    c[1] = imin(c[0] + AMR_PATCH, nxc);
+    c[2] = id % npy * AMR_PATCH;
+    c[3] = imin(c[2] + AMR_PATCH, nyc);
+    f[0] = 2 * c[0];
+    f[1] = c[1] == nxc ? nxf : 2 * c[1];
+    f[2] = 2 * c[2];
+    f[3] = c[3] == nyc ? nyf : 2 * c[3];
+}
+
+/* Block b of n x m points extended by the boundary values on the sides
+ * of the domain */
+static void extend(const int *b, int n, int m, int *e)
+{
+    e[0] = b[0] == 0 ? -1 : b[0];
+    e[1] = b[1] == n ? n + 1 : b[1];
+    e[2] = b[2] == 0 ? -1 : b[2];
+    e[3] = b[3] == m ? m + 1 : b[3];
+}
+
+/* Add the points [i0, i1) x [j0, j1) moved from the slot sslot of rank
+ * src to the slot dslot of rank dst, if this rank is either of them */
+static void add_piece(transfer *t, int src, int sslot, int dst, int dslot,
+                      int i0, int i1, int j0, int j1)
+{
+    piece p = {0, 0, i0, i1, j0, j1};
+
+    if (i0 >= i1 || j0 >= j1)
+        return;
+    if (src == world->rank) {
+        if (t->nsend == t->maxsend) {
+            t->maxsend = 2 * t->maxsend + 16;
+            t->send = realloc(t->send, t->maxsend * sizeof(piece));
+        }
+        p.peer = dst;
+        p.slot = sslot;
+        t->send[t->nsend++] = p;
+    }
+    if (dst == world->rank) {
+        if (t->nrecv == t->maxrecv) {
+            t->maxrecv = 2 * t->maxrecv + 16;
+            t->recv = realloc(t->recv, t->maxrecv * sizeof(piece));
+        }
+        p.peer = src;
+        p.slot = dslot;
+        t->recv[t->nrecv++] = p;
+    }
+}
+
+/* Add the intersection of [i0, i1) x [j0, j1) with the block e */
+static void add_clipped(transfer *t, int src, int sslot, int dst, int dslot,
+                        int i0, int i1, int j0, int j1, const int *e)
+{
+    add_piece(t, src, sslot, dst, dslot, imax(i0, e[0]), imin(i1, e[1]),
+              imax(j0, e[2]), imin(j1, e[3]));
+}
+
+static void transfer_init(transfer *t, int scale)
+{
+    memset(t, 0, sizeof(transfer));
+    t->scale = scale;
+}
+
+static void transfer_free(transfer *t)
+{
+    free(t->send);
+    free(t->recv);
+    transfer_init(t, t->scale);
+}
+
+/* Move the pieces of t from the arrays of src to those of dst. Both ranks
+ * of a piece list it in the same order, so the pieces are packed in the
+ * order of the list for each peer. The pieces within this rank are in
+ * the same order in both lists and are copied directly. */
+static void run_transfer(transfer *t, view (*src)(int), view (*dst)(int))
+{
+    int size = world->size, rank = world->rank;
+    int *counts, *sdispl, *rcount, *rdispl, *offset;
+    int k, r, i, j, s, total;
+    real *sbuf, *rbuf;
+    piece *p;
+    view v, w;
+
+    counts = calloc(5 * size, sizeof(int));
+    sdispl = counts + size;
+    rcount = counts + 2 * size;
+    rdispl = counts + 3 * size;
+    offset = counts + 4 * size;
+    s = t->scale;
+
+    for (k = 0, r = 0; k < t->nsend; k++) {
+        p = &t->send[k];
+        if (p->peer != rank) {
+            counts[p->peer] += (p->i1 - p->i0) * (p->j1 - p->j0);
+            continue;
+        }
+        while (t->recv[r].peer != rank)
+            r++;
+        v = src(p->slot);
+        w = dst(t->recv[r++].slot);
+        for (i = p->i0; i < p->i1; i++)
+            for (j = p->j0; j < p->j1; j++)
+                w.data[idx(i - w.i0, j - w.j0, w.width)] =
+                    v.data[idx(s * i + s - 1 - v.i0, s * j + s - 1 - v.j0,
+                               v.width)];
+    }
+    for (k = 0; k < t->nrecv; k++) {
+        p = &t->recv[k];
+        if (p->peer != rank)
+            rcount[p->peer] += (p->i1 - p->i0) * (p->j1 - p->j0);
+    }
+    for (k = 1; k < size; k++) {
+        sdispl[k] = sdispl[k - 1] + counts[k - 1];
+        rdispl[k] = rdispl[k - 1] + rcount[k - 1];
+    }
+    total = sdispl[size - 1] + counts[size - 1];
+    k = rdispl[size - 1] + rcount[size - 1];
+    if ((size_t) total + k > tbuf_size) {
+        free(tbuf);
+        tbuf_size = (size_t) total + k;
+        tbuf = malloc(tbuf_size * sizeof(real));
+    }
+    sbuf = tbuf;
+    rbuf = tbuf + total;
+
+    memcpy(offset, sdispl, size * sizeof(int));
+    for (k = 0; k < t->nsend; k++) {
+        p = &t->send[k];
+        if (p->peer == rank)
+            continue;
+        v = src(p->slot);
+        for (i = p->i0; i < p->i1; i++)
+            for (j = p->j0; j < p->j1; j++)
+                sbuf[offset[p->peer]++] =
+                    v.data[idx(s * i + s - 1 - v.i0, s * j + s - 1 - v.j0,
+                               v.width)];
+    }
+    MPI_Alltoallv(sbuf, counts, sdispl, HEAT_MPI_REAL, rbuf, rcount, rdispl,
+                  HEAT_MPI_REAL, world->comm);
+    memcpy(offset, rdispl, size * sizeof(int));
+    for (k = 0; k < t->nrecv; k++) {
+        p = &t->recv[k];
+        if (p->peer == rank)
+            continue;
+        v = dst(p->slot);
+        for (i = p->i0; i < p->i1; i++)
+            for (j = p->j0; j < p->j1; j++)
+                v.data[idx(i - v.i0, j - v.j0, v.width)] =
+                    rbuf[offset[p->peer]++];
+    }
+    free(counts);
+}
+
+/* Value at the fine point i, j interpolated from the coarse points in v.
+ * The corners of the boundary values are not part of the problem and are
+ * left out. */
+static double prolong(view v, int i, int j)
+{
+    int ci[2] = {half(i - 1), half(i)}, cj[2] = {half(j - 1), half(j)};
+    int a, b, n = 0;
+    double sum = 0.0;
+
+    for (a = 0; a < (ci[0] == ci[1] ? 1 : 2); a++) {
+        for (b = 0; b < (cj[0] == cj[1] ? 1 : 2); b++) {
+            if ((ci[a] < 0 || ci[a] >= nxc) && (cj[b] < 0 || cj[b] >= nyc))
+                continue;
+            sum += v.data[idx(ci[a] - v.i0, cj[b] - v.j0, v.width)];
+            n++;
+        }
+    }
+    return sum / n;
+}
+
+/* Ghost values of the patch on the sides without a refined neighbour,
+ * at the fraction w of the coarse step */
+static void coarse_ghosts(patch *p, double w)
+{
+    int i, j, width, pi, pj;
+    view vo = cold_view(p - patches), vn = cnew_view(p - patches);
+    real *d = p->prev.data;
+
+    width = p->prev.ny + 2;
+    pi = p->id / npy;
+    pj = p->id % npy;
+    if (pi == 0 || owner[p->id - npy] < 0) {
+        for (j = p->fj0; j < p->fj1; j++)
+            d[idx(0, j - p->fj0 + 1, width)] =
+                (1.0 - w) * prolong(vo, p->fi0 - 1, j) +
+                w * prolong(vn, p->fi0 - 1, j);
+    }
+    if (pi == npx - 1 || owner[p->id + npy] < 0) {
+        for (j = p->fj0; j < p->fj1; j++)
+            d[idx(p->prev.nx + 1, j - p->fj0 + 1, width)] =
+                (1.0 - w) * prolong(vo, p->fi1, j) +
+                w * prolong(vn, p->fi1, j);
+    }
+    if (pj == 0 || owner[p->id - 1] < 0) {
+        for (i = p->fi0; i < p->fi1; i++)
+            d[idx(i - p->fi0 + 1, 0, width)] =
+                (1.0 - w) * prolong(vo, i, p->fj0 - 1) +
+                w * prolong(vn, i, p->fj0 - 1);
+    }
+    if (pj == npy - 1 || owner[p->id + 1] < 0) {
+        for (i = p->fi0; i < p->fi1; i++)
+            d[idx(i - p->fi0 + 1, p->prev.ny + 1, width)] =
+                (1.0 - w) * prolong(vo, i, p->fj1) +
+                w * prolong(vn, i, p->fj1);
+    }
+}
+
+/* Advance the patch by one step with the coefficients cx and cy. The
+ * rows are updated whole, without the parallel regions of
+ * evolve_interior and evolve_edges, which cost more than the update of a
+ * patch; the threads share the patches instead. */
+static void evolve_patch(patch *p, double cx, double cy)
+{
+    int i, width = p->prev.pitch;
+
+    for (i = 1; i <= p->prev.nx; i++)
+        evolve_row(&p->curr.data[idx(i, 1, width)],
+                   &p->prev.data[idx(i, 1, width)], width, p->prev.ny, cx,
+                   cy);
+    swap_fields(&p->curr, &p->prev);
+}
+
+/* Allocate the fields of the patch id */
+static void patch_alloc(patch *p, int id)
+{
+    int c[4], f[4], n;
+
+    patch_area(id, c, f);
+    p->id = id;
+    p->ci0 = c[0];
+    p->ci1 = c[1];
+    p->cj0 = c[2];
+    p->cj1 = c[3];
+    p->fi0 = f[0];
+    p->fi1 = f[1];
+    p->fj0 = f[2];
+    p->fj1 = f[3];
+    p->prev.nx = p->curr.nx = f[1] - f[0];
+    p->prev.ny = p->curr.ny = f[3] - f[2];
+    p->prev.nghost = p->curr.nghost = 1;
+    p->prev.pitch = p->curr.pitch = p->prev.ny + 2;
+    p->prev.dx = p->curr.dx = uniform->dx;
+    p->prev.dy = p->curr.dy = uniform->dy;
+    n = (p->prev.nx + 2) * (p->prev.ny + 2);
+    p->prev.data = malloc_2d(p->prev.nx + 2, p->prev.ny + 2);
+    p->curr.data = malloc_2d(p->curr.nx + 2, p->curr.ny + 2);
+    memset(p->prev.data, 0, n * sizeof(real));
+    memset(p->curr.data, 0, n * sizeof(real));
+    n = (c[1] - c[0] + 2) * (c[3] - c[2] + 2);
+    p->cold = malloc(n * sizeof(real));
+    p->cnew = malloc(n * sizeof(real));
+}
+
+static void patches_free(patch *list, int n)
+{
+    int k;
+
+    for (k = 0; k < n; k++) {
+        free_2d(list[k].prev.data);
+        free_2d(list[k].curr.data);
+        free(list[k].cold);
+        free(list[k].cnew);
+    }
+    free(list);
+}
+
+/* Coarse values of the patches, with one ghost layer, from the owners of
+ * the coarse blocks */
+static void add_fetch(transfer *t)
+{
+    int id, q, c[4], f[4], e[4];
+
+    for (id = 0; id < npx * npy; id++) {
+        if (owner[id] < 0)
+            continue;
+        patch_area(id, c, f);
+        for (q = 0; q < world->size; q++) {
+            extend(&cblock[4 * q], nxc, nyc, e);
+            add_clipped(t, q, -1, owner[id], slot[id], c[0] - 1, c[1] + 1,
+                        c[2] - 1, c[3] + 1, e);
+        }
+    }
+}
+
+/* Lists of the steps for the current patches */
+static void build_lists(void)
+{
+    int id, q, c[4], f[4];
+
+    transfer_free(&fetch);
+    transfer_free(&ghosts);
+    transfer_free(&inject);
+    add_fetch(&fetch);
+    for (id = 0; id < npx * npy; id++) {
+        if (owner[id] < 0)
+            continue;
+        patch_area(id, c, f);
+        /* Ghost rows and columns from the refined neighbours */
+        if (id / npy > 0 && owner[id - npy] >= 0)
+            add_piece(&ghosts, owner[id - npy], slot[id - npy], owner[id],
+                      slot[id], f[0] - 1, f[0], f[2], f[3]);
+        if (id / npy < npx - 1 && owner[id + npy] >= 0)
+            add_piece(&ghosts, owner[id + npy], slot[id + npy], owner[id],
+                      slot[id], f[1], f[1] + 1, f[2], f[3]);
+        if (id % npy > 0 && owner[id - 1] >= 0)
+            add_piece(&ghosts, owner[id - 1], slot[id - 1], owner[id],
+                      slot[id], f[0], f[1], f[2] - 1, f[2]);
+        if (id % npy < npy - 1 && owner[id + 1] >= 0)
+            add_piece(&ghosts, owner[id + 1], slot[id + 1], owner[id],
+                      slot[id], f[0], f[1], f[3], f[3] + 1);
+        /* Fine values of the coarse points under the patch */
+        for (q = 0; q < world->size; q++)
+            add_clipped(&inject, owner[id], slot[id], q, -1, c[0], c[1],
+                        c[2], c[3], &cblock[4 * q]);
+    }
+}
+
+/* Flag the patches with the coarse level and redistribute them. The first
+ * time the patches take the values of the uniform field. Returns the
+ * number of refined fine points. */
+static long regrid(double gradient, int first)
+{
+    int np = npx * npy;
+    int *flag, *old_owner, *old_slot;
+    int i, j, id, k, nref, pi, pj, di, dj, width;
+    long points = 0;
+    double *grad, d, range[2] = {-HUGE_VAL, -HUGE_VAL};
+    real *u = coarse.data;
+    transfer t;
+    patch *p;
+    view v;
+
+    /* Largest difference of neighbouring values on each patch, and the
+     * range of the field as the largest value and the negated smallest
+     * one */
+    exchange_post(&coarse, &cpar, nb);
+    MPI_Waitall(8, cpar.requests, MPI_STATUSES_IGNORE);
+    grad = calloc(np, sizeof(double));
+    width = coarse.pitch;
+    for (i = 0; i <= coarse.nx + 1; i++) {
+        for (j = 0; j <= coarse.ny + 1; j++) {
+            range[0] = fmax(range[0], u[idx(i, j, width)]);
+            range[1] = fmax(range[1], -u[idx(i, j, width)]);
+        }
+    }
+    for (i = 1; i <= coarse.nx; i++) {
+        for (j = 1; j <= coarse.ny; j++) {
+            d = fmax(fabs(u[idx(i + 1, j, width)] - u[idx(i, j, width)]),
+                     fabs(u[idx(i, j, width)] - u[idx(i - 1, j, width)]));
+            d = fmax(d, fmax(fabs(u[idx(i, j + 1, width)] -
+                                  u[idx(i, j, width)]),
+                             fabs(u[idx(i, j, width)] -
+                                  u[idx(i, j - 1, width)])));
+            id = (coarse.x0 + i - 1) / AMR_PATCH * npy +
+                 (coarse.y0 + j - 1) / AMR_PATCH;
+            grad[id] = fmax(grad[id], d);
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, grad, np, MPI_DOUBLE, MPI_MAX, world->comm);
+    MPI_Allreduce(MPI_IN_PLACE, range, 2, MPI_DOUBLE, MPI_MAX, world->comm);
+
+    /* Refine the flagged patches and their neighbours */
+    flag = calloc(np, sizeof(int));
+    for (id = 0; id < np; id++) {
+        if (grad[id] < gradient * (range[0] + range[1]))
+            continue;
+        pi = id / npy;
+        pj = id % npy;
+        for (di = imax(pi - 1, 0); di <= imin(pi + 1, npx - 1); di++)
+            for (dj = imax(pj - 1, 0); dj <= imin(pj + 1, npy - 1); dj++)
+                flag[di * npy + dj] = 1;
+    }
+    nref = 0;
+    for (id = 0; id < np; id++)
+        nref += flag[id];
+
+    /* Equal contiguous shares of the refined patches */
+    old_owner = owner;
+    old_slot = slot;
+    owner = malloc(2 * np * sizeof(int));
+    slot = owner + np;
+    retired = patches;
+    nretired = npatches;
+    patches = malloc((nref / world->size + 1) * sizeof(patch));
+    npatches = 0;
+    k = 0;
+    for (id = 0; id < np; id++) {
+        owner[id] = slot[id] = -1;
+        if (!flag[id])
+            continue;
+        owner[id] = (int) ((long) k * world->size / nref);
+        slot[id] = k - (int) (((long) owner[id] * nref + world->size - 1) /
+                              world->size);
+        k++;
+        if (owner[id] == world->rank)
+            patch_alloc(&patches[npatches++], id);
+    }
+    for (k = 0; k < npatches; k++)
+        points += (long) patches[k].prev.nx * patches[k].prev.ny;
+    MPI_Allreduce(MPI_IN_PLACE, &points, 1, MPI_LONG, MPI_SUM, world->comm);
+
+    transfer_init(&t, 1);
+    if (first) {
+        /* Values of the uniform field */
+        int c[4], f[4];
+        for (id = 0; id < np; id++) {
+            if (owner[id] < 0)
+                continue;
+            patch_area(id, c, f);
+            for (k = 0; k < world->size; k++)
+                add_clipped(&t, k, -1, owner[id], slot[id], f[0], f[1],
+                            f[2], f[3], &fblock[4 * k]);
+        }
+        run_transfer(&t, uniform_view, fine_view);
+    } else {
+        /* Interpolate the new patches from the coarse level, and move the
+         * values of those that were refined already */
+        add_fetch(&t);
+        run_transfer(&t, coarse_view, cnew_view);
+        transfer_free(&t);
+        #pragma omp parallel for private(p, v, i, j, width) \
+            schedule(dynamic)
+        for (k = 0; k < npatches; k++) {
+            p = &patches[k];
+            if (old_owner[p->id] >= 0)
+                continue;
+            v = cnew_view(k);
+            width = p->prev.pitch;
+            for (i = p->fi0; i < p->fi1; i++)
+                for (j = p->fj0; j < p->fj1; j++)
+                    p->prev.data[idx(i - p->fi0 + 1, j - p->fj0 + 1,
+                                     width)] = prolong(v, i, j);
+        }
+        for (id = 0; id < np; id++) {
+            int c[4], f[4];
+            if (owner[id] < 0 || old_owner[id] < 0)
+                continue;
+            patch_area(id, c, f);
+            add_piece(&t, old_owner[id], old_slot[id], owner[id], slot[id],
+                      f[0], f[1], f[2], f[3]);
+        }
+        run_transfer(&t, retired_view, fine_view);
+    }
+    transfer_free(&t);
+    patches_free(retired, nretired);
+    retired = NULL;
+    nretired = 0;
+    free(old_owner);
+    free(flag);
+    free(grad);
+
+    build_lists();
+    return points;
+}
+
+/* Set up the coarse level with the values of the uniform field at its
+ * points */
+static void amr_setup(field *temperature, parallel_data *parallel)
+{
+    int dims[2], periods[2], coords[2], q, k, width;
+    int e[4], fe[4];
+    transfer t;
+
+    world = parallel;
+    uniform = temperature;
+    nxf = temperature->nx_full;
+    nyf = temperature->ny_full;
+    nxc = (nxf - 1) / 2;
+    nyc = (nyf - 1) / 2;
+    npx = (nxc + AMR_PATCH - 1) / AMR_PATCH;
+    npy = (nyc + AMR_PATCH - 1) / AMR_PATCH;
+    MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
+    if (nxf % 2 == 0 || nyf % 2 == 0 || nxc < dims[0] || nyc < dims[1]) {
+        if (parallel->rank == 0)
+            printf("Adaptive mesh refinement needs odd dimensions and at "
+                   "least one coarse point per rank\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    /* Blocks of all the ranks */
+    cblock = malloc(8 * parallel->size * sizeof(int));
+    fblock = cblock + 4 * parallel->size;
+    for (q = 0; q < parallel->size; q++) {
+        MPI_Cart_coords(parallel->comm, q, 2, coords);
+        cblock[4 * q] = block_start(nxc, dims[0], coords[0]);
+        cblock[4 * q + 1] = block_start(nxc, dims[0], coords[0] + 1);
+        cblock[4 * q + 2] = block_start(nyc, dims[1], coords[1]);
+        cblock[4 * q + 3] = block_start(nyc, dims[1], coords[1] + 1);
+        fblock[4 * q] = parallel->cuts[0][coords[0]];
+        fblock[4 * q + 1] = parallel->cuts[0][coords[0] + 1];
+        fblock[4 * q + 2] = parallel->cuts[1][coords[1]];
+        fblock[4 * q + 3] = parallel->cuts[1][coords[1] + 1];
+    }
+
+    /* Coarse level with the datatypes of its blocks */
+    k = 4 * parallel->rank;
+    coarse.x0 = cblock[k];
+    coarse.y0 = cblock[k + 2];
+    coarse.nx = cblock[k + 1] - cblock[k];
+    coarse.ny = cblock[k + 3] - cblock[k + 2];
+    coarse.nx_full = nxc;
+    coarse.ny_full = nyc;
+    coarse.nghost = 1;
+    coarse.pitch = coarse.ny + 2;
+    coarse.dx = 2.0 * temperature->dx;
+    coarse.dy = 2.0 * temperature->dy;
+    cnext = coarse;
+    width = coarse.ny + 2;
+    coarse.data = malloc_2d(coarse.nx + 2, width);
+    cnext.data = malloc_2d(coarse.nx + 2, width);
+    cpar = *parallel;
+    MPI_Type_vector(coarse.nx + 2, 1, width, HEAT_MPI_REAL,
+                    &cpar.columntype);
+    MPI_Type_contiguous(width, HEAT_MPI_REAL, &cpar.rowtype);
+    MPI_Type_commit(&cpar.columntype);
+    MPI_Type_commit(&cpar.rowtype);
+    nb[0] = parallel->nup;
+    nb[1] = parallel->ndown;
+    nb[2] = parallel->nleft;
+    nb[3] = parallel->nright;
+
+    /* Values at the coarse points, with the boundary values */
+    transfer_init(&t, 2);
+    for (q = 0; q < parallel->size; q++) {
+        extend(&cblock[4 * q], nxc, nyc, e);
+        for (k = 0; k < parallel->size; k++) {
+            extend(&fblock[4 * k], nxf, nyf, fe);
+            add_piece(&t, k, -1, q, -1, imax(e[0], half(fe[0])),
+                      imin(e[1], half(fe[1])), imax(e[2], half(fe[2])),
+                      imin(e[3], half(fe[3])));
+        }
+    }
+    run_transfer(&t, uniform_view, coarse_view);
+    transfer_free(&t);
+    memcpy(cnext.data, coarse.data,
+           (size_t) (coarse.nx + 2) * width * sizeof(real));
+
+    /* Coarse values under the uniform block */
+    ub[0] = half(temperature->x0 - 1);
+    ub[1] = half(temperature->x0 + temperature->nx - 1) + 1;
+    ub[2] = half(temperature->y0 - 1);
+    ub[3] = half(temperature->y0 + temperature->ny - 1) + 1;
+    ubuf = malloc((size_t) (ub[1] - ub[0]) * (ub[3] - ub[2]) *
+                  sizeof(real));
+
+    owner = malloc(2 * npx * npy * sizeof(int));
+    slot = owner + npx * npy;
+    for (k = 0; k < npx * npy; k++)
+        owner[k] = slot[k] = -1;
+    patches = NULL;
+    npatches = 0;
+    transfer_init(&fetch, 1);
+    transfer_init(&ghosts, 1);
+    transfer_init(&inject, 2);
+}
+
+static void amr_free(void)
+{
+    patches_free(patches, npatches);
+    transfer_free(&fetch);
+    transfer_free(&ghosts);
+    transfer_free(&inject);
+    free_2d(coarse.data);
+    free_2d(cnext.data);
+    MPI_Type_free(&cpar.rowtype);
+    MPI_Type_free(&cpar.columntype);
+    free(ubuf);
+    free(owner);
+    free(cblock);
+    free(tbuf);
+    tbuf = NULL;
+    tbuf_size = 0;
+}
+
+/* Interpolate the uniform field from the coarse level and copy the
+ * patches over it */
+static void resample(void)
+{
+    int q, r, i, j, e[4], b[4], c[4], f[4], id, g, width;
+    transfer t;
+
+    transfer_init(&t, 1);
+    for (r = 0; r < world->size; r++) {
+        b[0] = half(fblock[4 * r] - 1);
+        b[1] = half(fblock[4 * r + 1] - 1) + 1;
+        b[2] = half(fblock[4 * r + 2] - 1);
+        b[3] = half(fblock[4 * r + 3] - 1) + 1;
+        for (q = 0; q < world->size; q++) {
+            extend(&cblock[4 * q], nxc, nyc, e);
+            add_clipped(&t, q, -1, r, -1, b[0], b[1], b[2], b[3], e);
+        }
+    }
+    run_transfer(&t, coarse_view, ubuf_view);
+    transfer_free(&t);
+
+    g = uniform->nghost;
+    width = uniform->pitch;
+    for (i = 0; i < uniform->nx; i++)
+        for (j = 0; j < uniform->ny; j++)
+            uniform->data[idx(i + g, j + g, width)] =
+                prolong(ubuf_view(-1), uniform->x0 + i, uniform->y0 + j);
+
+    for (id = 0; id < npx * npy; id++) {
+        if (owner[id] < 0)
+            continue;
+        patch_area(id, c, f);
+        for (r = 0; r < world->size; r++)
+            add_clipped(&t, owner[id], slot[id], r, -1, f[0], f[1], f[2],
+                        f[3], &fblock[4 * r]);
+    }
+    run_transfer(&t, fine_view, uniform_view);
+    transfer_free(&t);
+}
+
+/* Advance the field temperature by nsteps steps of dt, rounded up to a
+ * multiple of AMR_SUBCYCLE, with the patches refined above gradient. The
+ * images and the checkpoints are written after the coarse steps in which
+ * the steps from iter0 on reach their intervals. Returns the number of
+ * steps. */
+int evolve_amr(field *temperature, double a, double dt, int nsteps,
+               double gradient, int iter0, int image_interval,
+               int restart_interval, parallel_data *parallel)
+{
+    int n, s, k, iter, ncoarse;
+    long points = 0, work = 0;
+    double cx, cy;
+    patch *p;
+
+    cx = a * dt / (temperature->dx * temperature->dx);
+    cy = a * dt / (temperature->dy * temperature->dy);
+    amr_setup(temperature, parallel);
+    ncoarse = (nsteps + AMR_SUBCYCLE - 1) / AMR_SUBCYCLE;
+    for (n = 0; n < ncoarse; n++) {
+        if (n % AMR_REGRID == 0) {
+            points = regrid(gradient, n == 0);
+        }
+        work += (long) nxc * nyc + AMR_SUBCYCLE * points;
+
+        /* Coarse step */
+        run_transfer(&fetch, coarse_view, cold_view);
+        exchange_post(&coarse, &cpar, nb);
+        evolve_interior(&cnext, &coarse, a, AMR_SUBCYCLE * dt);
+        MPI_Waitall(8, cpar.requests, MPI_STATUSES_IGNORE);
+        evolve_edges(&cnext, &coarse, a, AMR_SUBCYCLE * dt);
+        swap_fields(&cnext, &coarse);
+        run_transfer(&fetch, coarse_view, cnew_view);
+
+        /* Fine steps of the patches */
+        for (s = 0; s < AMR_SUBCYCLE; s++) {
+            run_transfer(&ghosts, fine_view, fine_view);
+            #pragma omp parallel for private(p) schedule(dynamic)
+            for (k = 0; k < npatches; k++) {
+                p = &patches[k];
+                coarse_ghosts(p, (double) s / AMR_SUBCYCLE);
+                evolve_patch(p, cx, cy);
+            }
+        }
+        run_transfer(&inject, fine_view, coarse_view);
+
+        iter = iter0 + AMR_SUBCYCLE * (n + 1) - 1;
+        if (iter / image_interval >
+            (iter - AMR_SUBCYCLE) / image_interval ||
+            iter / restart_interval >
+            (iter - AMR_SUBCYCLE) / restart_interval)
+            resample();
+        if (iter / image_interval > (iter - AMR_SUBCYCLE) / image_interval)
+            write_field(temperature, iter, parallel);
+        if (iter / restart_interval >
+            (iter - AMR_SUBCYCLE) / restart_interval)
+            write_restart(temperature, parallel, iter);
+    }
+    resample();
+
+    if (parallel->rank == 0 && ncoarse > 0)
+        printf("Adaptive mesh refinement updated %.1f%% of the points of "
+               "the uniform grid\n", 100.0 * work /
+               ((double) ncoarse * AMR_SUBCYCLE * nxf * nyf));
+    amr_free();
+    return AMR_SUBCYCLE * ncoarse;
+}
@@ -0,0 +1,237 @@
+/* Measured load balancing for heat equation solver
+ *
+ * With the option -b steps every rank times its updates of the field,
+ * evolve_interior and evolve_edges, and after every window of steps the
+ * times are gathered. When the busiest rank exceeds the mean by more than
+ * the ratio given with -r, the cuts between the rows and the columns of
+ * ranks are moved so that the ranks get points in proportion to their
+ * measured speed. On the Cartesian grid a cut is shared by a whole row
+ * (column) of ranks, so the heights of the rows of ranks are chosen first,
+ * with the columns as they are, from the slowest rank of each row, and
+ * then the widths of the columns with the new heights.
+ *
+ * The field moves to the new blocks with one MPI_Alltoallw in which only
+ * the ranks whose old and new blocks overlap, the neighbours unless the
+ * cuts move by more than a block, exchange slabs. The datatypes of the
+ * halo exchange and of the I/O and the state of the halo engine are then
+ * rebuilt for the new local dimensions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Cut n points into parts in proportion to weight, each part with at
+ * least g points */
+static void proportional_cuts(int *cuts, const double *weight, int parts,
+                              int n, int g)
+{
+    double total = 0.0, sum = 0.0;
+    int k;
+
+    for (k = 0; k < parts; k++)
+        total += weight[k];
+    cuts[0] = 0;
+    for (k = 1; k < parts; k++) {
+        sum += weight[k - 1];
+        cuts[k] = (int) floor(n * sum / total + 0.5);
+    }
+    cuts[parts] = n;
+    for (k = 1; k < parts; k++) {
+        if (cuts[k] < cuts[k - 1] + g)
+            cuts[k] = cuts[k - 1] + g;
+    }
+    for (k = parts - 1; k > 0; k--) {
+        if (cuts[k] > cuts[k + 1] - g)
+            cuts[k] = cuts[k + 1] - g;
+    }
+}
+
+/* Rows [b[0], b[1]) and columns [b[2], b[3]) of the block of the rank at
+ * coords between the cuts, and in e the same extended by the boundary
+ * values on the sides of the domain */
+static void block_of(int *const cuts[2], const int *dims, const int *coords,
+                     int *b, int *e)
+{
+    int d;
+
+    for (d = 0; d < 2; d++) {
+        b[2 * d] = cuts[d][coords[d]];
+        b[2 * d + 1] = cuts[d][coords[d] + 1];
+        e[2 * d] = b[2 * d] - (coords[d] == 0);
+        e[2 * d + 1] = b[2 * d + 1] + (coords[d] == dims[d] - 1);
+    }
+}
+
+/* Datatype of the intersection of the extended blocks a and b in the
+ * local array of the block own with g ghost layers and rows pitch values
+ * apart, or MPI_DATATYPE_NULL if they do not overlap */
+static MPI_Datatype overlap_type(const int *own, const int *a, const int *b,
+                                 int g, int pitch)
+{
+    MPI_Datatype type = MPI_DATATYPE_NULL;
+    int sizes[2], subsizes[2], starts[2], d, lo, hi;
+
+    for (d = 0; d < 2; d++) {
+        lo = a[2 * d] > b[2 * d] ? a[2 * d] : b[2 * d];
+        hi = a[2 * d + 1] < b[2 * d + 1] ? a[2 * d + 1] : b[2 * d + 1];
+        if (lo >= hi)
+            return type;
+        sizes[d] = d ? pitch : own[1] - own[0] + 2 * g;
+        subsizes[d] = hi - lo;
+        starts[d] = lo - own[2 * d] + g;
+    }
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+                             HEAT_MPI_REAL, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/* Check the balance of the busy times of the ranks over the last window,
+ * and if the busiest rank exceeds the mean by more than ratio move the
+ * blocks. current and previous are reallocated with the new dimensions,
+ * both with the values of previous. Returns 1 if the blocks were moved. */
+int rebalance(field *current, field *previous, double busy, double ratio,
+              parallel_data *parallel)
+{
+    int dims[2], periods[2], coords[2], nbcoords[2];
+    int oldb[4], newb[4], olde[4], newe[4], nbold[4], nbnew[4], b[4];
+    int *newcuts[2], *counts, *displs;
+    int p, q, k, g, nx, ny, width, moved;
+    double *times, *speed, *weight, mean = 0.0, worst = 0.0, rate;
+    MPI_Datatype *types;
+    real *data;
+
+    MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
+    times = malloc(2 * parallel->size * sizeof(double));
+    speed = times + parallel->size;
+    MPI_Allgather(&busy, 1, MPI_DOUBLE, times, 1, MPI_DOUBLE,
+                  parallel->comm);
+    for (k = 0; k < parallel->size; k++) {
+        mean += times[k] / parallel->size;
+        worst = fmax(worst, times[k]);
+    }
+    if (worst <= ratio * mean || mean <= 0.0) {
+        free(times);
+        return 0;
+    }
+
+    /* Points per second of each rank */
+    for (k = 0; k < parallel->size; k++) {
+        MPI_Cart_coords(parallel->comm, k, 2, nbcoords);
+        speed[k] = (double) (parallel->cuts[0][nbcoords[0] + 1] -
+                             parallel->cuts[0][nbcoords[0]]) *
+                   (parallel->cuts[1][nbcoords[1] + 1] -
+                    parallel->cuts[1][nbcoords[1]]) /
+                   fmax(times[k], 1.0e-9);
+    }
+
+    /* Heights of the rows of ranks with the present widths, then widths
+     * of the columns with the new heights */
+    g = parallel->halo_depth * stencil_radius();
+    nx = current->nx_full;
+    ny = current->ny_full;
+    newcuts[0] = malloc((dims[0] + dims[1] + 2) * sizeof(int));
+    newcuts[1] = newcuts[0] + dims[0] + 1;
+    weight = malloc((dims[0] + dims[1]) * sizeof(double));
+    for (p = 0; p < dims[0]; p++) {
+        weight[p] = HUGE_VAL;
+        for (q = 0; q < dims[1]; q++) {
+            nbcoords[0] = p;
+            nbcoords[1] = q;
+            MPI_Cart_rank(parallel->comm, nbcoords, &k);
+            rate = speed[k] / (parallel->cuts[1][q + 1] -
+                               parallel->cuts[1][q]);
+            weight[p] = fmin(weight[p], rate);
+        }
+    }
+    proportional_cuts(newcuts[0], weight, dims[0], nx, g);
+    for (q = 0; q < dims[1]; q++) {
+        weight[q] = HUGE_VAL;
+        for (p = 0; p < dims[0]; p++) {
+            nbcoords[0] = p;
+            nbcoords[1] = q;
+            MPI_Cart_rank(parallel->comm, nbcoords, &k);
+            rate = speed[k] / (newcuts[0][p + 1] - newcuts[0][p]);
+            weight[q] = fmin(weight[q], rate);
+        }
+    }
+    proportional_cuts(newcuts[1], weight, dims[1], ny, g);
+    free(weight);
+    moved = memcmp(newcuts[0], parallel->cuts[0],
+                   (dims[0] + dims[1] + 2) * sizeof(int)) != 0;
+    if (!moved) {
+        free(newcuts[0]);
+        free(times);
+        return 0;
+    }
+
+    /* Move the values of previous, boundary values included, from the
+     * old blocks to the new ones */
+    block_of(parallel->cuts, dims, coords, oldb, olde);
+    block_of(newcuts, dims, coords, newb, newe);
+    width = newb[3] - newb[2] + 2 * g;
+    data = malloc_2d(newb[1] - newb[0] + 2 * g, width);
+    counts = calloc(4 * parallel->size, sizeof(int));
+    displs = counts + 2 * parallel->size;
+    types = malloc(2 * parallel->size * sizeof(MPI_Datatype));
+    for (k = 0; k < parallel->size; k++) {
+        MPI_Cart_coords(parallel->comm, k, 2, nbcoords);
+        block_of(parallel->cuts, dims, nbcoords, b, nbold);
+        block_of(newcuts, dims, nbcoords, b, nbnew);
+        types[k] = overlap_type(oldb, olde, nbnew, g, previous->pitch);
+        types[parallel->size + k] = overlap_type(newb, newe, nbold, g, width);
+        counts[k] = types[k] != MPI_DATATYPE_NULL;
+        counts[parallel->size + k] =
+            types[parallel->size + k] != MPI_DATATYPE_NULL;
+        if (!counts[k])
+            types[k] = HEAT_MPI_REAL;
+        if (!counts[parallel->size + k])
+            types[parallel->size + k] = HEAT_MPI_REAL;
+    }
+    MPI_Alltoallw(previous->data, counts, displs, types, data,
+                  &counts[parallel->size], &displs[parallel->size],
+                  &types[parallel->size], parallel->comm);
+    for (k = 0; k < 2 * parallel->size; k++) {
+        if (counts[k])
+            MPI_Type_free(&types[k]);
+    }
+    free(types);
+    free(counts);
+
+    /* Rebuild the fields, the datatypes and the halo engine for the new
+     * blocks */
+    deallocate_field(current);
+    deallocate_field(previous);
+    free_datatypes(parallel);
+    halo_free();
+    memcpy(parallel->cuts[0], newcuts[0],
+           (dims[0] + dims[1] + 2) * sizeof(int));
+    free(newcuts[0]);
+    parallel_datatypes(parallel, nx, ny);
+    halo_setup(parallel);
+    set_field_dimensions(current, nx, ny, parallel);
+    set_field_dimensions(previous, nx, ny, parallel);
+    allocate_field(previous);
+    allocate_field(current);
+    for (p = 0; p < previous->nx + 2 * g; p++)
+        memcpy(&previous->data[idx(p, 0, previous->pitch)],
+               &data[idx(p, 0, width)], width * sizeof(real));
+    copy_field(previous, current);
+    free_2d(data);
+
+    if (parallel->rank == 0) {
+        printf("Load imbalance %.2f, rows of ranks moved to", worst / mean);
+        for (p = 0; p < dims[0]; p++)
+            printf(" %d", parallel->cuts[0][p + 1] - parallel->cuts[0][p]);
+        printf(" and columns to");
+        for (q = 0; q < dims[1]; q++)
+            printf(" %d", parallel->cuts[1][q + 1] - parallel->cuts[1][q]);
+        printf(" points\n");
+    }
+    free(times);
+    return 1;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Work, time and accuracy of the adaptive mesh refinement: runs the same
+# case on the uniform grid and with -A for several gradients, and prints
+# the share of the point updates of the uniform grid, the time, the
+# speedup and the largest difference of a point of the final field from
+# the uniform one, read from the checkpoints. The size has to be odd.
+#
+# Usage: bench/amr.sh [ranks] [steps] [size] [gradients...]
+
+NP=${1:-4}
+NSTEPS=${2:-400}
+N=${3:-3201}
+GRADIENTS=${*:4}
+GRADIENTS=${GRADIENTS:-"0.01 0.02 0.05 0.1"}
+MPIRUN=${MPIRUN:-mpirun}
+EXE=$(cd "$(dirname "$0")/.." && pwd)/heat_mpi
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH"
+
+# Values of a checkpoint, one per line, after the three integers of the
+# header
+values() {
+    od -A n -j 12 -t f8 -v "$1" | tr -s ' ' '\n' | grep -v '^$'
+}
+
+printf "%10s %10s %10s %10s %12s\n" "gradient" "updates" "time (s)" \
+       "speedup" "max error"
+for g in uniform $GRADIENTS; do
+    rm -f HEAT_RESTART.dat heat_*.png
+    if [ $g = uniform ]; then
+        out=$($MPIRUN -np $NP "$EXE" $N $N $NSTEPS) || exit 1
+        values HEAT_RESTART.dat > uniform.txt
+    else
+        out=$($MPIRUN -np $NP "$EXE" -A $g $N $N $NSTEPS) || exit 1
+    fi
+    time=$(echo "$out" | sed -n 's/Iteration took \(.*\) seconds./\1/p')
+    share=$(echo "$out" | sed -n 's/.*updated \(.*\)% of the points.*/\1/p')
+    [ $g = uniform ] && reference=$time
+    values HEAT_RESTART.dat | paste uniform.txt - |
+        awk -v g=$g -v s=${share:-100.0} -v t=$time -v t0=$reference '{
+            e = $1 - $2; if (e < 0) e = -e; if (e > m) m = e }
+            END { printf "%10s %9s%% %10s %10.2f %12.3e\n", g, s, t,
+                  t0 / t, m }'
+done
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Accuracy and cost of the second- and fourth-order stencils (-o 2 and
+# -o 4): advances the smooth field of -i sine on the unit square up to the
+# time T with N x N inner points, spacing 1 / (N + 1), and the largest
+# stable time step that divides T, and prints the point updates, the time,
+# the error against the exact solution and the error of the spatial
+# discretisation alone (see field_error in setup.c).
+#
+# The explicit time integration is first order in dt, and at the stability
+# limit dt is proportional to the square of the spacing, so the total
+# error decreases only as O(h^2) also with the fourth-order stencil. The
+# fourth-order stencil pays off when the spatial error dominates, e.g.
+# with a smaller dt given to the runs or for long times.
+#
+# Usage: bench/convergence.sh [ranks] [time] [sizes...]
+
+NP=${1:-4}
+TIME=${2:-0.02}
+SIZES=${*:3}
+SIZES=${SIZES:-"31 63 127 255"}
+MPIRUN=${MPIRUN:-mpirun}
+EXE=$(cd "$(dirname "$0")/.." && pwd)/heat_mpi
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH"
+
+printf "%6s %6s %8s %14s %10s %12s %12s\n" "order" "N" "steps" \
+       "updates" "time (s)" "error" "spatial"
+for order in 2 4; do
+    for n in $SIZES; do
+        # Spacing, number of steps and time step; the stability limit of
+        # the fourth-order stencil is 3/4 of the five-point one (a = 0.5)
+        read h steps dt <<< $(awk -v n=$n -v o=$order -v t=$TIME 'BEGIN {
+            h = 1.0 / (n + 1); limit = h * h / 2.0;
+            if (o == 4) limit *= 0.75;
+            steps = int(t / limit) + 1;
+            printf "%.17g %d %.17g", h, steps, t / steps }')
+        rm -f HEAT_RESTART.dat heat_*.png
+        out=$($MPIRUN -np $NP "$EXE" -o $order -i sine -g $h -d $dt \
+              $n $n $steps) || exit 1
+        time=$(echo "$out" | sed -n 's/Iteration took \(.*\) seconds./\1/p')
+        errors=$(echo "$out" | sed -n \
+            's/Error against the exact solution \(.*\), of the spatial discretisation \(.*\)/\1 \2/p')
+        awk -v o=$order -v n=$n -v s=$steps -v t=$time -v e="$errors" 'BEGIN {
+            split(e, err, " ");
+            printf "%6d %6d %8d %14.0f %10s %12.3e %12.3e\n", o, n, s,
+                   1.0 * n * n * s, t, err[1], err[2] }'
+    done
+done
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Benchmark of the deep halo exchange: time of the main loop for halo
+# depths k = 1, 2, 4, 8 at several field sizes (and thus local domain
+# sizes). The runs are done in a scratch directory so that no checkpoint
+# is picked up.
+#
+# Usage: bench/halo_depth.sh [ranks] [steps] [sizes...]
+
+NP=${1:-8}
+NSTEPS=${2:-500}
+SIZES=${*:3}
+SIZES=${SIZES:-"256 512 1024 2048"}
+MPIRUN=${MPIRUN:-mpirun}
+EXE=$(cd "$(dirname "$0")/.." && pwd)/heat_mpi
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH"
+
+printf "%-12s %-12s %4s %10s\n" "field" "local" "k" "time (s)"
+for n in $SIZES; do
+    for k in 1 2 4 8; do
+        rm -f HEAT_RESTART.dat heat_*.png
+        out=$($MPIRUN -np $NP "$EXE" -k $k $n $n $NSTEPS) || exit 1
+        local_size=$(echo "$out" | sed -n 's/Local domain size \(.*\) x \(.*\)/\1x\2/p')
+        time=$(echo "$out" | sed -n 's/Iteration took \(.*\) seconds./\1/p')
+        printf "%-12s %-12s %4d %10s\n" "${n}x${n}" "$local_size" $k "$time"
+    done
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Benchmark of the halo exchange engines: latency of one exchange with
+# each engine of -e at several field sizes. The fields are allocated in
+# shared memory windows so that the shared engine can be measured too.
+# The runs are done in a scratch directory so that no checkpoint is
+# picked up.
+#
+# Usage: bench/halo_engines.sh [ranks] [repeat] [sizes...]
+
+NP=${1:-8}
+REPEAT=${2:-1000}
+SIZES=${*:3}
+SIZES=${SIZES:-"256 512 1024 2048"}
+MPIRUN=${MPIRUN:-mpirun}
+EXE=$(cd "$(dirname "$0")/.." && pwd)/heat_mpi
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH"
+
+printf "%-12s %-12s %-12s %10s\n" "field" "local" "engine" "us/step"
+for n in $SIZES; do
+    out=$($MPIRUN -np $NP "$EXE" -e shared -B $REPEAT $n $n 1) || exit 1
+    local_size=$(echo "$out" | sed -n 's/Local domain size \(.*\) x \(.*\)/\1x\2/p')
+    echo "$out" | sed -n '/^exchange/,$p' | tail -n +2 |
+    while read engine time; do
+        printf "%-12s %-12s %-12s %10s\n" "${n}x${n}" "$local_size" \
+               "$engine" "$time"
+    done
+done
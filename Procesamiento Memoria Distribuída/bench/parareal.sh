@@ -0,0 +1,41 @@
+#!/bin/bash
+# Parareal against the pure spatial decomposition at equal core count:
+# runs the same case on the same number of ranks with -T 1 (all the ranks
+# in the spatial decomposition) and with several numbers of time slices,
+# and prints the iterations of Parareal, the time, the speedup and the
+# difference of the reference value at (5,5). The time step is set below
+# the stability limit (5e-5 for the default grid spacing and diffusion
+# constant), see parareal.c.
+#
+# Usage: bench/parareal.sh [ranks] [steps] [size] [dt] [slices...]
+
+NP=${1:-16}
+NSTEPS=${2:-8000}
+N=${3:-512}
+DT=${4:-4e-5}
+SLICES=${*:5}
+SLICES=${SLICES:-"2 4 8"}
+MPIRUN=${MPIRUN:-mpirun}
+EXE=$(cd "$(dirname "$0")/.." && pwd)/heat_mpi
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+cd "$SCRATCH"
+
+printf "%6s %10s %10s %10s %12s\n" "slices" "iter" "time (s)" "speedup" \
+       "difference"
+for t in 1 $SLICES; do
+    rm -f HEAT_RESTART.dat heat_*.png
+    out=$($MPIRUN -np $NP "$EXE" -T $t -d $DT $N $N $NSTEPS) || exit 1
+    iter=$(echo "$out" | sed -n 's/Parareal converged in \(.*\) iterations/\1/p')
+    value=$(echo "$out" | sed -n 's/Reference value at 5,5: \(.*\)/\1/p')
+    time=$(echo "$out" | sed -n 's/Iteration took \(.*\) seconds./\1/p')
+    if [ $t = 1 ]; then
+        reference=$value
+        serial=$time
+    fi
+    awk -v s=$t -v k=${iter:--} -v t=$time -v t1=$serial -v v=$value \
+        -v r=$reference 'BEGIN {
+        e = v - r; if (e < 0) e = -e;
+        printf "%6d %10s %10s %10.2f %12.3e\n", s, k, t, t1 / t, e }'
+done
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Accuracy and speed of the field precisions: builds the solver with
+# PRECISION=double, single and mixed in scratch copies of the sources,
+# runs the same case with each and compares the reference value at (5,5)
+# with the double precision one.
+#
+# Usage: bench/precision.sh [ranks] [steps] [size]
+
+NP=${1:-4}
+NSTEPS=${2:-500}
+N=${3:-2000}
+MPIRUN=${MPIRUN:-mpirun}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+printf "%-8s %12s %12s %12s %10s\n" "mode" "value" "abs error" \
+       "rel error" "time (s)"
+for p in double single mixed; do
+    mkdir "$SCRATCH/$p"
+    cp "$SRC"/*.c "$SRC"/*.h "$SRC"/Makefile "$SCRATCH/$p"
+    make -s -C "$SCRATCH/$p" PRECISION=$p > /dev/null 2>&1 || exit 1
+    out=$(cd "$SCRATCH/$p" &&
+          $MPIRUN -np $NP ./heat_mpi $N $N $NSTEPS) || exit 1
+    value=$(echo "$out" | sed -n 's/Reference value at 5,5: \(.*\)/\1/p')
+    time=$(echo "$out" | sed -n 's/Iteration took \(.*\) seconds./\1/p')
+    [ $p = double ] && reference=$value
+    awk -v m=$p -v v=$value -v r=$reference -v t=$time 'BEGIN {
+        e = v - r; if (e < 0) e = -e;
+        printf "%-8s %12.6f %12.3e %12.3e %10s\n", m, v, e, e / r, t }'
+done
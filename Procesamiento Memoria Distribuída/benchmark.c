@@ -0,0 +1,171 @@
+/* Kernel benchmarks for heat equation solver */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Time repeat updates of the interior. The slowest rank determines the
+ * time. */
+static double time_interior(field *curr, field *prev, double a, double dt,
+                            int repeat, parallel_data *parallel)
+{
+    int r;
+    double t, tmax;
+
+    MPI_Barrier(parallel->comm);
+    t = MPI_Wtime();
+    for (r = 0; r < repeat; r++) {
+        evolve_interior(curr, prev, a, dt);
+    }
+    t = MPI_Wtime() - t;
+    MPI_Allreduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, parallel->comm);
+    return tmax;
+}
+
+/* Compare the row by row sweep of evolve_interior with the tiled one.
+ *
+ * The memory traffic of the kernels is not measured directly. Instead the
+ * bandwidth of copy_field (read, write allocate and write: three values,
+ * 24 bytes per point in double precision) is measured on the same arrays,
+ * and the time of the kernels is converted to the number of bytes per
+ * point that could be moved at that bandwidth. A kernel that reuses every
+ * loaded cache line of prev reaches the same three values per point as
+ * the copy, one that reloads the rows above and below from memory needs
+ * up to five. */
+void benchmark_kernels(field *curr, field *prev, double a, double dt,
+                       int repeat, parallel_data *parallel)
+{
+    int r, w, tile;
+    double t, tmax, bandwidth, points;
+
+    points = (double) (curr->nx - 2) * (curr->ny - 2) * repeat;
+
+    /* Reference bandwidth */
+    copy_field(prev, curr);
+    MPI_Barrier(parallel->comm);
+    t = MPI_Wtime();
+    for (r = 0; r < repeat; r++) {
+        copy_field(prev, curr);
+    }
+    t = MPI_Wtime() - t;
+    MPI_Allreduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, parallel->comm);
+    bandwidth = 3.0 * sizeof(real) * (curr->nx + 2 * curr->nghost) *
+        curr->pitch * repeat / tmax;
+
+    /* Tiles given with -C or the default ones */
+    tile = set_tile_width(0);
+    if (tile <= 0)
+        tile = cache_tile_width();
+    if (parallel->rank == 0) {
+        printf("Copy bandwidth %.2f GB/s per task\n", bandwidth / 1.0e9);
+        printf("%-8s %8s %12s %12s\n", "loop", "tile", "ns/point",
+               "bytes/point");
+    }
+    for (w = 0; w < 2; w++) {
+        set_tile_width(w == 0 ? 0 : tile);
+        /* Warm up */
+        time_interior(curr, prev, a, dt, 1, parallel);
+        t = time_interior(curr, prev, a, dt, repeat, parallel);
+        if (parallel->rank == 0) {
+            printf("%-8s %8d %12.3f %12.1f\n", w == 0 ? "rows" : "tiled",
+                   w == 0 ? curr->ny - 2 : tile, 1.0e9 * t / points,
+                   bandwidth * t / points);
+        }
+    }
+    set_tile_width(tile);
+}
+
+/* Compare the interior update of copies of the fields with the rows
+ * padded to different pitches, each with and without huge pages. The
+ * copies are made with the padding given with -W restored afterwards. */
+void benchmark_pitch(field *curr, field *prev, double a, double dt,
+                     int repeat, parallel_data *parallel)
+{
+    static const int lines[] = {-1, 0, 1, 2};
+    field c, p;
+    int k, h, i, g, padding, huge;
+    double t, points;
+
+    g = curr->nghost;
+    points = (double) (curr->nx - 2) * (curr->ny - 2) * repeat;
+    padding = set_row_padding(-1);
+    huge = set_huge_pages(0);
+    if (parallel->rank == 0)
+        printf("%-8s %8s %8s %12s\n", "padding", "pitch", "huge", "ns/point");
+    for (k = 0; k < (int) (sizeof(lines) / sizeof(lines[0])); k++) {
+        set_row_padding(lines[k]);
+        for (h = 0; h < 2; h++) {
+            set_huge_pages(h);
+            c = *curr;
+            p = *prev;
+            c.pitch = p.pitch = row_pitch(curr->ny + 2 * g);
+            c.data = malloc_2d(curr->nx + 2 * g, c.pitch);
+            p.data = malloc_2d(curr->nx + 2 * g, p.pitch);
+            for (i = 0; i < curr->nx + 2 * g; i++) {
+                memcpy(&c.data[idx(i, 0, c.pitch)],
+                       &prev->data[idx(i, 0, prev->pitch)],
+                       (curr->ny + 2 * g) * sizeof(real));
+                memcpy(&p.data[idx(i, 0, p.pitch)],
+                       &prev->data[idx(i, 0, prev->pitch)],
+                       (curr->ny + 2 * g) * sizeof(real));
+            }
+            /* Warm up */
+            time_interior(&c, &p, a, dt, 1, parallel);
+            t = time_interior(&c, &p, a, dt, repeat, parallel);
+            if (parallel->rank == 0) {
+                if (lines[k] < 0)
+                    printf("%-8s", "none");
+                else
+                    printf("%-8d", lines[k]);
+                printf(" %8d %8s %12.3f\n", c.pitch, h ? "yes" : "no",
+                       1.0e9 * t / points);
+            }
+            free_2d(c.data);
+            free_2d(p.data);
+        }
+    }
+    set_row_padding(padding);
+    set_huge_pages(huge);
+}
+
+/* Measure the latency of a halo exchange, from exchange_init to the end
+ * of exchange_finalize, with each of the engines. The slowest rank
+ * determines the time. */
+void benchmark_halo(field *temperature, int repeat, parallel_data *parallel)
+{
+    static const char *engines[] = {"isend", "persistent", "neighbor",
+                                    "shared", "rma"};
+    char current[16];
+    int e, r;
+    double t, tmax;
+
+    strncpy(current, halo_name(), sizeof(current) - 1);
+    current[sizeof(current) - 1] = '\0';
+    if (parallel->rank == 0)
+        printf("%-12s %12s\n", "exchange", "us/step");
+    for (e = 0; e < (int) (sizeof(engines) / sizeof(engines[0])); e++) {
+        /* The fields are in shared memory windows only if the shared
+         * engine was selected at start-up */
+        if (strcmp(engines[e], "shared") == 0 &&
+            strcmp(current, "shared") != 0)
+            continue;
+        select_halo(engines[e]);
+        /* Warm up, also creates the persistent requests */
+        exchange_init(temperature, parallel);
+        exchange_finalize(parallel);
+        MPI_Barrier(parallel->comm);
+        t = MPI_Wtime();
+        for (r = 0; r < repeat; r++) {
+            exchange_init(temperature, parallel);
+            exchange_finalize(parallel);
+        }
+        t = MPI_Wtime() - t;
+        MPI_Allreduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, parallel->comm);
+        if (parallel->rank == 0)
+            printf("%-12s %12.2f\n", engines[e], 1.0e6 * tmax / repeat);
+    }
+    select_halo(current);
+}
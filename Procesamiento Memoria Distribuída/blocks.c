@@ -0,0 +1,458 @@
+/* Over-decomposition for heat equation solver
+ *
+ * With the option -O n the field is split into n blocks per rank, each
+ * of them a field with its own ghost layer, so that a rank has work left
+ * while it waits for the ghost layers of some of its blocks. The blocks
+ * form a grid of the shape with the smallest border length. They are
+ * dealt to the ranks in consecutive runs of n, in row-major order or,
+ * with -H, along a Hilbert curve over the grid of blocks, which keeps the
+ * blocks of a rank together and so more of the borders inside the rank.
+ *
+ * At every step the ghost layers that come from blocks on other ranks are
+ * posted first, the borders between blocks of the same rank are copied
+ * directly, and the blocks that need no messages are advanced at once.
+ * The others advance their interior and then their edges in the order in
+ * which their messages complete, with MPI_Waitsome. The uniform field of
+ * the ranks is only used for the input and the output: the blocks are
+ * filled from it at the start and copied back to it for write_field, the
+ * checkpoints and the end of the run. The result is the same as that of
+ * the uniform field.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Block of the over-decomposition */
+typedef struct {
+    int id;                    /* Index bi * by + bj */
+    field curr, prev;          /* Values with one ghost layer */
+    int nb[4];                 /* Neighbouring blocks up, down, left and
+                                * right, -1 on the boundary */
+    int remote;                /* Sides whose ghost layer is received */
+    int pending;               /* Of them not yet arrived in this step */
+    MPI_Datatype rowtype;      /* Inner part of a row */
+    MPI_Datatype columntype;   /* Inner part of a column */
+} block;
+
+static int bx, by;             /* Grid of blocks */
+static int *owner, *slot;      /* Rank and local index of every block */
+static block *blocks;          /* Blocks of this rank */
+static int nblocks;
+
+/* Side of the neighbour facing the side s */
+static const int opposite[4] = {1, 0, 3, 2};
+
+/* Position of the cell x, y on the Hilbert curve over an n x n grid, n a
+ * power of two */
+static long hilbert_index(int n, int x, int y)
+{
+    long d = 0;
+    int s, rx, ry, t;
+
+    for (s = n / 2; s > 0; s /= 2) {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += (long) s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const long *x = a, *y = b;
+
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+/* Grid of total blocks over an nx x ny field with the shortest borders,
+ * with at least one point per block */
+static void block_grid(int total, int nx, int ny)
+{
+    long length, best = -1;
+    int p;
+
+    for (p = 1; p <= total; p++) {
+        if (total % p != 0 || nx < p || ny < total / p)
+            continue;
+        length = (long) (p - 1) * ny + (long) (total / p - 1) * nx;
+        if (best < 0 || length < best) {
+            best = length;
+            bx = p;
+            by = total / p;
+        }
+    }
+    if (best < 0) {
+        printf("Cannot divide grid %d x %d to %d blocks\n", nx, ny, total);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+/* Rows [e[0], e[1]) and columns [e[2], e[3]) of the block id with the
+ * boundary values on the sides of the domain */
+static void block_extent(int id, int nx, int ny, int *e)
+{
+    int bi = id / by, bj = id % by;
+
+    e[0] = block_start(nx, bx, bi) - (bi == 0);
+    e[1] = block_start(nx, bx, bi + 1) + (bi == bx - 1);
+    e[2] = block_start(ny, by, bj) - (bj == 0);
+    e[3] = block_start(ny, by, bj + 1) + (bj == by - 1);
+}
+
+/* Same for the block of the rank at coords in the uniform field */
+static void rank_extent(parallel_data *parallel, const int *dims,
+                        const int *coords, int *e)
+{
+    int d;
+
+    for (d = 0; d < 2; d++) {
+        e[2 * d] = parallel->cuts[d][coords[d]] - (coords[d] == 0);
+        e[2 * d + 1] = parallel->cuts[d][coords[d] + 1] +
+                       (coords[d] == dims[d] - 1);
+    }
+}
+
+/* Datatype of the intersection of a and b in the local array of the
+ * field f, or MPI_DATATYPE_NULL if they do not overlap */
+static MPI_Datatype overlap_type(field *f, const int *a, const int *b)
+{
+    MPI_Datatype type = MPI_DATATYPE_NULL;
+    int sizes[2], subsizes[2], starts[2];
+    int lo[2], hi[2], d;
+
+    for (d = 0; d < 2; d++) {
+        lo[d] = a[2 * d] > b[2 * d] ? a[2 * d] : b[2 * d];
+        hi[d] = a[2 * d + 1] < b[2 * d + 1] ? a[2 * d + 1] : b[2 * d + 1];
+        if (lo[d] >= hi[d])
+            return type;
+        subsizes[d] = hi[d] - lo[d];
+    }
+    sizes[0] = f->nx + 2 * f->nghost;
+    sizes[1] = f->pitch;
+    starts[0] = lo[0] - f->x0 + f->nghost;
+    starts[1] = lo[1] - f->y0 + f->nghost;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+                             HEAT_MPI_REAL, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/* Copy the values between the uniform field and the blocks, into the
+ * blocks if scatter, boundary values included */
+static void redistribute(field *uniform, int scatter,
+                         parallel_data *parallel)
+{
+    int dims[2], periods[2], coords[2], own[4], e[4], r[4];
+    int q, id, n = 0, nreq, k;
+    MPI_Request *requests;
+    MPI_Datatype *types;
+    block *b;
+
+    MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
+    rank_extent(parallel, dims, coords, own);
+    nreq = bx * by + nblocks * parallel->size;
+    requests = malloc(nreq * sizeof(MPI_Request));
+    types = malloc(nreq * sizeof(MPI_Datatype));
+
+    /* The part of the uniform block of this rank in each block */
+    for (id = 0; id < bx * by; id++) {
+        block_extent(id, uniform->nx_full, uniform->ny_full, e);
+        types[n] = overlap_type(uniform, own, e);
+        if (types[n] == MPI_DATATYPE_NULL)
+            continue;
+        if (scatter)
+            MPI_Isend(uniform->data, 1, types[n], owner[id], id,
+                      parallel->comm, &requests[n]);
+        else
+            MPI_Irecv(uniform->data, 1, types[n], owner[id], id,
+                      parallel->comm, &requests[n]);
+        n++;
+    }
+    /* The parts of the uniform blocks of the ranks in the own blocks */
+    for (k = 0; k < nblocks; k++) {
+        b = &blocks[k];
+        block_extent(b->id, uniform->nx_full, uniform->ny_full, e);
+        for (q = 0; q < parallel->size; q++) {
+            MPI_Cart_coords(parallel->comm, q, 2, coords);
+            rank_extent(parallel, dims, coords, r);
+            types[n] = overlap_type(&b->prev, e, r);
+            if (types[n] == MPI_DATATYPE_NULL)
+                continue;
+            if (scatter)
+                MPI_Irecv(b->prev.data, 1, types[n], q, b->id,
+                          parallel->comm, &requests[n]);
+            else
+                MPI_Isend(b->prev.data, 1, types[n], q, b->id,
+                          parallel->comm, &requests[n]);
+            n++;
+        }
+    }
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+    for (k = 0; k < n; k++)
+        MPI_Type_free(&types[k]);
+    free(types);
+    free(requests);
+
+    if (scatter) {
+        for (k = 0; k < nblocks; k++)
+            copy_field(&blocks[k].prev, &blocks[k].curr);
+    }
+}
+
+/* Split the field into nper blocks per rank and deal them to the ranks,
+ * along a Hilbert curve if hilbert */
+static void blocks_setup(field *uniform, int nper, int hilbert,
+                         parallel_data *parallel)
+{
+    int total, id, k, n, s, width, remote = 0, borders = 0;
+    int nx = uniform->nx_full, ny = uniform->ny_full;
+    int bi, bj, tag_ub, *attr, flag;
+    long *keys;
+    block *b;
+
+    total = nper * parallel->size;
+    block_grid(total, nx, ny);
+    MPI_Comm_get_attr(parallel->comm, MPI_TAG_UB, &attr, &flag);
+    tag_ub = flag ? *attr : 32767;
+    if (4L * total > tag_ub) {
+        if (parallel->rank == 0)
+            printf("Too many blocks for the message tags\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    /* Order of the blocks along the curve */
+    keys = malloc(2 * total * sizeof(long));
+    for (n = 1; n < bx || n < by; n *= 2)
+        ;
+    for (id = 0; id < total; id++) {
+        keys[2 * id] = hilbert ? hilbert_index(n, id / by, id % by) : id;
+        keys[2 * id + 1] = id;
+    }
+    qsort(keys, total, 2 * sizeof(long), compare_keys);
+    owner = malloc(2 * total * sizeof(int));
+    slot = owner + total;
+    for (k = 0; k < total; k++) {
+        id = keys[2 * k + 1];
+        owner[id] = k / nper;
+        slot[id] = k % nper;
+    }
+    free(keys);
+
+    nblocks = nper;
+    blocks = malloc(nblocks * sizeof(block));
+    for (id = 0; id < total; id++) {
+        bi = id / by;
+        bj = id % by;
+        for (s = 0; s < 4; s++) {
+            /* Count the borders once, from the block up or left */
+            if ((s == 1 && bi < bx - 1) || (s == 3 && bj < by - 1)) {
+                borders++;
+                remote += owner[id] !=
+                          owner[s == 1 ? id + by : id + 1];
+            }
+        }
+        if (owner[id] != parallel->rank)
+            continue;
+        b = &blocks[slot[id]];
+        b->id = id;
+        b->prev.x0 = block_start(nx, bx, bi);
+        b->prev.y0 = block_start(ny, by, bj);
+        b->prev.nx = block_start(nx, bx, bi + 1) - b->prev.x0;
+        b->prev.ny = block_start(ny, by, bj + 1) - b->prev.y0;
+        b->prev.nx_full = nx;
+        b->prev.ny_full = ny;
+        b->prev.nghost = 1;
+        b->prev.pitch = b->prev.ny + 2;
+        b->prev.dx = uniform->dx;
+        b->prev.dy = uniform->dy;
+        b->curr = b->prev;
+        width = b->prev.ny + 2;
+        b->prev.data = malloc_2d(b->prev.nx + 2, width);
+        b->curr.data = malloc_2d(b->curr.nx + 2, width);
+        b->nb[0] = bi > 0 ? id - by : -1;
+        b->nb[1] = bi < bx - 1 ? id + by : -1;
+        b->nb[2] = bj > 0 ? id - 1 : -1;
+        b->nb[3] = bj < by - 1 ? id + 1 : -1;
+        b->remote = 0;
+        for (s = 0; s < 4; s++) {
+            if (b->nb[s] >= 0 && owner[b->nb[s]] != parallel->rank)
+                b->remote++;
+        }
+        MPI_Type_contiguous(b->prev.ny, HEAT_MPI_REAL, &b->rowtype);
+        MPI_Type_vector(b->prev.nx, 1, width, HEAT_MPI_REAL,
+                        &b->columntype);
+        MPI_Type_commit(&b->rowtype);
+        MPI_Type_commit(&b->columntype);
+    }
+
+    if (parallel->rank == 0) {
+        printf("Using %d x %d blocks, %d per rank in %s order\n", bx, by,
+               nper, hilbert ? "Hilbert" : "row-major");
+        printf("%d of the %d borders between the blocks are between "
+               "ranks\n", remote, borders);
+    }
+    redistribute(uniform, 1, parallel);
+}
+
+static void blocks_free(void)
+{
+    int k;
+
+    for (k = 0; k < nblocks; k++) {
+        free_2d(blocks[k].prev.data);
+        free_2d(blocks[k].curr.data);
+        MPI_Type_free(&blocks[k].rowtype);
+        MPI_Type_free(&blocks[k].columntype);
+    }
+    free(blocks);
+    free(owner);
+}
+
+/* Offset of the ghost layer on side s of the block, or with inner of the
+ * layer of inner points next to it */
+static int side_offset(field *f, int s, int inner)
+{
+    int width = f->ny + 2;
+
+    switch (s) {
+    case 0:
+        return idx(inner ? 1 : 0, 1, width);
+    case 1:
+        return idx(inner ? f->nx : f->nx + 1, 1, width);
+    case 2:
+        return idx(1, inner ? 1 : 0, width);
+    default:
+        return idx(1, inner ? f->ny : f->ny + 1, width);
+    }
+}
+
+/* Copy the inner layer of the block m next to the side s of b into the
+ * ghost layer of b */
+static void copy_side(block *b, block *m, int s)
+{
+    real *dst = &b->prev.data[side_offset(&b->prev, s, 0)];
+    real *src = &m->prev.data[side_offset(&m->prev, opposite[s], 1)];
+    int i;
+
+    /* Blocks side by side have the same rows but not the same width */
+    if (s < 2) {
+        memcpy(dst, src, b->prev.ny * sizeof(real));
+    } else {
+        for (i = 0; i < b->prev.nx; i++)
+            dst[i * (b->prev.ny + 2)] = src[i * (m->prev.ny + 2)];
+    }
+}
+
+/* Advance all the blocks of the rank by one step */
+static void blocks_step(double a, double dt, MPI_Request *requests,
+                        int *owners, parallel_data *parallel)
+{
+    int k, s, m, nrecv = 0, nsend, done, count, *indices;
+    MPI_Datatype type;
+    block *b;
+
+    /* Post the ghost layers from the other ranks, then the layers sent
+     * to them */
+    for (k = 0; k < nblocks; k++) {
+        b = &blocks[k];
+        b->pending = b->remote;
+        for (s = 0; s < 4; s++) {
+            m = b->nb[s];
+            if (m < 0 || owner[m] == parallel->rank)
+                continue;
+            type = s < 2 ? b->rowtype : b->columntype;
+            MPI_Irecv(&b->prev.data[side_offset(&b->prev, s, 0)], 1, type,
+                      owner[m], 4 * b->id + s, parallel->comm,
+                      &requests[nrecv]);
+            owners[nrecv++] = k;
+        }
+    }
+    nsend = nrecv;
+    for (k = 0; k < nblocks; k++) {
+        b = &blocks[k];
+        for (s = 0; s < 4; s++) {
+            m = b->nb[s];
+            if (m < 0 || owner[m] == parallel->rank)
+                continue;
+            type = s < 2 ? b->rowtype : b->columntype;
+            MPI_Isend(&b->prev.data[side_offset(&b->prev, s, 1)], 1, type,
+                      owner[m], 4 * m + opposite[s], parallel->comm,
+                      &requests[nsend++]);
+        }
+    }
+
+    /* Borders inside the rank, and the blocks that need no messages */
+    for (k = 0; k < nblocks; k++) {
+        b = &blocks[k];
+        for (s = 0; s < 4; s++) {
+            m = b->nb[s];
+            if (m >= 0 && owner[m] == parallel->rank)
+                copy_side(b, &blocks[slot[m]], s);
+        }
+        if (b->remote == 0) {
+            evolve_interior(&b->curr, &b->prev, a, dt);
+            evolve_edges(&b->curr, &b->prev, a, dt);
+        }
+    }
+    for (k = 0; k < nblocks; k++) {
+        if (blocks[k].remote > 0)
+            evolve_interior(&blocks[k].curr, &blocks[k].prev, a, dt);
+    }
+
+    /* Edges of each block as soon as its last ghost layer arrives */
+    indices = owners + nrecv;
+    for (done = 0; done < nrecv; done += count) {
+        MPI_Waitsome(nrecv, requests, &count, indices, MPI_STATUSES_IGNORE);
+        for (m = 0; m < count; m++) {
+            b = &blocks[owners[indices[m]]];
+            if (--b->pending == 0)
+                evolve_edges(&b->curr, &b->prev, a, dt);
+        }
+    }
+    MPI_Waitall(nsend - nrecv, &requests[nrecv], MPI_STATUSES_IGNORE);
+
+    for (k = 0; k < nblocks; k++)
+        swap_fields(&blocks[k].curr, &blocks[k].prev);
+}
+
+/* Advance the field temperature by nsteps steps of dt with nper blocks
+ * per rank, dealt along a Hilbert curve if hilbert. The images and the
+ * checkpoints are written at the intervals of the steps from iter0 on. */
+void evolve_blocks(field *temperature, double a, double dt, int nsteps,
+                   int nper, int hilbert, int iter0, int image_interval,
+                   int restart_interval, parallel_data *parallel)
+{
+    MPI_Request *requests;
+    int *owners;
+    int iter;
+
+    blocks_setup(temperature, nper, hilbert, parallel);
+    requests = malloc(8 * nblocks * sizeof(MPI_Request));
+    owners = malloc(8 * nblocks * sizeof(int));
+    for (iter = iter0; iter < iter0 + nsteps; iter++) {
+        blocks_step(a, dt, requests, owners, parallel);
+        if (iter % image_interval == 0 || iter % restart_interval == 0)
+            redistribute(temperature, 0, parallel);
+        if (iter % image_interval == 0)
+            write_field(temperature, iter, parallel);
+        if (iter % restart_interval == 0)
+            write_restart(temperature, parallel, iter);
+    }
+    redistribute(temperature, 0, parallel);
+    free(requests);
+    free(owners);
+    blocks_free();
+}
@@ -4,157 +4,604 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "heat.h"
 
+/* Number of columns updated at a time by evolve_interior, 0 means that
+ * whole rows are updated */
+static int tile_width = 0;
+
+/* Largest absolute change and sum of the squared changes of the points
+ * updated since the last call of take_residual, accumulated only when
+ * enabled with track_residual */
+static int tracking = 0;
+static double residual[2] = {0.0, 0.0};
+
+/* Set the second ghost layer on the physical boundaries for the
+ * fourth-order stencil by odd reflection about the boundary values in the
+ * first one, u[-2] = 2 u[-1] - u[0]. The solution has a vanishing second
+ * derivative normal to a boundary of constant temperature, so the
+ * reflection keeps the scheme fourth-order there. */
+static void reflect_boundary(field *temperature, parallel_data *parallel)
+{
+    int i, j, width, g, nx, ny;
+    real *u = temperature->data;
+    g = temperature->nghost;
+    nx = temperature->nx;
+    ny = temperature->ny;
+    width = temperature->pitch;
+
+    if (parallel->nup == MPI_PROC_NULL)
+        for (j = g; j < ny + g; j++)
+            u[idx(g - 2, j, width)] = 2 * u[idx(g - 1, j, width)] -
+                                      u[idx(g, j, width)];
+    if (parallel->ndown == MPI_PROC_NULL)
+        for (j = g; j < ny + g; j++)
+            u[idx(nx + g + 1, j, width)] = 2 * u[idx(nx + g, j, width)] -
+                                           u[idx(nx + g - 1, j, width)];
+    if (parallel->nleft == MPI_PROC_NULL)
+        for (i = g; i < nx + g; i++)
+            u[idx(i, g - 2, width)] = 2 * u[idx(i, g - 1, width)] -
+                                      u[idx(i, g, width)];
+    if (parallel->nright == MPI_PROC_NULL)
+        for (i = g; i < nx + g; i++)
+            u[idx(i, ny + g + 1, width)] = 2 * u[idx(i, ny + g, width)] -
+                                           u[idx(i, ny + g - 1, width)];
+}
+
 /* Exchange the boundary values */
 void exchange_init(field *temperature, parallel_data *parallel)
 {
-    int ind, width;
-    width = temperature->ny + 2;
+    int nb[4];
+
+    if (stencil_radius() == 2)
+        reflect_boundary(temperature, parallel);
+    if (halo_engine() != HALO_ISEND) {
+        halo_start(temperature, parallel);
+        return;
+    }
+    nb[0] = parallel->nup;
+    nb[1] = parallel->ndown;
+    nb[2] = parallel->nleft;
+    nb[3] = parallel->nright;
+    exchange_post(temperature, parallel, nb);
+}
+
+/* Post the messages of the boundary values with the neighbours nb in the
+ * order up, down, left and right. MPI_PROC_NULL skips a side. */
+void exchange_post(field *temperature, parallel_data *parallel,
+                   const int *nb)
+{
+    int ind, width, g;
+    g = temperature->nghost;
+    width = temperature->pitch;
     // Send to the up, receive from down
-    ind = idx(1, 0, width);
+    ind = idx(g, 0, width);
     MPI_Isend(&temperature->data[ind], 1, parallel->rowtype,
-              parallel->nup, 11, parallel->comm, &parallel->requests[0]);
-    ind = idx(temperature->nx + 1, 0, width);
+              nb[0], 11, parallel->comm, &parallel->requests[0]);
+    ind = idx(temperature->nx + g, 0, width);
     MPI_Irecv(&temperature->data[ind], 1, parallel->rowtype, 
-              parallel->ndown, 11, parallel->comm, &parallel->requests[1]);
+              nb[1], 11, parallel->comm, &parallel->requests[1]);
     // Send to the down, receive from up
     ind = idx(temperature->nx, 0, width);
     MPI_Isend(&temperature->data[ind], 1, parallel->rowtype, 
-              parallel->ndown, 12, parallel->comm, &parallel->requests[2]);
+              nb[1], 12, parallel->comm, &parallel->requests[2]);
     ind = idx(0, 0, width);
     MPI_Irecv(&temperature->data[ind], 1, parallel->rowtype,
-              parallel->nup, 12, parallel->comm, &parallel->requests[3]);
+              nb[0], 12, parallel->comm, &parallel->requests[3]);
     // Send to the left, receive from right
-    ind = idx(0, 1, width);
+    ind = idx(0, g, width);
     MPI_Isend(&temperature->data[ind], 1, parallel->columntype,
-              parallel->nleft, 13, parallel->comm, &parallel->requests[4]); 
-    ind = idx(0, temperature->ny + 1, width);
+              nb[2], 13, parallel->comm, &parallel->requests[4]); 
+    ind = idx(0, temperature->ny + g, width);
     MPI_Irecv(&temperature->data[ind], 1, parallel->columntype, 
-              parallel->nright, 13, parallel->comm, &parallel->requests[5]); 
+              nb[3], 13, parallel->comm, &parallel->requests[5]); 
     // Send to the right, receive from left
     ind = idx(0, temperature->ny, width);
     MPI_Isend(&temperature->data[ind], 1, parallel->columntype,
-              parallel->nright, 14, parallel->comm, &parallel->requests[7]);
+              nb[3], 14, parallel->comm, &parallel->requests[7]);
     ind = 0;
     MPI_Irecv(&temperature->data[ind], 1, parallel->columntype,
-              parallel->nleft, 14, parallel->comm, &parallel->requests[6]);
+              nb[2], 14, parallel->comm, &parallel->requests[6]);
 
 }
 
 /* complete the non-blocking communication */
 void exchange_finalize(parallel_data *parallel)
 {
+    if (halo_engine() != HALO_ISEND) {
+        halo_wait(parallel);
+        return;
+    }
     MPI_Waitall(8, &parallel->requests[0], MPI_STATUSES_IGNORE);
 }
 
+/* Exchange all the nghost ghost layers in a blocking manner. The rows
+ * are exchanged first and the columns, which span also the ghost rows,
+ * only after that, so that the corner regions needed by evolve_deep are
+ * filled from the diagonal neighbours as well. The engines of halo.c
+ * exchange only one ghost layer without the corners and are not used
+ * here, setup rejects them with depth above one. */
+void exchange_deep(field *temperature, parallel_data *parallel)
+{
+    int ind, width, g;
+    g = temperature->nghost;
+    width = temperature->pitch;
+    // Send to the up, receive from down
+    ind = idx(g, 0, width);
+    MPI_Isend(&temperature->data[ind], 1, parallel->rowtype,
+              parallel->nup, 11, parallel->comm, &parallel->requests[0]);
+    ind = idx(temperature->nx + g, 0, width);
+    MPI_Irecv(&temperature->data[ind], 1, parallel->rowtype,
+              parallel->ndown, 11, parallel->comm, &parallel->requests[1]);
+    // Send to the down, receive from up
+    ind = idx(temperature->nx, 0, width);
+    MPI_Isend(&temperature->data[ind], 1, parallel->rowtype,
+              parallel->ndown, 12, parallel->comm, &parallel->requests[2]);
+    ind = idx(0, 0, width);
+    MPI_Irecv(&temperature->data[ind], 1, parallel->rowtype,
+              parallel->nup, 12, parallel->comm, &parallel->requests[3]);
+    MPI_Waitall(4, &parallel->requests[0], MPI_STATUSES_IGNORE);
+
+    // Send to the left, receive from right
+    ind = idx(0, g, width);
+    MPI_Isend(&temperature->data[ind], 1, parallel->columntype,
+              parallel->nleft, 13, parallel->comm, &parallel->requests[4]);
+    ind = idx(0, temperature->ny + g, width);
+    MPI_Irecv(&temperature->data[ind], 1, parallel->columntype,
+              parallel->nright, 13, parallel->comm, &parallel->requests[5]);
+    // Send to the right, receive from left
+    ind = idx(0, temperature->ny, width);
+    MPI_Isend(&temperature->data[ind], 1, parallel->columntype,
+              parallel->nright, 14, parallel->comm, &parallel->requests[7]);
+    ind = 0;
+    MPI_Irecv(&temperature->data[ind], 1, parallel->columntype,
+              parallel->nleft, 14, parallel->comm, &parallel->requests[6]);
+    MPI_Waitall(4, &parallel->requests[4], MPI_STATUSES_IGNORE);
+}
+
+/* Width of the column tiles such that the three rows of prev and the row
+ * of curr touched by a tile fit into half of the L2 cache */
+int cache_tile_width(void)
+{
+    long cache;
+
+    cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache <= 0) {
+        /* L2 size unknown, use a share of the L3 cache or a guess */
+        cache = sysconf(_SC_LEVEL3_CACHE_SIZE) / sysconf(_SC_NPROCESSORS_ONLN);
+        if (cache <= 0)
+            cache = 256 * 1024;
+    }
+    return cache / 2 / (4 * sizeof(real));
+}
+
+/* Set the width of the column tiles of evolve_interior, 0 disables
+ * tiling. Returns the previous width. */
+int set_tile_width(int width)
+{
+    int old = tile_width;
+    tile_width = width;
+    return old;
+}
+
+/* Enable (on != 0) or disable the accumulation of the residual by the
+ * updates of the field and clear it. Only the updates of the halo depth
+ * one routines are accumulated. */
+void track_residual(int on)
+{
+    tracking = on;
+    residual[0] = residual[1] = 0.0;
+}
+
+/* Return the residual accumulated since the previous call in res and
+ * start a new one */
+void take_residual(double *res)
+{
+    res[0] = residual[0];
+    res[1] = residual[1];
+    residual[0] = residual[1] = 0.0;
+}
+
+/* Add the residual of a thread to that of the field */
+void merge_residual(const double *res)
+{
+    if (!tracking)
+        return;
+    #pragma omp critical(heat_residual)
+    {
+        if (res[0] > residual[0])
+            residual[0] = res[0];
+        residual[1] += res[1];
+    }
+}
+
+/* Update n points of a row, with the residual accumulated into res when
+ * it is tracked */
+static inline void update_row(real *curr, const real *prev, int width,
+                              int n, double cx, double cy, double *res)
+{
+    if (tracking)
+        evolve_row_residual(curr, prev, width, n, cx, cy, res);
+    else
+        evolve_row(curr, prev, width, n, cx, cy);
+}
+
+/* Update the points j0 <= j < j1 of the rows i0 <= i < i1 */
+static void update_block(field *curr, field *prev, double cx, double cy,
+                         int i0, int i1, int j0, int j1)
+{
+    int i, width;
+    width = curr->pitch;
+
+    #pragma omp parallel private(i)
+    {
+        double res[2] = {0.0, 0.0};
+        #pragma omp for schedule(static)
+        for (i = i0; i < i1; i++) {
+            update_row(&curr->data[idx(i, j0, width)],
+                       &prev->data[idx(i, j0, width)], width, j1 - j0, cx,
+                       cy, res);
+        }
+        merge_residual(res);
+    }
+}
+
+/* Update the interior points of the rows i0 <= i < i1, those that are
+ * at least the stencil radius r away from the ghost layers */
+static void interior_rows(field *curr, field *prev, double cx, double cy,
+                          int i0, int i1)
+{
+    int i, j, n;
+    int width, g, r;
+    g = curr->nghost;
+    width = curr->pitch;
+    r = stencil_radius();
+
+    if (tile_width <= 0 || tile_width >= curr->ny - 2 * r) {
+        #pragma omp parallel private(i)
+        {
+            double res[2] = {0.0, 0.0};
+            #pragma omp for schedule(static)
+            for (i = i0; i < i1; i++) {
+                update_row(&curr->data[idx(i, g + r, width)],
+                           &prev->data[idx(i, g + r, width)], width,
+                           curr->ny - 2 * r, cx, cy, res);
+            }
+            merge_residual(res);
+        }
+        return;
+    }
+
+    /* Sweep the interior one column tile at a time so that the rows of
+     * prev are still in cache when they are needed for the next row.
+     * Every thread updates the same rows in every tile, so no
+     * synchronization is needed between the tiles */
+    #pragma omp parallel private(i, j, n)
+    {
+        double res[2] = {0.0, 0.0};
+        for (j = g + r; j < curr->ny + g - r; j += tile_width) {
+            n = curr->ny + g - r - j;
+            if (n > tile_width)
+                n = tile_width;
+            #pragma omp for schedule(static) nowait
+            for (i = i0; i < i1; i++) {
+                update_row(&curr->data[idx(i, j, width)],
+                           &prev->data[idx(i, j, width)], width, n, cx, cy,
+                           res);
+            }
+        }
+        merge_residual(res);
+    }
+}
+
 /* Update the temperature values using five-point stencil */
 void evolve_interior(field *curr, field *prev, double a, double dt)
 {
-    int i, j;
-    int ic, iu, id, il, ir; // indexes for center, up, down, left, right
-    int width;
-    width = curr->ny + 2;
-    double dx2, dy2;
+    double cx, cy;
+    int r = stencil_radius();
 
     /* Determine the temperature field at next time step
      * As we have fixed boundary conditions, the outermost gridpoints
      * are not updated. */
-    dx2 = prev->dx * prev->dx;
-    dy2 = prev->dy * prev->dy;
-    for (i = 2; i < curr->nx; i++) {
-        for (j = 2; j < curr->ny; j++) {
-            ic = idx(i, j, width);
-            iu = idx(i+1, j, width);
-            id = idx(i-1, j, width);
-            ir = idx(i, j+1, width);
-            il = idx(i, j-1, width);
-            curr->data[ic] = prev->data[ic] + a * dt *
-                               ((prev->data[iu] -
-                                 2.0 * prev->data[ic] +
-                                 prev->data[id]) / dx2 +
-                                (prev->data[ir] -
-                                 2.0 * prev->data[ic] +
-                                 prev->data[il]) / dy2);
-        }
-    }
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    interior_rows(curr, prev, cx, cy, curr->nghost + r,
+                  curr->nx + curr->nghost - r);
 }
 
 /* Update the temperature values using five-point stencil */
-/* update only the border-dependent regions of the field */
+/* update only the border-dependent regions of the field, the bands of
+ * stencil radius width along the sides */
 void evolve_edges(field *curr, field *prev, double a, double dt)
 {
-    int i, j;
-    int ic, iu, id, il, ir; // indexes for center, up, down, left, right
-    int width;
-    width = curr->ny + 2;
-    double dx2, dy2;
+    int g, r, nx, ny;
+    g = curr->nghost;
+    r = stencil_radius();
+    nx = curr->nx;
+    ny = curr->ny;
+    double cx, cy;
 
     /* Determine the temperature field at next time step
      * As we have fixed boundary conditions, the outermost gridpoints
      * are not updated. */
-    dx2 = prev->dx * prev->dx;
-    dy2 = prev->dy * prev->dy;
-    i = 1;
-    for (j = 1; j < curr->ny + 1; j++) {
-        ic = idx(i, j, width);
-        iu = idx(i+1, j, width);
-        id = idx(i-1, j, width);
-        ir = idx(i, j+1, width);
-        il = idx(i, j-1, width);
-        curr->data[ic] = prev->data[ic] + a * dt *
-                           ((prev->data[iu] -
-                             2.0 * prev->data[ic] +
-                             prev->data[id]) / dx2 +
-                            (prev->data[ir] -
-                             2.0 * prev->data[ic] +
-                             prev->data[il]) / dy2);
-    }
-    i = curr -> nx;
-    for (j = 1; j < curr->ny + 1; j++) {
-        ic = idx(i, j, width);
-        iu = idx(i+1, j, width);
-        id = idx(i-1, j, width);
-        ir = idx(i, j+1, width);
-        il = idx(i, j-1, width);
-        curr->data[ic] = prev->data[ic] + a * dt *
-                           ((prev->data[iu] -
-                             2.0 * prev->data[ic] +
-                             prev->data[id]) / dx2 +
-                            (prev->data[ir] -
-                             2.0 * prev->data[ic] +
-                             prev->data[il]) / dy2);
-    }
-    j = 1;
-    for (i = 1; i < curr->nx + 1; i++) {
-        ic = idx(i, j, width);
-        iu = idx(i+1, j, width);
-        id = idx(i-1, j, width);
-        ir = idx(i, j+1, width);
-        il = idx(i, j-1, width);
-        curr->data[ic] = prev->data[ic] + a * dt *
-                           ((prev->data[iu] -
-                             2.0 * prev->data[ic] +
-                             prev->data[id]) / dx2 +
-                            (prev->data[ir] -
-                             2.0 * prev->data[ic] +
-                             prev->data[il]) / dy2);
-    }
-    j = curr -> ny;
-    for (i = 1; i < curr->nx + 1; i++) {
-        ic = idx(i, j, width);
-        iu = idx(i+1, j, width);
-        id = idx(i-1, j, width);
-        ir = idx(i, j+1, width);
-        il = idx(i, j-1, width);
-        curr->data[ic] = prev->data[ic] + a * dt *
-                           ((prev->data[iu] -
-                             2.0 * prev->data[ic] +
-                             prev->data[id]) / dx2 +
-                            (prev->data[ir] -
-                             2.0 * prev->data[ic] +
-                             prev->data[il]) / dy2);
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    update_block(curr, prev, cx, cy, g, g + r, g, ny + g);
+    update_block(curr, prev, cx, cy, nx + g - r, nx + g, g, ny + g);
+    /* The corners have been updated with the rows */
+    update_block(curr, prev, cx, cy, g + r, nx + g - r, g, g + r);
+    update_block(curr, prev, cx, cy, g + r, nx + g - r, ny + g - r, ny + g);
+}
+
+/* Corners of the field updated by evolve_overlap, after the sides
+ * EDGE_UP ... EDGE_RIGHT */
+#define CORNER 16
+#define EDGES_AND_CORNERS 255
+
+/* Side whose ghost layer is received by each request of exchange_init */
+static const int ghost_side[8] = {0, EDGE_DOWN, 0, EDGE_UP,
+                                  0, EDGE_RIGHT, EDGE_LEFT, 0};
+
+/* Ghost layers needed by the upper left, upper right, lower left and
+ * lower right corners */
+static const int corner_sides[4] = {EDGE_UP | EDGE_LEFT, EDGE_UP | EDGE_RIGHT,
+                                    EDGE_DOWN | EDGE_LEFT,
+                                    EDGE_DOWN | EDGE_RIGHT};
+
+/* Test (or with wait, wait for) the requests of exchange_init and return
+ * the sides whose ghost layer has arrived since the previous call */
+static int poll_ghosts(parallel_data *parallel, int wait)
+{
+    int indices[8];
+    int count, k, arrived = 0;
+
+    if (halo_engine() != HALO_ISEND)
+        return halo_test(parallel, wait);
+    if (wait)
+        MPI_Waitsome(8, parallel->requests, &count, indices,
+                     MPI_STATUSES_IGNORE);
+    else
+        MPI_Testsome(8, parallel->requests, &count, indices,
+                     MPI_STATUSES_IGNORE);
+    if (count == MPI_UNDEFINED)
+        return 0;
+    for (k = 0; k < count; k++)
+        arrived |= ghost_side[indices[k]];
+    return arrived;
+}
+
+/* Update the edges and corners whose ghost layers have arrived and that
+ * are not yet done. The edges are bands of stencil radius width and the
+ * corners squares of that size. Returns the new set of done edges and
+ * corners. */
+static int edges_ready(field *curr, field *prev, double cx, double cy,
+                       int arrived, int done)
+{
+    int i, j, k;
+    int g, r, nx, ny;
+    g = curr->nghost;
+    r = stencil_radius();
+    nx = curr->nx;
+    ny = curr->ny;
+
+    if ((arrived & EDGE_UP) && !(done & EDGE_UP)) {
+        update_block(curr, prev, cx, cy, g, g + r, g + r, ny + g - r);
+        done |= EDGE_UP;
+    }
+    if ((arrived & EDGE_DOWN) && !(done & EDGE_DOWN)) {
+        update_block(curr, prev, cx, cy, nx + g - r, nx + g, g + r,
+                     ny + g - r);
+        done |= EDGE_DOWN;
+    }
+    if ((arrived & EDGE_LEFT) && !(done & EDGE_LEFT)) {
+        update_block(curr, prev, cx, cy, g + r, nx + g - r, g, g + r);
+        done |= EDGE_LEFT;
+    }
+    if ((arrived & EDGE_RIGHT) && !(done & EDGE_RIGHT)) {
+        update_block(curr, prev, cx, cy, g + r, nx + g - r, ny + g - r,
+                     ny + g);
+        done |= EDGE_RIGHT;
+    }
+    for (k = 0; k < 4; k++) {
+        if ((arrived & corner_sides[k]) != corner_sides[k] ||
+            (done & (CORNER << k)))
+            continue;
+        i = (corner_sides[k] & EDGE_UP) ? g : nx + g - r;
+        j = (corner_sides[k] & EDGE_LEFT) ? g : ny + g - r;
+        update_block(curr, prev, cx, cy, i, i + r, j, j + r);
+        done |= CORNER << k;
+    }
+    return done;
+}
+
+/* Update the whole field while the halo exchange started by exchange_init
+ * is in flight, and complete the exchange. The interior is updated in
+ * nstrips strips of rows and the requests are tested between the strips,
+ * so that the messages progress also without an asynchronous progress
+ * thread. Each edge is updated as soon as its own ghost layer has arrived
+ * and each corner once both of its ghost layers are there. */
+void evolve_overlap(field *curr, field *prev, double a, double dt,
+                    int nstrips, parallel_data *parallel)
+{
+    int i, i1, rows, r;
+    int arrived = 0, done = 0;
+    double cx, cy;
+
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    r = stencil_radius();
+
+    rows = (curr->nx - 2 * r + nstrips - 1) / nstrips;
+    if (rows < 1)
+        rows = 1;
+    for (i = curr->nghost + r; i < curr->nx + curr->nghost - r; i += rows) {
+        i1 = i + rows;
+        if (i1 > curr->nx + curr->nghost - r)
+            i1 = curr->nx + curr->nghost - r;
+        interior_rows(curr, prev, cx, cy, i, i1);
+        arrived |= poll_ghosts(parallel, 0);
+        done = edges_ready(curr, prev, cx, cy, arrived, done);
+    }
+
+    /* Interior done, update the rest in the order the messages arrive */
+    while (done != EDGES_AND_CORNERS) {
+        arrived |= poll_ghosts(parallel, 1);
+        done = edges_ready(curr, prev, cx, cy, arrived, done);
+    }
+    /* Complete the sends */
+    exchange_finalize(parallel);
+}
+
+/* Extent of the region updated by evolve_deep with the given margin */
+static void deep_region(field *temperature, int margin,
+                        parallel_data *parallel, int *i0, int *i1,
+                        int *j0, int *j1)
+{
+    *i0 = temperature->nghost;
+    *i1 = temperature->nx + temperature->nghost;
+    *j0 = temperature->nghost;
+    *j1 = temperature->ny + temperature->nghost;
+    if (parallel->nup != MPI_PROC_NULL)
+        *i0 -= margin;
+    if (parallel->ndown != MPI_PROC_NULL)
+        *i1 += margin;
+    if (parallel->nleft != MPI_PROC_NULL)
+        *j0 -= margin;
+    if (parallel->nright != MPI_PROC_NULL)
+        *j1 += margin;
+}
+
+/* Update the temperature values using five-point stencil */
+/* update the inner part of the field extended by margin layers into the
+ * ghost region. Between two calls of exchange_deep the margin is decreased
+ * by one at every step, so that the ghost layers received last are consumed
+ * one at a time. Sides with a physical boundary are not extended. */
+void evolve_deep(field *curr, field *prev, double a, double dt, int margin,
+                 parallel_data *parallel)
+{
+    int i;
+    int i0, i1, j0, j1;     // extent of the updated region
+    int width, g;
+    g = curr->nghost;
+    width = curr->pitch;
+    double cx, cy;
+
+    assert(margin < g);
+
+    deep_region(curr, margin, parallel, &i0, &i1, &j0, &j1);
+
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    #pragma omp parallel for schedule(static)
+    for (i = i0; i < i1; i++) {
+        evolve_row(&curr->data[idx(i, j0, width)],
+                   &prev->data[idx(i, j0, width)], width, j1 - j0, cx, cy);
+    }
+
+    /* The boundary values next to the extended part are not refreshed by
+     * the exchange of curr, so carry them over from prev */
+    if (parallel->nup == MPI_PROC_NULL)
+        memcpy(&curr->data[idx(g - 1, j0, width)],
+               &prev->data[idx(g - 1, j0, width)], (j1 - j0) * sizeof(real));
+    if (parallel->ndown == MPI_PROC_NULL)
+        memcpy(&curr->data[idx(curr->nx + g, j0, width)],
+               &prev->data[idx(curr->nx + g, j0, width)],
+               (j1 - j0) * sizeof(real));
+    for (i = i0; i < i1; i++) {
+        if (parallel->nleft == MPI_PROC_NULL)
+            curr->data[idx(i, g - 1, width)] = prev->data[idx(i, g - 1, width)];
+        if (parallel->nright == MPI_PROC_NULL)
+            curr->data[idx(i, curr->ny + g, width)] =
+                prev->data[idx(i, curr->ny + g, width)];
+    }
+}
+
+/* Update the temperature values using five-point stencil */
+/* advance nsub steps of evolve_deep, starting from the given margin, in a
+ * single sweep over the rows. Row i of step s is updated at wavefront
+ * w = i + 2*s, so that only about 2*nsub rows of both fields are in use
+ * at a time and stay in cache while they are updated nsub times. The
+ * steps alternate between the two fields as with swap_fields: step 0
+ * writes curr, step 1 writes prev and so on, and the results are the same
+ * as with nsub calls of evolve_deep.
+ *
+ * The skew of two rows per step makes row i of step s depend only on
+ * rows updated at earlier wavefronts, so the threads can share the
+ * columns of every row and need to synchronize only once per wavefront.
+ * A row of step s overwrites the same row of step s-2, which was last
+ * needed for the row below it in step s-1, updated at wavefront w-1. */
+void evolve_skewed(field *curr, field *prev, double a, double dt, int margin,
+                   int nsub, parallel_data *parallel)
+{
+    int i0[nsub], i1[nsub], j0[nsub], j1[nsub]; // extents of the steps
+    real *src[nsub], *dst[nsub];              // fields of the steps
+    int s, w, wend;
+    int width, g;
+    g = curr->nghost;
+    width = curr->pitch;
+    double cx, cy;
+
+    assert(nsub >= 1 && nsub <= margin + 1 && margin < g);
+
+    for (s = 0; s < nsub; s++) {
+        deep_region(curr, margin - s, parallel, &i0[s], &i1[s], &j0[s],
+                    &j1[s]);
+        src[s] = (s % 2 == 0) ? prev->data : curr->data;
+        dst[s] = (s % 2 == 0) ? curr->data : prev->data;
+    }
+    wend = i1[nsub - 1] + 2 * (nsub - 1);
+
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    #pragma omp parallel private(s, w)
+    {
+        int i, lo, hi, jstart, jend, nthreads, tid;
+        nthreads = 1;
+        tid = 0;
+#ifdef _OPENMP
+        nthreads = omp_get_num_threads();
+        tid = omp_get_thread_num();
+#endif
+        /* Strip of columns of this thread */
+        jstart = j0[0] + (j1[0] - j0[0]) * tid / nthreads;
+        jend = j0[0] + (j1[0] - j0[0]) * (tid + 1) / nthreads;
+
+        for (w = i0[0]; w < wend; w++) {
+            for (s = 0; s < nsub; s++) {
+                i = w - 2 * s;
+                if (i < i0[s] || i >= i1[s])
+                    continue;
+                lo = jstart > j0[s] ? jstart : j0[s];
+                hi = jend < j1[s] ? jend : j1[s];
+                if (hi > lo)
+                    evolve_row(&dst[s][idx(i, lo, width)],
+                               &src[s][idx(i, lo, width)], width, hi - lo,
+                               cx, cy);
+
+                /* Carry over the boundary values as in evolve_deep, just
+                 * before the next step needs them */
+                if (i == i0[s] && parallel->nup == MPI_PROC_NULL && hi > lo)
+                    memcpy(&dst[s][idx(g - 1, lo, width)],
+                           &src[s][idx(g - 1, lo, width)],
+                           (hi - lo) * sizeof(real));
+                if (i == i1[s] - 1 && parallel->ndown == MPI_PROC_NULL &&
+                    hi > lo)
+                    memcpy(&dst[s][idx(curr->nx + g, lo, width)],
+                           &src[s][idx(curr->nx + g, lo, width)],
+                           (hi - lo) * sizeof(real));
+                if (tid == 0 && parallel->nleft == MPI_PROC_NULL)
+                    dst[s][idx(i, g - 1, width)] = src[s][idx(i, g - 1, width)];
+                if (tid == nthreads - 1 && parallel->nright == MPI_PROC_NULL)
+                    dst[s][idx(i, curr->ny + g, width)] =
+                        src[s][idx(i, curr->ny + g, width)];
+            }
+            #pragma omp barrier
+        }
     }
 }
@@ -0,0 +1,142 @@
+/* Main solver routines for the 3D heat equation solver
+ *
+ * The field is updated with the seven-point stencil. As in the 2D solver
+ * the ghost layers are exchanged with non-blocking messages while the
+ * interior, the points that do not depend on them, is updated, and the
+ * six boundary layers of the local domain are updated after the exchange
+ * has completed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+#include "heat3d.h"
+
+/* Start the exchange of the six faces of the local domain with the
+ * neighbours. Direction d sends its first inner layer to the neighbour
+ * nb[2d] and its last one to nb[2d+1], and receives the ghost layers on
+ * the same sides. */
+void exchange_init3d(field3d *temperature, parallel_data3d *parallel)
+{
+    int height, width, d;
+    long first[3], last[3], ghost_lo[3], ghost_hi[3];
+
+    height = temperature->ny + 2;
+    width = temperature->nz + 2;
+
+    /* Offsets of the first point of the inner part of the faces */
+    first[0] = idx3d(1, 1, 1, height, width);
+    last[0] = idx3d(temperature->nx, 1, 1, height, width);
+    ghost_lo[0] = idx3d(0, 1, 1, height, width);
+    ghost_hi[0] = idx3d(temperature->nx + 1, 1, 1, height, width);
+    first[1] = idx3d(1, 1, 1, height, width);
+    last[1] = idx3d(1, temperature->ny, 1, height, width);
+    ghost_lo[1] = idx3d(1, 0, 1, height, width);
+    ghost_hi[1] = idx3d(1, temperature->ny + 1, 1, height, width);
+    first[2] = idx3d(1, 1, 1, height, width);
+    last[2] = idx3d(1, 1, temperature->nz, height, width);
+    ghost_lo[2] = idx3d(1, 1, 0, height, width);
+    ghost_hi[2] = idx3d(1, 1, temperature->nz + 1, height, width);
+
+    for (d = 0; d < 3; d++) {
+        MPI_Isend(&temperature->data[first[d]], 1, parallel->facetype[d],
+                  parallel->nb[2 * d], 11 + 2 * d, parallel->comm,
+                  &parallel->requests[4 * d]);
+        MPI_Irecv(&temperature->data[ghost_hi[d]], 1, parallel->facetype[d],
+                  parallel->nb[2 * d + 1], 11 + 2 * d, parallel->comm,
+                  &parallel->requests[4 * d + 1]);
+        MPI_Isend(&temperature->data[last[d]], 1, parallel->facetype[d],
+                  parallel->nb[2 * d + 1], 12 + 2 * d, parallel->comm,
+                  &parallel->requests[4 * d + 2]);
+        MPI_Irecv(&temperature->data[ghost_lo[d]], 1, parallel->facetype[d],
+                  parallel->nb[2 * d], 12 + 2 * d, parallel->comm,
+                  &parallel->requests[4 * d + 3]);
+    }
+}
+
+/* Complete the non-blocking communication */
+void exchange_finalize3d(parallel_data3d *parallel)
+{
+    MPI_Waitall(12, parallel->requests, MPI_STATUSES_IGNORE);
+}
+
+/* Update n consecutive points along z starting from curr using the values
+ * in prev. The neighbours along x are plane elements apart and those along
+ * y width elements apart. */
+static inline void update_line(real *restrict curr,
+                               const real *restrict prev, int n, long plane,
+                               int width, double cx, double cy, double cz)
+{
+    int k;
+    double c2;
+
+    for (k = 0; k < n; k++) {
+        c2 = 2.0 * prev[k];
+        curr[k] = prev[k] +
+                  cx * (((double) prev[k + plane] - c2) + prev[k - plane]) +
+                  cy * (((double) prev[k + width] - c2) + prev[k - width]) +
+                  cz * (((double) prev[k + 1] - c2) + prev[k - 1]);
+    }
+}
+
+/* Update the temperature values using seven-point stencil */
+/* update only the points that do not depend on the ghost layers */
+void evolve_interior3d(field3d *curr, field3d *prev, double a, double dt)
+{
+    int i, j, height, width;
+    long plane, ind;
+    double cx, cy, cz;
+
+    height = curr->ny + 2;
+    width = curr->nz + 2;
+    plane = (long) height * width;
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    cz = a * dt / (prev->dz * prev->dz);
+
+    #pragma omp parallel for private(j, ind) schedule(static)
+    for (i = 2; i < curr->nx; i++) {
+        for (j = 2; j < curr->ny; j++) {
+            ind = idx3d(i, j, 2, height, width);
+            update_line(&curr->data[ind], &prev->data[ind], curr->nz - 2,
+                        plane, width, cx, cy, cz);
+        }
+    }
+}
+
+/* Update the temperature values using seven-point stencil */
+/* update only the six boundary layers of the local domain */
+void evolve_edges3d(field3d *curr, field3d *prev, double a, double dt)
+{
+    int i, j, height, width, nz;
+    long plane, ind;
+    double cx, cy, cz;
+
+    height = curr->ny + 2;
+    width = curr->nz + 2;
+    plane = (long) height * width;
+    nz = curr->nz;
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    cz = a * dt / (prev->dz * prev->dz);
+
+    #pragma omp parallel for private(j, ind) schedule(static)
+    for (i = 1; i <= curr->nx; i++) {
+        for (j = 1; j <= curr->ny; j++) {
+            ind = idx3d(i, j, 1, height, width);
+            if (i == 1 || i == curr->nx || j == 1 || j == curr->ny) {
+                /* Whole line on the faces normal to x and y */
+                update_line(&curr->data[ind], &prev->data[ind], nz, plane,
+                            width, cx, cy, cz);
+            } else {
+                /* First and last point on the faces normal to z */
+                update_line(&curr->data[ind], &prev->data[ind], 1, plane,
+                            width, cx, cy, cz);
+                if (nz > 1)
+                    update_line(&curr->data[ind + nz - 1],
+                                &prev->data[ind + nz - 1], 1, plane, width,
+                                cx, cy, cz);
+            }
+        }
+    }
+}
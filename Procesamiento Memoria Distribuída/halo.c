@@ -0,0 +1,766 @@
+/* Alternative halo exchange engines for heat equation solver
+ *
+ * exchange_init and exchange_finalize in core.c post eight fresh
+ * MPI_Isend/MPI_Irecv calls at every step and send the columns with the
+ * strided columntype. The engines here are selected at start-up with the
+ * option -e:
+ *
+ * persistent: the eight requests are created once for each of the two
+ *             field buffers with MPI_Send_init/MPI_Recv_init and only
+ *             started at every step
+ * neighbor:   a single MPI_Ineighbor_alltoallw on the Cartesian
+ *             communicator
+ * shared:     the field buffers are allocated in MPI-3 shared memory
+ *             windows of the ranks on the same node, and the ghost layers
+ *             of the neighbours on the node are copied directly from their
+ *             buffers. The neighbours on other nodes are still exchanged
+ *             with messages.
+ * rma:        the field buffers are exposed in MPI windows and every rank
+ *             puts its boundary rows and columns into the ghost layers of
+ *             its neighbours, synchronised with post-start-complete-wait
+ *             on the group of the Cartesian neighbours.
+ *
+ * The persistent and neighbor engines send the rows directly from the
+ * field and the columns from contiguous buffers, into which they are
+ * packed (with AVX2 or AVX-512 gathers when the corresponding stencil
+ * kernel is in use in double precision) before the exchange and unpacked
+ * from after it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <mpi.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "heat.h"
+
+/* Requests and column buffers of the exchange of one field buffer */
+typedef struct {
+    real *data;                /* Field buffer, NULL if the slot is free */
+    MPI_Request requests[8];   /* Persistent requests, same order as in
+                                * exchange_init */
+    int counts[4];             /* Arguments of MPI_Ineighbor_alltoallw */
+    MPI_Aint sdispls[4], rdispls[4];
+    MPI_Datatype types[4];
+} halo_slot;
+
+typedef void (*pack_kernel)(real *buf, const real *data, int width, int n);
+typedef void (*unpack_kernel)(real *data, const real *buf, int width, int n);
+
+static int engine = HALO_ISEND;
+static const char *engine_names[] = {"isend", "persistent", "neighbor",
+                                     "shared", "rma"};
+
+static halo_slot slots[2];
+static int last_slot = 0;
+static real *sendbuf[2], *recvbuf[2]; /* Left and right columns */
+static int column_size = 0;
+
+static field *exchanged;       /* Field of the exchange in flight */
+static halo_slot *active;
+static int unpacked;           /* Sides already unpacked */
+
+/* Shared memory engine. The windows hold the two field buffers, the
+ * neighbours are in the order up, down, left, right. */
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static int node_neighbour[4];  /* Rank in node_comm, -1 if not on the node */
+static MPI_Win windows[2];
+static real *window_data[2];   /* Own field buffer, NULL if the window is
+                                * free */
+static real *neighbour_data[2][4];
+static int neighbour_nx[4], neighbour_ny[4];
+static int copied;             /* Sides copied but not yet reported */
+
+/* One-sided engine. The windows hold the two field buffers. */
+static MPI_Win rma_windows[2];
+static real *rma_data[2];      /* NULL if the window is free */
+static int rma_last = 0;
+static MPI_Group rma_group = MPI_GROUP_NULL; /* Cartesian neighbours */
+static MPI_Datatype rma_origin[4];   /* Boundary rows and columns sent up,
+                                      * down, left and right */
+static MPI_Datatype rma_target[4];   /* Same in the layout of the neighbour */
+static MPI_Aint rma_origin_disp[4], rma_target_disp[4];
+static int rma_completed;      /* Access epoch closed, or no epoch since
+                                * there are no neighbours */
+
+/* Copy n values from the column starting at data into buf */
+static void pack_portable(real *buf, const real *data, int width, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        buf[i] = data[(long) i * width];
+}
+
+/* Copy n values from buf into the column starting at data */
+static void unpack_portable(real *data, const real *buf, int width,
+                            int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        data[(long) i * width] = buf[i];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(HEAT_FLOAT_STORAGE)
+
+__attribute__((target("avx2")))
+static void pack_avx2(real *buf, const real *data, int width, int n)
+{
+    __m256i index = _mm256_set_epi64x(3L * width, 2L * width, width, 0);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(&buf[i], _mm256_i64gather_pd(
+                             &data[(long) i * width], index, 8));
+    }
+    pack_portable(&buf[i], &data[(long) i * width], width, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void pack_avx512(real *buf, const real *data, int width, int n)
+{
+    __m512i index = _mm512_set_epi64(7L * width, 6L * width, 5L * width,
+                                     4L * width, 3L * width, 2L * width,
+                                     width, 0);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(&buf[i], _mm512_i64gather_pd(
+                             index, &data[(long) i * width], 8));
+    }
+    pack_portable(&buf[i], &data[(long) i * width], width, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void unpack_avx512(real *data, const real *buf, int width, int n)
+{
+    __m512i index = _mm512_set_epi64(7L * width, 6L * width, 5L * width,
+                                     4L * width, 3L * width, 2L * width,
+                                     width, 0);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm512_i64scatter_pd(&data[(long) i * width], index,
+                             _mm512_loadu_pd(&buf[i]), 8);
+    }
+    unpack_portable(&data[(long) i * width], &buf[i], width, n - i);
+}
+
+#endif
+
+static pack_kernel pack = pack_portable;
+static unpack_kernel unpack = unpack_portable;
+
+/* Choose the halo exchange engine, name is one of "isend", "persistent",
+ * "neighbor", "shared" or "rma". The packing kernels follow the stencil
+ * kernel, so select_kernel has to be called first. Returns 0 on success
+ * and -1 if the engine is unknown. */
+int select_halo(const char *name)
+{
+    int e;
+
+    for (e = 0; e < (int) (sizeof(engine_names) / sizeof(engine_names[0]));
+         e++) {
+        if (strcmp(name, engine_names[e]) == 0)
+            break;
+    }
+    if (e == sizeof(engine_names) / sizeof(engine_names[0]))
+        return -1;
+    halo_free();
+    engine = e;
+
+    pack = pack_portable;
+    unpack = unpack_portable;
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(HEAT_FLOAT_STORAGE)
+    if (strcmp(kernel_name(), "avx512") == 0) {
+        pack = pack_avx512;
+        unpack = unpack_avx512;
+    } else if (strcmp(kernel_name(), "avx2") == 0) {
+        /* AVX2 has no scatter, the unpacking stays scalar */
+        pack = pack_avx2;
+    }
+#endif
+    return 0;
+}
+
+/* Engine in use */
+int halo_engine(void)
+{
+    return engine;
+}
+
+/* Name of the engine in use */
+const char *halo_name(void)
+{
+    return engine_names[engine];
+}
+
+/* Create the requests or the collective arguments for one field buffer */
+static void setup_slot(halo_slot *slot, field *temperature,
+                       parallel_data *parallel)
+{
+    int width, g, nx;
+    g = temperature->nghost;
+    nx = temperature->nx;
+    width = temperature->pitch;
+    real *data = temperature->data;
+
+    slot->data = data;
+    if (engine == HALO_PERSISTENT) {
+        // Send to the up, receive from down
+        MPI_Send_init(&data[idx(g, 0, width)], 1, parallel->rowtype,
+                      parallel->nup, 11, parallel->comm, &slot->requests[0]);
+        MPI_Recv_init(&data[idx(nx + g, 0, width)], 1, parallel->rowtype,
+                      parallel->ndown, 11, parallel->comm,
+                      &slot->requests[1]);
+        // Send to the down, receive from up
+        MPI_Send_init(&data[idx(nx, 0, width)], 1, parallel->rowtype,
+                      parallel->ndown, 12, parallel->comm,
+                      &slot->requests[2]);
+        MPI_Recv_init(&data[0], 1, parallel->rowtype, parallel->nup, 12,
+                      parallel->comm, &slot->requests[3]);
+        // Send to the left, receive from right
+        MPI_Send_init(sendbuf[0], column_size, HEAT_MPI_REAL,
+                      parallel->nleft, 13, parallel->comm, &slot->requests[4]);
+        MPI_Recv_init(recvbuf[1], column_size, HEAT_MPI_REAL,
+                      parallel->nright, 13, parallel->comm, &slot->requests[5]);
+        // Send to the right, receive from left
+        MPI_Recv_init(recvbuf[0], column_size, HEAT_MPI_REAL,
+                      parallel->nleft, 14, parallel->comm, &slot->requests[6]);
+        MPI_Send_init(sendbuf[1], column_size, HEAT_MPI_REAL,
+                      parallel->nright, 14, parallel->comm, &slot->requests[7]);
+        return;
+    }
+
+    /* The neighbours of the Cartesian communicator are in the order up,
+     * down, left, right. The rows are in the field and the columns in the
+     * buffers, so absolute addresses are used. */
+    MPI_Get_address(&data[idx(g, 0, width)], &slot->sdispls[0]);
+    MPI_Get_address(&data[idx(nx, 0, width)], &slot->sdispls[1]);
+    MPI_Get_address(sendbuf[0], &slot->sdispls[2]);
+    MPI_Get_address(sendbuf[1], &slot->sdispls[3]);
+    MPI_Get_address(&data[0], &slot->rdispls[0]);
+    MPI_Get_address(&data[idx(nx + g, 0, width)], &slot->rdispls[1]);
+    MPI_Get_address(recvbuf[0], &slot->rdispls[2]);
+    MPI_Get_address(recvbuf[1], &slot->rdispls[3]);
+    slot->counts[0] = slot->counts[1] = 1;
+    slot->counts[2] = slot->counts[3] = column_size;
+    slot->types[0] = slot->types[1] = parallel->rowtype;
+    slot->types[2] = slot->types[3] = HEAT_MPI_REAL;
+}
+
+/* Free the requests of a slot */
+static void free_slot(halo_slot *slot)
+{
+    int k;
+
+    if (slot->data == NULL)
+        return;
+    if (engine == HALO_PERSISTENT) {
+        for (k = 0; k < 8; k++)
+            MPI_Request_free(&slot->requests[k]);
+    }
+    slot->data = NULL;
+}
+
+/* Copy the g boundary columns of the field into the send buffers */
+static void pack_columns(field *temperature)
+{
+    int width, g, k, n;
+    g = temperature->nghost;
+    width = temperature->pitch;
+    n = temperature->nx + 2 * g;
+
+    for (k = 0; k < g; k++) {
+        pack(&sendbuf[0][k * n], &temperature->data[g + k], width, n);
+        pack(&sendbuf[1][k * n], &temperature->data[temperature->ny + k],
+             width, n);
+    }
+}
+
+/* Copy the received columns into the ghost columns on the given side,
+ * 0 for left and 1 for right. Nothing is received from MPI_PROC_NULL, the
+ * boundary columns are then left as they are. */
+static void unpack_columns(field *temperature, int side,
+                           parallel_data *parallel)
+{
+    int width, g, k, n, j;
+
+    if ((side == 0 ? parallel->nleft : parallel->nright) == MPI_PROC_NULL)
+        return;
+    g = temperature->nghost;
+    width = temperature->pitch;
+    n = temperature->nx + 2 * g;
+
+    j = side == 0 ? 0 : temperature->ny + g;
+    for (k = 0; k < g; k++)
+        unpack(&temperature->data[j + k], &recvbuf[side][k * n], width, n);
+}
+
+/* Find out which of the Cartesian neighbours are on the same node. Does
+ * nothing unless the shared engine is selected; has to be called before
+ * the fields are allocated. */
+void halo_setup(parallel_data *parallel)
+{
+    MPI_Group group, node_group;
+    int nb[4];
+    int k;
+
+    if (engine != HALO_SHARED || node_comm != MPI_COMM_NULL)
+        return;
+    MPI_Comm_split_type(parallel->comm, MPI_COMM_TYPE_SHARED, 0,
+                        MPI_INFO_NULL, &node_comm);
+    MPI_Comm_group(parallel->comm, &group);
+    MPI_Comm_group(node_comm, &node_group);
+    nb[0] = parallel->nup;
+    nb[1] = parallel->ndown;
+    nb[2] = parallel->nleft;
+    nb[3] = parallel->nright;
+    for (k = 0; k < 4; k++) {
+        node_neighbour[k] = -1;
+        if (nb[k] != MPI_PROC_NULL) {
+            MPI_Group_translate_ranks(group, 1, &nb[k], node_group,
+                                      &node_neighbour[k]);
+            if (node_neighbour[k] == MPI_UNDEFINED)
+                node_neighbour[k] = -1;
+        }
+    }
+    MPI_Group_free(&group);
+    MPI_Group_free(&node_group);
+}
+
+/* Allocate the data of temperature, ghost layers included, in a shared
+ * memory window. Collective over the ranks of the node. */
+real *halo_alloc(field *temperature)
+{
+    MPI_Info info;
+    MPI_Aint size;
+    real *data;
+    int *dims;
+    int w, k, n, disp_unit;
+
+    for (w = 0; w < 2; w++) {
+        if (window_data[w] == NULL)
+            break;
+    }
+    if (w == 2 || node_comm == MPI_COMM_NULL) {
+        printf("No shared memory window available for the field\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    /* The segments need not be contiguous, so that each of them can be
+     * placed close to its own rank */
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    size = (MPI_Aint) (temperature->nx + 2 * temperature->nghost) *
+        temperature->pitch * sizeof(real);
+    MPI_Win_allocate_shared(size, sizeof(real), info, node_comm, &data,
+                            &windows[w]);
+    MPI_Info_free(&info);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, windows[w]);
+    window_data[w] = data;
+
+    /* Buffers and dimensions of the neighbours on the node */
+    MPI_Comm_size(node_comm, &n);
+    dims = malloc(2 * n * sizeof(int));
+    MPI_Allgather(&temperature->nx, 1, MPI_INT, dims, 1, MPI_INT, node_comm);
+    MPI_Allgather(&temperature->ny, 1, MPI_INT, &dims[n], 1, MPI_INT,
+                  node_comm);
+    for (k = 0; k < 4; k++) {
+        neighbour_data[w][k] = NULL;
+        if (node_neighbour[k] < 0)
+            continue;
+        MPI_Win_shared_query(windows[w], node_neighbour[k], &size,
+                             &disp_unit, &neighbour_data[w][k]);
+        neighbour_nx[k] = dims[node_neighbour[k]];
+        neighbour_ny[k] = dims[n + node_neighbour[k]];
+    }
+    free(dims);
+    return data;
+}
+
+/* Free a field buffer allocated with halo_alloc. Collective over the
+ * ranks of the node. */
+void halo_dealloc(real *data)
+{
+    int w;
+
+    for (w = 0; w < 2; w++) {
+        if (window_data[w] == data)
+            break;
+    }
+    if (w == 2)
+        return;
+    MPI_Win_unlock_all(windows[w]);
+    MPI_Win_free(&windows[w]);
+    window_data[w] = NULL;
+    if (window_data[0] == NULL && window_data[1] == NULL)
+        MPI_Comm_free(&node_comm);
+}
+
+/* Exchange of the shared engine. The neighbours have written their
+ * buffers in the previous step, and will not write into the other buffer
+ * before the next step, so a barrier of the node is enough to make their
+ * boundary values available. Only the interior rows and columns are
+ * copied, the ghost values of the neighbours may be written at the same
+ * time. */
+static void shared_start(field *temperature, parallel_data *parallel)
+{
+    real *data, *nbdata;
+    int nb[4];
+    int w, i, k, g, width, nbwidth;
+
+    for (w = 0; w < 2; w++) {
+        if (window_data[w] == temperature->data)
+            break;
+    }
+    if (w == 2) {
+        printf("Field is not in a shared memory window\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    /* Messages to the neighbours on the other nodes */
+    nb[0] = node_neighbour[0] < 0 ? parallel->nup : MPI_PROC_NULL;
+    nb[1] = node_neighbour[1] < 0 ? parallel->ndown : MPI_PROC_NULL;
+    nb[2] = node_neighbour[2] < 0 ? parallel->nleft : MPI_PROC_NULL;
+    nb[3] = node_neighbour[3] < 0 ? parallel->nright : MPI_PROC_NULL;
+    exchange_post(temperature, parallel, nb);
+
+    MPI_Win_sync(windows[w]);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(windows[w]);
+
+    g = temperature->nghost;
+    width = temperature->pitch;
+    data = temperature->data;
+    copied = 0;
+    if ((nbdata = neighbour_data[w][0]) != NULL) {
+        for (k = 0; k < g; k++)
+            memcpy(&data[idx(k, g, width)],
+                   &nbdata[idx(neighbour_nx[0] + k, g, width)],
+                   temperature->ny * sizeof(real));
+        copied |= EDGE_UP;
+    }
+    if ((nbdata = neighbour_data[w][1]) != NULL) {
+        for (k = 0; k < g; k++)
+            memcpy(&data[idx(temperature->nx + g + k, g, width)],
+                   &nbdata[idx(g + k, g, width)],
+                   temperature->ny * sizeof(real));
+        copied |= EDGE_DOWN;
+    }
+    if ((nbdata = neighbour_data[w][2]) != NULL) {
+        nbwidth = row_pitch(neighbour_ny[2] + 2 * g);
+        for (i = g; i < temperature->nx + g; i++)
+            for (k = 0; k < g; k++)
+                data[idx(i, k, width)] =
+                    nbdata[idx(i, neighbour_ny[2] + k, nbwidth)];
+        copied |= EDGE_LEFT;
+    }
+    if ((nbdata = neighbour_data[w][3]) != NULL) {
+        nbwidth = row_pitch(neighbour_ny[3] + 2 * g);
+        for (i = g; i < temperature->nx + g; i++)
+            for (k = 0; k < g; k++)
+                data[idx(i, temperature->ny + g + k, width)] =
+                    nbdata[idx(i, g + k, nbwidth)];
+        copied |= EDGE_RIGHT;
+    }
+    unpacked = copied;
+}
+
+/* Create the neighbour group and the datatypes of the one-sided engine.
+ * Only the interior part of the boundary rows and columns is put, so that
+ * no two neighbours write to the same ghost cell. */
+static void rma_setup(field *temperature, parallel_data *parallel)
+{
+    MPI_Group group;
+    int mydims[2], nbdims[8] = {0};
+    int nb[4], ranks[4];
+    int k, n, g, width, nbwidth;
+
+    g = temperature->nghost;
+    width = temperature->pitch;
+    nb[0] = parallel->nup;
+    nb[1] = parallel->ndown;
+    nb[2] = parallel->nleft;
+    nb[3] = parallel->nright;
+
+    MPI_Comm_group(parallel->comm, &group);
+    for (n = 0, k = 0; k < 4; k++) {
+        if (nb[k] != MPI_PROC_NULL)
+            ranks[n++] = nb[k];
+    }
+    MPI_Group_incl(group, n, ranks, &rma_group);
+    MPI_Group_free(&group);
+
+    /* Dimensions of the neighbours, in the order up, down, left, right */
+    mydims[0] = temperature->nx;
+    mydims[1] = temperature->ny;
+    MPI_Neighbor_allgather(mydims, 2, MPI_INT, nbdims, 2, MPI_INT,
+                           parallel->comm);
+
+    for (k = 0; k < 4; k++) {
+        rma_origin[k] = rma_target[k] = MPI_DATATYPE_NULL;
+        if (nb[k] == MPI_PROC_NULL)
+            continue;
+        nbwidth = row_pitch(nbdims[2 * k + 1] + 2 * g);
+        if (k < 2) {
+            MPI_Type_vector(g, temperature->ny, width, HEAT_MPI_REAL,
+                            &rma_origin[k]);
+            MPI_Type_vector(g, temperature->ny, nbwidth, HEAT_MPI_REAL,
+                            &rma_target[k]);
+        } else {
+            MPI_Type_vector(temperature->nx, g, width, HEAT_MPI_REAL,
+                            &rma_origin[k]);
+            MPI_Type_vector(temperature->nx, g, nbwidth, HEAT_MPI_REAL,
+                            &rma_target[k]);
+        }
+        MPI_Type_commit(&rma_origin[k]);
+        MPI_Type_commit(&rma_target[k]);
+    }
+    /* Up: first interior rows into the last ghost rows of the neighbour,
+     * down: last interior rows into the first ghost rows, and similarly
+     * for the columns */
+    rma_origin_disp[0] = idx(g, g, width);
+    rma_target_disp[0] = idx(nbdims[0] + g, g, row_pitch(nbdims[1] + 2 * g));
+    rma_origin_disp[1] = idx(temperature->nx, g, width);
+    rma_target_disp[1] = idx(0, g, row_pitch(nbdims[3] + 2 * g));
+    rma_origin_disp[2] = idx(g, g, width);
+    rma_target_disp[2] = idx(g, nbdims[5] + g, row_pitch(nbdims[5] + 2 * g));
+    rma_origin_disp[3] = idx(g, temperature->ny, width);
+    rma_target_disp[3] = idx(g, 0, row_pitch(nbdims[7] + 2 * g));
+}
+
+/* Free the windows, the group and the datatypes of the one-sided engine.
+ * Collective over all the ranks. */
+static void rma_free(void)
+{
+    int w, k;
+
+    for (w = 0; w < 2; w++) {
+        if (rma_data[w] != NULL)
+            MPI_Win_free(&rma_windows[w]);
+        rma_data[w] = NULL;
+    }
+    if (rma_group == MPI_GROUP_NULL)
+        return;
+    if (rma_group != MPI_GROUP_EMPTY)
+        MPI_Group_free(&rma_group);
+    rma_group = MPI_GROUP_NULL;
+    for (k = 0; k < 4; k++) {
+        if (rma_origin[k] != MPI_DATATYPE_NULL) {
+            MPI_Type_free(&rma_origin[k]);
+            MPI_Type_free(&rma_target[k]);
+        }
+    }
+}
+
+/* Exchange of the one-sided engine: open the exposure epoch for the
+ * neighbours and put the boundary values into their ghost layers. The
+ * access epoch is closed by the first halo_test, so that the puts can
+ * proceed while the interior is updated. */
+static void rma_start(field *temperature, parallel_data *parallel)
+{
+    MPI_Win win;
+    int nb[4];
+    int w, k;
+
+    if (rma_group == MPI_GROUP_NULL)
+        rma_setup(temperature, parallel);
+    unpacked = 0;
+    rma_completed = 1;
+    if (rma_group == MPI_GROUP_EMPTY)
+        return;
+
+    /* The two field buffers alternate, each has its own window */
+    for (w = 0; w < 2; w++) {
+        if (rma_data[w] == temperature->data)
+            break;
+    }
+    if (w == 2) {
+        w = 1 - rma_last;
+        if (rma_data[w] != NULL)
+            MPI_Win_free(&rma_windows[w]);
+        MPI_Win_create(temperature->data,
+                       (MPI_Aint) (temperature->nx + 2 * temperature->nghost) *
+                       temperature->pitch * sizeof(real), sizeof(real),
+                       MPI_INFO_NULL,
+                       parallel->comm, &rma_windows[w]);
+        rma_data[w] = temperature->data;
+    }
+    rma_last = w;
+    win = rma_windows[w];
+
+    nb[0] = parallel->nup;
+    nb[1] = parallel->ndown;
+    nb[2] = parallel->nleft;
+    nb[3] = parallel->nright;
+    MPI_Win_post(rma_group, 0, win);
+    MPI_Win_start(rma_group, 0, win);
+    for (k = 0; k < 4; k++) {
+        if (nb[k] == MPI_PROC_NULL)
+            continue;
+        MPI_Put(&temperature->data[rma_origin_disp[k]], 1, rma_origin[k],
+                nb[k], rma_target_disp[k], 1, rma_target[k], win);
+    }
+    rma_completed = 0;
+}
+
+/* Start the exchange of the ghost layers of temperature with the selected
+ * engine */
+void halo_start(field *temperature, parallel_data *parallel)
+{
+    int s, size;
+
+    if (engine == HALO_SHARED) {
+        shared_start(temperature, parallel);
+        return;
+    }
+    if (engine == HALO_RMA) {
+        rma_start(temperature, parallel);
+        return;
+    }
+    size = temperature->nghost * (temperature->nx + 2 * temperature->nghost);
+    if (size != column_size) {
+        halo_free();
+        column_size = size;
+        for (s = 0; s < 2; s++) {
+            sendbuf[s] = malloc(column_size * sizeof(real));
+            recvbuf[s] = malloc(column_size * sizeof(real));
+        }
+    }
+
+    /* The two field buffers alternate, a buffer that has not been seen
+     * before replaces the one used less recently */
+    for (s = 0; s < 2; s++) {
+        if (slots[s].data == temperature->data)
+            break;
+    }
+    if (s == 2) {
+        s = 1 - last_slot;
+        free_slot(&slots[s]);
+        setup_slot(&slots[s], temperature, parallel);
+    }
+    last_slot = s;
+    active = &slots[s];
+    exchanged = temperature;
+    unpacked = 0;
+
+    pack_columns(temperature);
+    if (engine == HALO_PERSISTENT) {
+        MPI_Startall(8, active->requests);
+    } else {
+        MPI_Ineighbor_alltoallw(MPI_BOTTOM, active->counts, active->sdispls,
+                                active->types, MPI_BOTTOM, active->counts,
+                                active->rdispls, active->types,
+                                parallel->comm, &parallel->requests[0]);
+    }
+}
+
+/* Test (or with wait, wait for) the exchange started by halo_start. The
+ * received columns are unpacked as soon as they arrive. Returns the sides
+ * (EDGE_UP, EDGE_DOWN, EDGE_LEFT, EDGE_RIGHT) whose ghost layers have
+ * arrived since the previous call. */
+int halo_test(parallel_data *parallel, int wait)
+{
+    static const int ghost_side[8] = {0, EDGE_DOWN, 0, EDGE_UP,
+                                      0, EDGE_RIGHT, EDGE_LEFT, 0};
+    MPI_Request *requests;
+    int indices[8];
+    int count, k, flag, arrived;
+
+    requests = engine == HALO_PERSISTENT ? active->requests
+                                         : parallel->requests;
+    if (engine == HALO_RMA) {
+        if (unpacked == EDGE_ALL)
+            return 0;
+        if (!rma_completed) {
+            MPI_Win_complete(rma_windows[rma_last]);
+            rma_completed = 1;
+        }
+        if (rma_group == MPI_GROUP_EMPTY) {
+            flag = 1;
+        } else if (wait) {
+            MPI_Win_wait(rma_windows[rma_last]);
+            flag = 1;
+        } else {
+            MPI_Win_test(rma_windows[rma_last], &flag);
+        }
+        if (!flag)
+            return 0;
+        unpacked = EDGE_ALL;
+        return EDGE_ALL;
+    }
+    if (engine == HALO_NEIGHBOR) {
+        if (unpacked == EDGE_ALL)
+            return 0;
+        if (wait) {
+            MPI_Wait(&parallel->requests[0], MPI_STATUS_IGNORE);
+            flag = 1;
+        } else {
+            MPI_Test(&parallel->requests[0], &flag, MPI_STATUS_IGNORE);
+        }
+        if (!flag)
+            return 0;
+        unpack_columns(exchanged, 0, parallel);
+        unpack_columns(exchanged, 1, parallel);
+        unpacked = EDGE_ALL;
+        return EDGE_ALL;
+    }
+
+    /* The shared engine has copied the sides on the node already */
+    arrived = copied;
+    copied = 0;
+    if (wait && arrived)
+        wait = 0;
+    if (wait)
+        MPI_Waitsome(8, requests, &count, indices, MPI_STATUSES_IGNORE);
+    else
+        MPI_Testsome(8, requests, &count, indices, MPI_STATUSES_IGNORE);
+    if (count == MPI_UNDEFINED)
+        return arrived;
+    for (k = 0; k < count; k++) {
+        if (engine == HALO_PERSISTENT && indices[k] == 6)
+            unpack_columns(exchanged, 0, parallel);
+        else if (engine == HALO_PERSISTENT && indices[k] == 5)
+            unpack_columns(exchanged, 1, parallel);
+        arrived |= ghost_side[indices[k]];
+    }
+    unpacked |= arrived;
+    return arrived;
+}
+
+/* Complete the exchange started by halo_start */
+void halo_wait(parallel_data *parallel)
+{
+    if (engine == HALO_NEIGHBOR || engine == HALO_RMA) {
+        halo_test(parallel, 1);
+        return;
+    }
+    while (unpacked != EDGE_ALL)
+        halo_test(parallel, 1);
+    /* Complete the sends */
+    MPI_Waitall(8, engine == HALO_PERSISTENT ? active->requests
+                                             : parallel->requests,
+                MPI_STATUSES_IGNORE);
+}
+
+/* Free the requests, the buffers and the windows of the engine.
+ * Collective over all the ranks. */
+void halo_free(void)
+{
+    int s;
+
+    for (s = 0; s < 2; s++) {
+        free_slot(&slots[s]);
+        free(sendbuf[s]);
+        free(recvbuf[s]);
+        sendbuf[s] = recvbuf[s] = NULL;
+    }
+    column_size = 0;
+    rma_free();
+}
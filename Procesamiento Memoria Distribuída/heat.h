@@ -1,18 +1,49 @@
 #ifndef __HEAT_H__
 #define __HEAT_H__
 
+/* Floating point type of the temperature field, selected at build time
+ * with make PRECISION=double (default), single or mixed. The mixed mode
+ * stores the field in single precision, but the stencil accumulates in
+ * double precision. */
+#if defined(HEAT_SINGLE) || defined(HEAT_MIXED)
+#define HEAT_FLOAT_STORAGE
+typedef float real;
+#define HEAT_MPI_REAL MPI_FLOAT
+#else
+typedef double real;
+#define HEAT_MPI_REAL MPI_DOUBLE
+#endif
+
+#if defined(HEAT_SINGLE)
+#define PRECISION_NAME "single"
+#elif defined(HEAT_MIXED)
+#define PRECISION_NAME "mixed"
+#else
+#define PRECISION_NAME "double"
+#endif
+
 
 /* Datatype for temperature field */
 typedef struct {
     /* nx and ny are the true dimensions of the field. The array data
-     * contains also ghost layers, so it will have dimensions nx+2 x ny+2 */
+     * contains also nghost ghost layers on each side, so it will have
+     * dimensions nx+2*nghost x ny+2*nghost, with the rows pitch elements
+     * apart */
     int nx;                     /* Local dimensions of the field */
     int ny;
+    int nghost;                 /* Width of the ghost layers */
+    int pitch;                  /* Distance between the rows of data in
+                                 * elements, at least ny+2*nghost, see
+                                 * row_pitch */
     int nx_full;                /* Global dimensions of the field */
     int ny_full;                /* Global dimensions of the field */
+    int x0;                     /* Global indices of the first inner point,
+                                 * the local dimensions differ by one when
+                                 * the grid is not divisible by the ranks */
+    int y0;
     double dx;
     double dy;
-    double *data;
+    real *data;
 } field;
 
 /* Datatype for basic parallelization information */
@@ -20,6 +51,16 @@ typedef struct {
     int size;                   /* Number of MPI tasks */
     int rank;
     int nup, ndown, nleft, nright; /* Ranks of neighbouring MPI tasks */
+    int halo_depth;            /* Number of ghost layers exchanged at once */
+    int grid[2];               /* Process grid given with -p, zeros to
+                                * choose it from the field shape */
+    int *cuts[2];              /* First global row (column) of each row
+                                * (column) of ranks and the global
+                                * dimension at the end, see rebalance */
+    int slices;                /* Number of Parareal time slices */
+    int slice;                 /* Time slice of this rank */
+    MPI_Comm world;            /* Ranks of the spatial decomposition, those
+                                * of the time slice in the Parareal mode */
     MPI_Comm comm;             /* Cartesian communicator */
     MPI_Request requests[8];   /* Requests for non-blocking communication */
     MPI_Datatype rowtype;      /* MPI Datatype for communication of rows */
@@ -29,13 +70,71 @@ typedef struct {
     MPI_Datatype filetype;     /* MPI Datatype for file view in restart I/O */
 } parallel_data;
 
+/* Datatype for the run time options that are not part of the field or of
+ * the parallelization */
+typedef struct {
+    int benchmark;             /* Repetitions of the kernel benchmark, 0 for
+                                * a normal run */
+    int skew;                  /* Advance the steps between deep halo
+                                * exchanges with evolve_skewed */
+    int strips;                /* Strips of the interior between the polls
+                                * of the halo exchange, 0 for no polling */
+    double tolerance;          /* Largest change of a point in a step at
+                                * which the steady state is reached, 0 runs
+                                * all the steps */
+    int method;                /* Time integration method, METHOD_* */
+    double dt;                 /* Time step, 0 for the stability limit of
+                                * the explicit method */
+    int wcycle;                /* W-cycles instead of V-cycles in the
+                                * multigrid solver */
+    double gradient;           /* Gradient above which the adaptive mesh is
+                                * refined, negative for the uniform grid */
+    int balance;               /* Steps between the checks of the load
+                                * balance, 0 for fixed blocks */
+    double imbalance;          /* Ratio of the busiest rank to the mean
+                                * above which the blocks are moved */
+    int blocks;                /* Blocks per rank of the over-decomposition,
+                                * 0 for the single block */
+    int hilbert;               /* Blocks dealt along a Hilbert curve */
+    double quiescence;         /* Largest change of a tile in a step below
+                                * which it is skipped, 0 updates all */
+    int inplace;               /* Update a single field in place */
+} options;
+
 
 /* We use here fixed grid spacing */
 #define DX 0.01
 #define DY 0.01
 
-/* file name for restart checkpoints*/
+/* Thread support requested from MPI in the hybrid MPI + OpenMP mode. All
+ * MPI calls are made by the master thread outside of the parallel regions,
+ * so MPI_THREAD_FUNNELED is enough; MPI_THREAD_SERIALIZED can be requested
+ * with -DHEAT_THREAD_LEVEL=MPI_THREAD_SERIALIZED */
+#ifndef HEAT_THREAD_LEVEL
+#define HEAT_THREAD_LEVEL MPI_THREAD_FUNNELED
+#endif
+
+/* Halo exchange engines, see halo.c */
+enum { HALO_ISEND, HALO_PERSISTENT, HALO_NEIGHBOR, HALO_SHARED,
+       HALO_RMA };
+
+/* Time integration methods */
+enum { METHOD_EXPLICIT, METHOD_CN, METHOD_MG, METHOD_SPECTRAL };
+
+/* Sides of the field, as returned by halo_test */
+#define EDGE_UP 1
+#define EDGE_DOWN 2
+#define EDGE_LEFT 4
+#define EDGE_RIGHT 8
+#define EDGE_ALL 15
+
+/* file name for restart checkpoints, the checkpoints of single precision
+ * storage are kept apart from the double precision ones */
+#ifdef HEAT_FLOAT_STORAGE
+#define CHECKPOINT "HEAT_RESTART_float.dat"
+#else
 #define CHECKPOINT "HEAT_RESTART.dat"
+#endif
 
 /* Inline function for indexing the 2D arrays */
 static inline int idx(int i, int j, int width)
@@ -43,30 +142,163 @@ static inline int idx(int i, int j, int width)
     return i * width + j;
 }
 
+/* First of the n points 0 <= i < n in part k of the block distribution
+ * over parts parts. The first n % parts parts have one point more than
+ * the others. */
+static inline int block_start(int n, int parts, int k)
+{
+    return k * (n / parts) + (k < n % parts ? k : n % parts);
+}
+
 /* Function prototypes */
-double *malloc_2d(int nx, int ny);
+real *malloc_2d(int nx, int ny);
+
+void free_2d(real *array);
+
+int set_row_padding(int lines);
 
-void free_2d(double *array);
+int set_huge_pages(int on);
+
+int row_pitch(int width);
 
 void set_field_dimensions(field *temperature, int nx, int ny,
                           parallel_data *parallel);
 
 void parallel_setup(parallel_data *parallel, int nx, int ny);
 
+void parallel_datatypes(parallel_data *parallel, int nx, int ny);
+
+void free_datatypes(parallel_data *parallel);
+
 void initialize(int argc, char *argv[], field *temperature1,
                 field *temperature2, int *nsteps, parallel_data *parallel,
-                int *iter0);
+                int *iter0, options *opts);
 
 void generate_field(field *temperature, parallel_data *parallel);
 
+int field_error(field *temperature, double a, double dt, int nsteps,
+                double *errors, parallel_data *parallel);
+
 void exchange_init(field *temperature, parallel_data *parallel);
 
+void exchange_post(field *temperature, parallel_data *parallel,
+                   const int *nb);
+
 void exchange_finalize(parallel_data *parallel);
 
+void exchange_deep(field *temperature, parallel_data *parallel);
+
+int select_halo(const char *name);
+
+int halo_engine(void);
+
+const char *halo_name(void);
+
+void halo_setup(parallel_data *parallel);
+
+real *halo_alloc(field *temperature);
+
+void halo_dealloc(real *data);
+
+void halo_start(field *temperature, parallel_data *parallel);
+
+int halo_test(parallel_data *parallel, int wait);
+
+void halo_wait(parallel_data *parallel);
+
+void halo_free(void);
+
+int cache_tile_width(void);
+
+int set_tile_width(int width);
+
 void evolve_interior(field *curr, field *prev, double a, double dt);
 
 void evolve_edges(field *curr, field *prev, double a, double dt);
 
+void evolve_row(real *curr, const real *prev, int width, int n,
+                double cx, double cy);
+
+void evolve_row_residual(real *curr, const real *prev, int width, int n,
+                         double cx, double cy, double *res);
+
+void track_residual(int on);
+
+void take_residual(double *res);
+
+void merge_residual(const double *res);
+
+int select_kernel(const char *name);
+
+const char *kernel_name(void);
+
+int set_stencil_order(int order);
+
+int stencil_radius(void);
+
+void evolve_overlap(field *curr, field *prev, double a, double dt,
+                    int nstrips, parallel_data *parallel);
+
+void evolve_deep(field *curr, field *prev, double a, double dt, int margin,
+                 parallel_data *parallel);
+
+void evolve_skewed(field *curr, field *prev, double a, double dt, int margin,
+                   int nsub, parallel_data *parallel);
+
+int evolve_cn(field *curr, field *prev, double a, double dt,
+              parallel_data *parallel);
+
+int evolve_implicit(field *curr, field *prev, double a, double dt,
+                    double theta, parallel_data *parallel);
+
+void cn_free(void);
+
+int solve_multigrid(field *temperature, double tolerance, int maxcycles,
+                    int w, parallel_data *parallel);
+
+void evolve_spectral(field *temperature, double a, double dt, int nsteps,
+                     parallel_data *parallel);
+
+int rebalance(field *current, field *previous, double busy, double ratio,
+              parallel_data *parallel);
+
+int evolve_amr(field *temperature, double a, double dt, int nsteps,
+               double gradient, int iter0, int image_interval,
+               int restart_interval, parallel_data *parallel);
+
+void active_setup(field *temperature, double tolerance);
+
+void active_free(void);
+
+void evolve_active(field *curr, field *prev, double a, double dt,
+                   parallel_data *parallel);
+
+double skipped_fraction(int step, parallel_data *parallel);
+
+void inplace_setup(field *temperature);
+
+void inplace_free(void);
+
+void evolve_interior_inplace(field *temperature, double a, double dt);
+
+void evolve_edges_inplace(field *temperature, double a, double dt);
+
+void evolve_blocks(field *temperature, double a, double dt, int nsteps,
+                   int nper, int hilbert, int iter0, int image_interval,
+                   int restart_interval, parallel_data *parallel);
+
+int evolve_parareal(field *current, double a, double dt, int nsteps,
+                    double tolerance, parallel_data *parallel);
+
+void benchmark_kernels(field *curr, field *prev, double a, double dt,
+                       int repeat, parallel_data *parallel);
+
+void benchmark_pitch(field *curr, field *prev, double a, double dt,
+                     int repeat, parallel_data *parallel);
+
+void benchmark_halo(field *temperature, int repeat,
+                    parallel_data *parallel);
+
 void write_field(field *temperature, int iter, parallel_data *parallel);
 
 void read_field(field *temperature1, field *temperature2,
@@ -0,0 +1,100 @@
+#ifndef __HEAT3D_H__
+#define __HEAT3D_H__
+
+/* The 3D solver shares the precision of the field, the grid spacing, the
+ * thread support level and the block distribution with the 2D one */
+#include "heat.h"
+
+#define DZ 0.01
+
+/* Datatype for the 3D temperature field */
+typedef struct {
+    /* nx, ny and nz are the true dimensions of the field. The array data
+     * contains also one ghost layer on each side, so it will have
+     * dimensions nx+2 x ny+2 x nz+2 */
+    int nx;                     /* Local dimensions of the field */
+    int ny;
+    int nz;
+    int nx_full;                /* Global dimensions of the field */
+    int ny_full;
+    int nz_full;
+    int x0;                     /* Global indices of the first inner point */
+    int y0;
+    int z0;
+    double dx;
+    double dy;
+    double dz;
+    real *data;
+} field3d;
+
+/* Datatype for the parallelization information of the 3D solver */
+typedef struct {
+    int size;                   /* Number of MPI tasks */
+    int rank;
+    int dims[3];               /* Process grid */
+    int coords[3];             /* Position of this rank in the grid */
+    int nb[6];                 /* Ranks of the neighbours in the directions
+                                * -x, +x, -y, +y, -z and +z */
+    int grid[3];               /* Process grid given with -p, zeros to
+                                * choose it from the field shape */
+    MPI_Comm comm;             /* Cartesian communicator */
+    MPI_Request requests[12];  /* Requests for non-blocking communication */
+    MPI_Datatype facetype[3];  /* MPI Datatypes for the inner part of the
+                                * faces normal to x, y and z */
+    MPI_Datatype restarttype;  /* MPI Datatype for communication in restart I/O */
+    MPI_Datatype filetype;     /* MPI Datatype for file view in restart I/O */
+} parallel_data3d;
+
+/* file name for 3D restart checkpoints */
+#ifdef HEAT_FLOAT_STORAGE
+#define CHECKPOINT3D "HEAT3D_RESTART_float.dat"
+#else
+#define CHECKPOINT3D "HEAT3D_RESTART.dat"
+#endif
+
+/* Inline function for indexing the 3D arrays, height and width are the
+ * second and third dimension of the array */
+static inline long idx3d(int i, int j, int k, int height, int width)
+{
+    return ((long) i * height + j) * width + k;
+}
+
+/* Function prototypes */
+void initialize3d(int argc, char *argv[], field3d *temperature1,
+                  field3d *temperature2, int *nsteps, int *plane,
+                  parallel_data3d *parallel, int *iter0);
+
+void parallel_setup3d(parallel_data3d *parallel, int nx, int ny, int nz);
+
+void set_field_dimensions3d(field3d *temperature, int nx, int ny, int nz,
+                            parallel_data3d *parallel);
+
+void generate_field3d(field3d *temperature, parallel_data3d *parallel);
+
+void allocate_field3d(field3d *temperature);
+
+void copy_field3d(field3d *temperature1, field3d *temperature2);
+
+void swap_fields3d(field3d *temperature1, field3d *temperature2);
+
+void exchange_init3d(field3d *temperature, parallel_data3d *parallel);
+
+void exchange_finalize3d(parallel_data3d *parallel);
+
+void evolve_interior3d(field3d *curr, field3d *prev, double a, double dt);
+
+void evolve_edges3d(field3d *curr, field3d *prev, double a, double dt);
+
+void write_plane(field3d *temperature, int plane, int iter,
+                 parallel_data3d *parallel);
+
+void write_restart3d(field3d *temperature, parallel_data3d *parallel,
+                     int iter);
+
+void read_restart3d(field3d *temperature, parallel_data3d *parallel,
+                    int *iter);
+
+void finalize3d(field3d *temperature1, field3d *temperature2,
+                parallel_data3d *parallel);
+
+#endif  /* __HEAT3D_H__ */
@@ -0,0 +1,310 @@
+/* Crank-Nicolson time integrator for heat equation solver
+ *
+ * With the option -m cn every step solves
+ *
+ *     (I - h L) u^{n+1} = (I + h L) u^n,      h = a*dt/2,
+ *
+ * where L is the five-point Laplacian, instead of doing the explicit
+ * update. The scheme is second order in time and unconditionally stable,
+ * so the time step given with -d is not limited by the grid spacing.
+ *
+ * The boundary values do not change in time, so the system is solved for
+ * the increment d = u^{n+1} - u^n, which vanishes on the boundary:
+ *
+ *     (I - h L) d = 2 h L u^n.
+ *
+ * The matrix is symmetric positive definite and the system is solved with
+ * the preconditioned conjugate gradient method, starting from the
+ * increment of the previous step. The ghost layers of the search
+ * direction are exchanged with exchange_init and exchange_finalize, so
+ * with the engine selected with -e, while the interior of the product
+ * with the matrix is computed. The preconditioner is a symmetric red-black
+ * Gauss-Seidel sweep over the local part of the field that ignores the
+ * coupling to the neighbouring ranks (block Jacobi), so it needs no
+ * communication and keeps the preconditioned matrix symmetric.
+ *
+ * evolve_implicit does the same for the theta method
+ *
+ *     (I - theta a dt L) d = a dt L u^n,
+ *
+ * Crank-Nicolson being theta = 1/2. The backward Euler method, theta = 1,
+ * damps all the modes and is the coarse propagator of the Parareal mode
+ * (see parareal.c). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Reduction of the norm of the residual relative to that of the right
+ * hand side at which the iteration stops, and the largest number of
+ * iterations in a step */
+#ifdef HEAT_FLOAT_STORAGE
+#define CG_TOLERANCE 1e-5
+#else
+#define CG_TOLERANCE 1e-10
+#endif
+#define CG_MAXITER 1000
+
+/* Increment, residual, preconditioned residual, search direction and the
+ * product of the search direction with the matrix. Only the search
+ * direction is exchanged; the ghost layers of the others stay zero. */
+static field x, r, z, p, q;
+static int allocated = 0;
+
+/* out = diag * in + ox * (up + down) + oy * (left + right) for the points
+ * i0 <= i < i1, j0 <= j < j1. Returns the sum of in * out over them. */
+static double stencil_block(field *out, field *in, double diag, double ox,
+                            double oy, int i0, int i1, int j0, int j1)
+{
+    int i, j, width;
+    double dot = 0.0;
+    width = in->pitch;
+
+    #pragma omp parallel for private(j) reduction(+:dot) schedule(static)
+    for (i = i0; i < i1; i++) {
+        const real *c = &in->data[idx(i, 0, width)];
+        real *o = &out->data[idx(i, 0, width)];
+        for (j = j0; j < j1; j++) {
+            o[j] = diag * c[j] + ox * ((double) c[j - width] + c[j + width]) +
+                   oy * ((double) c[j - 1] + c[j + 1]);
+            dot += (double) c[j] * o[j];
+        }
+    }
+    return dot;
+}
+
+/* Apply the stencil of stencil_block to the inner part of in, whose ghost
+ * layers are exchanged meanwhile. Returns the local sum of in * out. */
+static double apply(field *out, field *in, double diag, double ox,
+                    double oy, parallel_data *parallel)
+{
+    int g, nx, ny;
+    double dot;
+    g = in->nghost;
+    nx = in->nx;
+    ny = in->ny;
+
+    exchange_init(in, parallel);
+    dot = stencil_block(out, in, diag, ox, oy, g + 1, nx + g - 1, g + 1,
+                        ny + g - 1);
+    exchange_finalize(parallel);
+
+    /* First and last row, then the first and last column in between */
+    dot += stencil_block(out, in, diag, ox, oy, g, g + 1, g, ny + g);
+    if (nx > 1)
+        dot += stencil_block(out, in, diag, ox, oy, nx + g - 1, nx + g, g,
+                             ny + g);
+    dot += stencil_block(out, in, diag, ox, oy, g + 1, nx + g - 1, g, g + 1);
+    if (ny > 1)
+        dot += stencil_block(out, in, diag, ox, oy, g + 1, nx + g - 1,
+                             ny + g - 1, ny + g);
+    return dot;
+}
+
+/* Symmetric red-black Gauss-Seidel sweep for the matrix of apply with
+ * the ghost layers of z kept at zero: z = M^-1 r. The forward sweep sets
+ * the red points (i + j even) and then the black ones, the backward sweep
+ * corrects the red points with the final black ones. Returns the local
+ * sums of r * z and r * r in dots. */
+static void precondition(field *z, field *r, double diag, double ox,
+                         double oy, double *dots)
+{
+    int i, j, width, g, nx, ny;
+    double rz = 0.0, rr = 0.0;
+    g = r->nghost;
+    nx = r->nx;
+    ny = r->ny;
+    width = r->pitch;
+
+    #pragma omp parallel private(i, j)
+    {
+        #pragma omp for schedule(static)
+        for (i = g; i < nx + g; i++) {
+            real *zi = &z->data[idx(i, 0, width)];
+            const real *ri = &r->data[idx(i, 0, width)];
+            for (j = g + (i + g) % 2; j < ny + g; j += 2)
+                zi[j] = ri[j] / diag;
+        }
+        #pragma omp for schedule(static)
+        for (i = g; i < nx + g; i++) {
+            real *zi = &z->data[idx(i, 0, width)];
+            const real *ri = &r->data[idx(i, 0, width)];
+            for (j = g + (i + g + 1) % 2; j < ny + g; j += 2)
+                zi[j] = (ri[j] - ox * ((double) zi[j - width] +
+                                       zi[j + width]) -
+                         oy * ((double) zi[j - 1] + zi[j + 1])) / diag;
+        }
+        #pragma omp for schedule(static)
+        for (i = g; i < nx + g; i++) {
+            real *zi = &z->data[idx(i, 0, width)];
+            for (j = g + (i + g) % 2; j < ny + g; j += 2)
+                zi[j] -= (ox * ((double) zi[j - width] + zi[j + width]) +
+                          oy * ((double) zi[j - 1] + zi[j + 1])) / diag;
+        }
+        #pragma omp for reduction(+:rz, rr) schedule(static)
+        for (i = g; i < nx + g; i++) {
+            const real *zi = &z->data[idx(i, 0, width)];
+            const real *ri = &r->data[idx(i, 0, width)];
+            for (j = g; j < ny + g; j++) {
+                rz += (double) ri[j] * zi[j];
+                rr += (double) ri[j] * ri[j];
+            }
+        }
+    }
+    dots[0] = rz;
+    dots[1] = rr;
+}
+
+/* y = y + alpha * v over the inner part of the fields */
+static void axpy(field *y, double alpha, field *v)
+{
+    int i, j, width, g;
+    g = y->nghost;
+    width = y->pitch;
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = g; i < y->nx + g; i++) {
+        for (j = idx(i, g, width); j < idx(i, y->ny + g, width); j++)
+            y->data[j] += alpha * v->data[j];
+    }
+}
+
+/* y = v + beta * y over the inner part of the fields */
+static void aypx(field *y, double beta, field *v)
+{
+    int i, j, width, g;
+    g = y->nghost;
+    width = y->pitch;
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (i = g; i < y->nx + g; i++) {
+        for (j = idx(i, g, width); j < idx(i, y->ny + g, width); j++)
+            y->data[j] = v->data[j] + beta * y->data[j];
+    }
+}
+
+/* Allocate a work field with the dimensions of temperature */
+static void allocate_work(field *work, field *temperature)
+{
+    *work = *temperature;
+    allocate_field(work);
+}
+
+/* Advance the field by one step of the theta method from prev to curr.
+ * Returns the number of conjugate gradient iterations. */
+int evolve_implicit(field *curr, field *prev, double a, double dt,
+                    double theta, parallel_data *parallel)
+{
+    double cx, cy, diag, ox, oy;
+    double dots[2], bb, rz, pq;
+    int i, j, width, g, iter;
+    g = curr->nghost;
+    width = curr->pitch;
+
+    if (!allocated) {
+        allocate_work(&x, curr);
+        allocate_work(&r, curr);
+        allocate_work(&z, curr);
+        allocate_work(&p, curr);
+        allocate_work(&q, curr);
+        allocated = 1;
+    }
+
+    /* Coefficients of I - theta a dt L, cx and cy are those of the
+     * explicit update */
+    cx = a * dt / (prev->dx * prev->dx);
+    cy = a * dt / (prev->dy * prev->dy);
+    diag = 1.0 + 2.0 * theta * (cx + cy);
+    ox = -theta * cx;
+    oy = -theta * cy;
+
+    /* Right hand side a dt L u^n into r, then r = b - A x for the
+     * increment of the previous step in x */
+    apply(&r, prev, -2.0 * (cx + cy), cx, cy, parallel);
+    copy_field(&x, &p);
+    apply(&q, &p, diag, ox, oy, parallel);
+    bb = 0.0;
+    #pragma omp parallel for private(j) reduction(+:bb) schedule(static)
+    for (i = g; i < curr->nx + g; i++) {
+        for (j = idx(i, g, width); j < idx(i, curr->ny + g, width); j++) {
+            bb += (double) r.data[j] * r.data[j];
+            r.data[j] -= q.data[j];
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &bb, 1, MPI_DOUBLE, MPI_SUM, parallel->comm);
+    precondition(&z, &r, diag, ox, oy, dots);
+    MPI_Allreduce(MPI_IN_PLACE, dots, 2, MPI_DOUBLE, MPI_SUM,
+                  parallel->comm);
+
+    rz = dots[0];
+    iter = 0;
+    if (bb == 0.0) {
+        /* Steady state, the increment is zero */
+        memset(x.data, 0, (size_t) (x.nx + 2 * g) * width * sizeof(real));
+    } else {
+        copy_field(&z, &p);
+        while (dots[1] > CG_TOLERANCE * CG_TOLERANCE * bb &&
+               iter < CG_MAXITER) {
+            pq = apply(&q, &p, diag, ox, oy, parallel);
+            MPI_Allreduce(MPI_IN_PLACE, &pq, 1, MPI_DOUBLE, MPI_SUM,
+                          parallel->comm);
+            axpy(&x, rz / pq, &p);
+            axpy(&r, -rz / pq, &q);
+            precondition(&z, &r, diag, ox, oy, dots);
+            MPI_Allreduce(MPI_IN_PLACE, dots, 2, MPI_DOUBLE, MPI_SUM,
+                          parallel->comm);
+            aypx(&p, dots[0] / rz, &z);
+            rz = dots[0];
+            iter++;
+        }
+        if (iter == CG_MAXITER && parallel->rank == 0)
+            printf("Conjugate gradient did not converge in %d iterations, "
+                   "relative residual %e\n", iter,
+                   sqrt(dots[1] / bb));
+    }
+
+    /* u^{n+1} = u^n + d, the change of the points is the residual of the
+     * steady state mode */
+    #pragma omp parallel private(i, j)
+    {
+        double res[2] = {0.0, 0.0}, d;
+        #pragma omp for schedule(static)
+        for (i = g; i < curr->nx + g; i++) {
+            for (j = idx(i, g, width); j < idx(i, curr->ny + g, width);
+                 j++) {
+                curr->data[j] = prev->data[j] + x.data[j];
+                d = x.data[j];
+                res[1] += d * d;
+                d = d < 0 ? -d : d;
+                res[0] = d > res[0] ? d : res[0];
+            }
+        }
+        merge_residual(res);
+    }
+    return iter;
+}
+
+/* Advance the field by one Crank-Nicolson step from prev to curr. Returns
+ * the number of conjugate gradient iterations. */
+int evolve_cn(field *curr, field *prev, double a, double dt,
+              parallel_data *parallel)
+{
+    return evolve_implicit(curr, prev, a, dt, 0.5, parallel);
+}
+
+/* Free the work fields of the Crank-Nicolson integrator */
+void cn_free(void)
+{
+    if (!allocated)
+        return;
+    deallocate_field(&x);
+    deallocate_field(&r);
+    deallocate_field(&z);
+    deallocate_field(&p);
+    deallocate_field(&q);
+    allocated = 0;
+}
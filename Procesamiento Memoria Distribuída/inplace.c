@@ -0,0 +1,184 @@
+/* In-place update of a single field for heat equation solver
+ *
+ * With the option -I the field is advanced without the second buffer, so
+ * that a rank can hold a field twice as large. The row kernels read the
+ * rows above and below at a fixed distance, so the old values of the rows
+ * are kept in a small buffer: every thread updates its own band of rows
+ * in chunks of INPLACE_ROWS rows, copying the old rows of a chunk into
+ * the buffer before they are overwritten and rolling the last two of them
+ * over to the next chunk. The rows next to the bands of the other threads
+ * are copied before all the threads start to write.
+ *
+ * The halo is exchanged while the interior is updated, as in the two
+ * buffer scheme. The edge rows and columns are not touched by the
+ * interior update, but the rows and columns next to them are, so their
+ * old values are saved first. After the exchange the edges are updated
+ * from strips of old values: the rows through the row kernel and the
+ * columns through the same kernel on transposed strips, with cx and cy
+ * swapped. The two terms of the stencil are then only added in the other
+ * order, so the result is bitwise identical to the two buffer scheme. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "heat.h"
+
+/* Rows updated by a thread between the copies into its buffer */
+#define INPLACE_ROWS 8
+
+/* Rolling rows of old values of the threads, the old values next to the
+ * edges saved before the interior update, and the strips of old values
+ * of the edges */
+static real *rows = NULL;
+static real *saved = NULL;
+static real *strips = NULL;
+
+/* Allocate the buffers for a field of nx x ny inner points */
+void inplace_setup(field *temperature)
+{
+    int nthreads = 1, nx = temperature->nx, ny = temperature->ny;
+
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    rows = malloc_2d(nthreads * (INPLACE_ROWS + 3), temperature->pitch);
+    saved = malloc_2d(2, nx + ny);
+    strips = malloc_2d(1, 6 * temperature->pitch + 7 * (nx + 2));
+}
+
+void inplace_free(void)
+{
+    free_2d(rows);
+    free_2d(saved);
+    free_2d(strips);
+    rows = saved = strips = NULL;
+}
+
+/* Update the interior points, those away from the ghost layers, in
+ * place */
+void evolve_interior_inplace(field *temperature, double a, double dt)
+{
+    int i, nx, ny, width;
+    double cx, cy;
+    real *u = temperature->data;
+
+    nx = temperature->nx;
+    ny = temperature->ny;
+    width = temperature->pitch;
+    if (nx < 3 || ny < 3)
+        return;
+    cx = a * dt / (temperature->dx * temperature->dx);
+    cy = a * dt / (temperature->dy * temperature->dy);
+
+    /* Old values next to the edges, in the order up, down, left and
+     * right */
+    memcpy(saved, &u[idx(2, 2, width)], (ny - 2) * sizeof(real));
+    memcpy(&saved[ny - 2], &u[idx(nx - 1, 2, width)],
+           (ny - 2) * sizeof(real));
+    for (i = 2; i < nx; i++) {
+        saved[2 * (ny - 2) + i - 2] = u[idx(i, 2, width)];
+        saved[2 * (ny - 2) + nx - 2 + i - 2] = u[idx(i, ny - 1, width)];
+    }
+
+    #pragma omp parallel private(i)
+    {
+        int nthreads = 1, tid = 0, start, end, i0, i1;
+        real *buf, *tail;
+#ifdef _OPENMP
+        nthreads = omp_get_num_threads();
+        tid = omp_get_thread_num();
+#endif
+        /* Band of rows of this thread, the old rows of a chunk start from
+         * the second row of the buffer, the row after the band is kept
+         * at the end. Only the inner points are copied, the ghost layers
+         * may still be in flight. */
+        buf = &rows[(size_t) tid * (INPLACE_ROWS + 3) * width];
+        tail = &buf[(INPLACE_ROWS + 2) * width];
+        start = 2 + block_start(nx - 2, nthreads, tid);
+        end = 2 + block_start(nx - 2, nthreads, tid + 1);
+        if (start < end) {
+            memcpy(&buf[1], &u[idx(start - 1, 1, width)], ny * sizeof(real));
+            memcpy(&buf[width + 1], &u[idx(start, 1, width)],
+                   ny * sizeof(real));
+            memcpy(&tail[1], &u[idx(end, 1, width)], ny * sizeof(real));
+        }
+        #pragma omp barrier
+
+        for (i0 = start; i0 < end; i0 = i1) {
+            i1 = i0 + INPLACE_ROWS < end ? i0 + INPLACE_ROWS : end;
+            for (i = i0 + 1; i <= i1; i++)
+                memcpy(&buf[idx(i - i0 + 1, 1, width)],
+                       i == end ? &tail[1] : &u[idx(i, 1, width)],
+                       ny * sizeof(real));
+            for (i = i0; i < i1; i++)
+                evolve_row(&u[idx(i, 2, width)],
+                           &buf[idx(i - i0 + 1, 2, width)], width, ny - 2,
+                           cx, cy);
+            /* The last two old rows are the first ones of the next
+             * chunk */
+            memmove(buf, &buf[idx(i1 - i0, 0, width)],
+                    2 * width * sizeof(real));
+        }
+    }
+}
+
+/* Update the edge rows and columns in place, after the interior and the
+ * halo exchange */
+void evolve_edges_inplace(field *temperature, double a, double dt)
+{
+    int i, j, nx, ny, width, height;
+    double cx, cy;
+    real *u = temperature->data;
+    real *up, *down, *left, *right, *line;
+
+    nx = temperature->nx;
+    ny = temperature->ny;
+    width = temperature->pitch;
+    height = nx + 2;
+    cx = a * dt / (temperature->dx * temperature->dx);
+    cy = a * dt / (temperature->dy * temperature->dy);
+
+    /* Three old rows around the upper and the lower edge, and three old
+     * columns around the left and the right edge, stored as rows */
+    up = strips;
+    down = &up[3 * width];
+    left = &down[3 * width];
+    right = &left[3 * height];
+    line = &right[3 * height];
+    memcpy(up, &u[idx(0, 0, width)], 3 * width * sizeof(real));
+    memcpy(down, &u[idx(nx - 1, 0, width)], 3 * width * sizeof(real));
+    for (i = 1; i <= nx; i++) {
+        for (j = 0; j < 3; j++) {
+            left[idx(j, i, height)] = u[idx(i, j, width)];
+            right[idx(j, i, height)] = u[idx(i, ny - 1 + j, width)];
+        }
+    }
+    if (nx >= 3 && ny >= 3) {
+        /* Overwritten by the interior update */
+        memcpy(&up[idx(2, 2, width)], saved, (ny - 2) * sizeof(real));
+        memcpy(&down[2], &saved[ny - 2], (ny - 2) * sizeof(real));
+        memcpy(&left[idx(2, 2, height)], &saved[2 * (ny - 2)],
+               (nx - 2) * sizeof(real));
+        memcpy(&right[2], &saved[2 * (ny - 2) + nx - 2],
+               (nx - 2) * sizeof(real));
+    }
+
+    /* The corners are updated with the rows */
+    evolve_row(&u[idx(1, 1, width)], &up[idx(1, 1, width)], width, ny, cx,
+               cy);
+    evolve_row(&u[idx(nx, 1, width)], &down[idx(1, 1, width)], width, ny,
+               cx, cy);
+    if (nx < 3)
+        return;
+    evolve_row(&line[2], &left[idx(1, 2, height)], height, nx - 2, cy, cx);
+    for (i = 2; i < nx; i++)
+        u[idx(i, 1, width)] = line[i];
+    evolve_row(&line[2], &right[idx(1, 2, height)], height, nx - 2, cy, cx);
+    for (i = 2; i < nx; i++)
+        u[idx(i, ny, width)] = line[i];
+}
@@ -9,6 +9,26 @@
 #include "heat.h"
 #include "pngwriter.h"
 
+/* Datatype of the inner block of rank p in the full nx_full x ny_full
+ * array, whose first point is returned in ix and jy. The caller frees the
+ * datatype. */
+static MPI_Datatype block_type(field *temperature, parallel_data *parallel,
+                               int p, int *ix, int *jy)
+{
+    MPI_Datatype type;
+    int dims[2], periods[2], coords[2], nx, ny;
+
+    MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
+    MPI_Cart_coords(parallel->comm, p, 2, coords);
+    *ix = parallel->cuts[0][coords[0]];
+    *jy = parallel->cuts[1][coords[1]];
+    nx = parallel->cuts[0][coords[0] + 1] - *ix;
+    ny = parallel->cuts[1][coords[1] + 1] - *jy;
+    MPI_Type_vector(nx, ny, temperature->ny_full, HEAT_MPI_REAL, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
 /* Output routine that prints out a picture of the temperature
  * distribution. */
 void write_field(field *temperature, int iter, parallel_data *parallel)
@@ -18,13 +38,17 @@ void write_field(field *temperature, int iter, parallel_data *parallel)
     /* The actual write routine takes only the actual data
      * (without ghost layers) so we need array for that. */
     int height, width;
-    double *full_data;
+    real *full_data;
+#ifdef HEAT_FLOAT_STORAGE
+    double *png_data;
+#endif
 
-    int coords[2];
+    MPI_Datatype block;
     int ix, jy;
 
-    int i, p;
+    int i, p, g;
 
+    g = temperature->nghost;
     height = temperature->nx_full;
     width = temperature->ny_full;
 
@@ -33,20 +57,27 @@ void write_field(field *temperature, int iter, parallel_data *parallel)
         full_data = malloc_2d(height, width);
         for (i = 0; i < temperature->nx; i++)
             memcpy(&full_data[idx(i, 0, width)], 
-                     &temperature->data[idx(i+1, 1, temperature->ny + 2)],
-                   temperature->ny * sizeof(double));
+                   &temperature->data[idx(i + g, g, temperature->pitch)],
+                   temperature->ny * sizeof(real));
         /* Receive data from other ranks */
         for (p = 1; p < parallel->size; p++) {
-            MPI_Cart_coords(parallel->comm, p, 2, coords);
-            ix = coords[0] * temperature->nx;
-            jy = coords[1] * temperature->ny;
-            MPI_Recv(&full_data[idx(ix, jy, width)], 1, 
-                     parallel->subarraytype, p, 22, 
+            block = block_type(temperature, parallel, p, &ix, &jy);
+            MPI_Recv(&full_data[idx(ix, jy, width)], 1, block, p, 22,
                      parallel->comm, MPI_STATUS_IGNORE);
+            MPI_Type_free(&block);
         }
         /* Write out the data to a png file */
         sprintf(filename, "%s_%04d.png", "heat", iter);
+#ifdef HEAT_FLOAT_STORAGE
+        /* save_png takes the values in double precision */
+        png_data = malloc((size_t) height * width * sizeof(double));
+        for (i = 0; i < height * width; i++)
+            png_data[i] = full_data[i];
+        save_png(png_data, height, width, filename, 'c');
+        free(png_data);
+#else
         save_png(full_data, height, width, filename, 'c');
+#endif
         free_2d(full_data);
     } else {
         /* Send data */
@@ -63,10 +94,11 @@ void read_field(field *temperature1, field *temperature2, char *filename,
                 parallel_data *parallel)
 {
     FILE *fp;
-    int nx, ny, i, j;
-    double *full_data;
+    int nx, ny, i, j, g, width;
+    real *full_data;
+    double value;
 
-    int coords[2];
+    MPI_Datatype block;
     int ix, jy, p;
 
     int count;
@@ -84,11 +116,12 @@ void read_field(field *temperature1, field *temperature2, char *filename,
     set_field_dimensions(temperature2, nx, ny, parallel);
 
 
+    g = temperature1->nghost;
+    width = temperature1->pitch;
+
     /* Allocate arrays (including ghost layers) */
-    temperature1->data =
-        malloc_2d(temperature1->nx + 2, temperature1->ny + 2);
-    temperature2->data =
-        malloc_2d(temperature2->nx + 2, temperature2->ny + 2);
+    allocate_field(temperature1);
+    allocate_field(temperature2);
 
     if (parallel->rank == 0) {
         /* Full array */
@@ -97,21 +130,21 @@ void read_field(field *temperature1, field *temperature2, char *filename,
         /* Read the actual data */
         for (i = 0; i < nx; i++) {
             for (j = 0; j < ny; j++) {
-                count = fscanf(fp, "%lf", &full_data[idx(i, j, ny)]);
+                count = fscanf(fp, "%lf", &value);
+                full_data[idx(i, j, ny)] = value;
             }
         }
         /* Copy to own local array */
         for (i = 0; i < temperature1->nx; i++) {
-            memcpy(&temperature1->data[idx(i+1, 1, temperature1->ny + 2)],
-                   &full_data[idx(i, 0, ny)], temperature1->ny * sizeof(double));
+            memcpy(&temperature1->data[idx(i + g, g, width)],
+                   &full_data[idx(i, 0, ny)], temperature1->ny * sizeof(real));
         }
         /* Send to other processes */
         for (p = 1; p < parallel->size; p++) {
-            MPI_Cart_coords(parallel->comm, p, 2, coords);
-            ix = coords[0] * temperature1->nx;
-            jy = coords[1] * temperature1->ny;
-            MPI_Send(&full_data[idx(ix, jy, ny)], 1, parallel->subarraytype, 
-                     p, 44, parallel->comm);
+            block = block_type(temperature1, parallel, p, &ix, &jy);
+            MPI_Send(&full_data[idx(ix, jy, ny)], 1, block, p, 44,
+                     parallel->comm);
+            MPI_Type_free(&block);
         }
     } else {
         /* Receive data */
@@ -121,17 +154,17 @@ void read_field(field *temperature1, field *temperature2, char *filename,
     }
 
     /* Set the boundary values */
-    for (i = 0; i < temperature1->nx + 1; i++) {
-        temperature1->data[idx(i, 0, temperature1->ny + 2)] = 
-            temperature1->data[idx(i, 1, temperature1->ny + 2)];
-        temperature1->data[idx(i, temperature1->ny + 1, temperature1->ny + 2)] =
-            temperature1->data[idx(i, temperature1->ny, temperature1->ny + 2)];
+    for (i = g - 1; i < temperature1->nx + g; i++) {
+        temperature1->data[idx(i, g - 1, width)] = 
+            temperature1->data[idx(i, g, width)];
+        temperature1->data[idx(i, temperature1->ny + g, width)] =
+            temperature1->data[idx(i, temperature1->ny + g - 1, width)];
     }
-    for (j = 0; j < temperature1->ny + 2; j++) {
-        temperature1->data[idx(0, j, temperature1->ny + 2)] = 
-                        temperature1->data[idx(1, j, temperature1->ny + 2)];
-        temperature1->data[idx(temperature1->nx + 1, j, temperature1->ny + 2)] =
-            temperature1->data[idx(temperature1->nx, j, temperature1->ny + 2)];
+    for (j = g - 1; j < temperature1->ny + g + 1; j++) {
+        temperature1->data[idx(g - 1, j, width)] = 
+                        temperature1->data[idx(g, j, width)];
+        temperature1->data[idx(temperature1->nx + g, j, width)] =
+            temperature1->data[idx(temperature1->nx + g - 1, j, width)];
     }
 
     copy_field(temperature1, temperature2);
@@ -161,10 +194,13 @@ void write_restart(field *temperature, parallel_data *parallel, int iter)
         MPI_File_write(fp, &iter, 1, MPI_INT, MPI_STATUS_IGNORE);
     }
 
+    /* The field follows the header, the view starts there so that the
+     * file does not depend on the blocks of the ranks, which rebalance
+     * may have moved */
     disp = 3 * sizeof(int);
-    MPI_File_set_view(fp, 0, MPI_DOUBLE, parallel->filetype, "native", 
+    MPI_File_set_view(fp, disp, HEAT_MPI_REAL, parallel->filetype, "native",
                       MPI_INFO_NULL);
-    MPI_File_write_at_all(fp, disp, temperature->data,
+    MPI_File_write_at_all(fp, 0, temperature->data,
                           1, parallel->restarttype, MPI_STATUS_IGNORE);
     MPI_File_close(&fp);
 }
@@ -193,10 +229,11 @@ void read_restart(field *temperature, parallel_data *parallel, int *iter)
     allocate_field(temperature);
 
 
+    /* The field follows the header */
     disp = 3 * sizeof(int);
-    MPI_File_set_view(fp, 0, MPI_DOUBLE, parallel->filetype, "native", 
+    MPI_File_set_view(fp, disp, HEAT_MPI_REAL, parallel->filetype, "native",
                       MPI_INFO_NULL);
-    MPI_File_read_at_all(fp, disp, temperature->data,
+    MPI_File_read_at_all(fp, 0, temperature->data,
                           1, parallel->restarttype, MPI_STATUS_IGNORE);
     MPI_File_close(&fp);
 }
@@ -0,0 +1,146 @@
+/* I/O related functions for the 3D heat equation solver */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "heat3d.h"
+#include "pngwriter.h"
+
+/* Output routine that prints out a picture of the temperature distribution
+ * in the plane normal to z with the global index plane. The ranks whose
+ * block contains the plane send its inner part to rank 0. */
+void write_plane(field3d *temperature, int plane, int iter,
+                 parallel_data3d *parallel)
+{
+    char filename[64];
+    int height, width, i, j, k, p, ix, jy, nx, ny;
+    int coords[3];
+    int *dims = parallel->dims;
+    double *full_data;
+    real *buffer;
+    MPI_Datatype block;
+
+    height = temperature->nx_full;
+    width = temperature->ny_full;
+
+    /* Pack the own part of the plane */
+    buffer = NULL;
+    k = plane - temperature->z0 + 1;
+    if (k >= 1 && k <= temperature->nz) {
+        buffer = malloc((size_t) temperature->nx * temperature->ny *
+                        sizeof(real));
+        for (i = 0; i < temperature->nx; i++)
+            for (j = 0; j < temperature->ny; j++)
+                buffer[i * temperature->ny + j] =
+                    temperature->data[idx3d(i + 1, j + 1, k,
+                                            temperature->ny + 2,
+                                            temperature->nz + 2)];
+    }
+
+    if (parallel->rank == 0) {
+        full_data = malloc((size_t) height * width * sizeof(double));
+        for (p = 0; p < parallel->size; p++) {
+            MPI_Cart_coords(parallel->comm, p, 3, coords);
+            if (plane < block_start(temperature->nz_full, dims[2],
+                                    coords[2]) ||
+                plane >= block_start(temperature->nz_full, dims[2],
+                                     coords[2] + 1))
+                continue;
+            ix = block_start(height, dims[0], coords[0]);
+            jy = block_start(width, dims[1], coords[1]);
+            nx = block_start(height, dims[0], coords[0] + 1) - ix;
+            ny = block_start(width, dims[1], coords[1] + 1) - jy;
+            if (p == 0) {
+                for (i = 0; i < nx; i++)
+                    for (j = 0; j < ny; j++)
+                        full_data[idx(ix + i, jy + j, width)] =
+                            buffer[i * ny + j];
+                continue;
+            }
+            /* save_png takes the values in double precision */
+            MPI_Type_vector(nx, ny, width, MPI_DOUBLE, &block);
+            MPI_Type_commit(&block);
+            MPI_Recv(&full_data[idx(ix, jy, width)], 1, block, p, 22,
+                     parallel->comm, MPI_STATUS_IGNORE);
+            MPI_Type_free(&block);
+        }
+        sprintf(filename, "%s_%04d.png", "heat3d", iter);
+        save_png(full_data, height, width, filename, 'c');
+        free(full_data);
+    } else if (buffer != NULL) {
+        /* Send the plane converted to double precision */
+        full_data = malloc((size_t) temperature->nx * temperature->ny *
+                           sizeof(double));
+        for (i = 0; i < temperature->nx * temperature->ny; i++)
+            full_data[i] = buffer[i];
+        MPI_Ssend(full_data, temperature->nx * temperature->ny, MPI_DOUBLE,
+                  0, 22, parallel->comm);
+        free(full_data);
+    }
+    free(buffer);
+}
+
+/* Write a restart checkpoint that contains field dimensions, current
+ * iteration number and temperature field. */
+void write_restart3d(field3d *temperature, parallel_data3d *parallel,
+                     int iter)
+{
+    MPI_File fp;
+    MPI_Offset disp;
+
+    // open the file and write the dimensions
+    MPI_File_open(MPI_COMM_WORLD, CHECKPOINT3D,
+                  MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fp);
+    if (parallel->rank == 0) {
+        MPI_File_write(fp, &temperature->nx_full, 1, MPI_INT,
+                       MPI_STATUS_IGNORE);
+        MPI_File_write(fp, &temperature->ny_full, 1, MPI_INT,
+                       MPI_STATUS_IGNORE);
+        MPI_File_write(fp, &temperature->nz_full, 1, MPI_INT,
+                       MPI_STATUS_IGNORE);
+        MPI_File_write(fp, &iter, 1, MPI_INT, MPI_STATUS_IGNORE);
+    }
+
+    /* The field follows the header, the view starts there */
+    disp = 4 * sizeof(int);
+    MPI_File_set_view(fp, disp, HEAT_MPI_REAL, parallel->filetype,
+                      "native", MPI_INFO_NULL);
+    MPI_File_write_at_all(fp, 0, temperature->data,
+                          1, parallel->restarttype, MPI_STATUS_IGNORE);
+    MPI_File_close(&fp);
+}
+
+/* Read a restart checkpoint that contains field dimensions, current
+ * iteration number and temperature field. */
+void read_restart3d(field3d *temperature, parallel_data3d *parallel,
+                    int *iter)
+{
+    MPI_File fp;
+    MPI_Offset disp;
+
+    int nx, ny, nz;
+
+    MPI_File_open(MPI_COMM_WORLD, CHECKPOINT3D, MPI_MODE_RDONLY,
+                  MPI_INFO_NULL, &fp);
+
+    // read grid size and current iteration
+    MPI_File_read_all(fp, &nx, 1, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_File_read_all(fp, &ny, 1, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_File_read_all(fp, &nz, 1, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_File_read_all(fp, iter, 1, MPI_INT, MPI_STATUS_IGNORE);
+    // set correct dimensions to MPI metadata
+    parallel_setup3d(parallel, nx, ny, nz);
+    // set local dimensions and allocate memory for the data
+    set_field_dimensions3d(temperature, nx, ny, nz, parallel);
+    allocate_field3d(temperature);
+
+    /* The field follows the header, the view starts there */
+    disp = 4 * sizeof(int);
+    MPI_File_set_view(fp, disp, HEAT_MPI_REAL, parallel->filetype,
+                      "native", MPI_INFO_NULL);
+    MPI_File_read_at_all(fp, 0, temperature->data,
+                         1, parallel->restarttype, MPI_STATUS_IGNORE);
+    MPI_File_close(&fp);
+}
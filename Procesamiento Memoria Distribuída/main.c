@@ -81,6 +81,7 @@ int main(int argc, char **argv)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <mpi.h>
 
@@ -100,55 +101,373 @@ int main(int argc, char **argv)
 
     parallel_data parallelization; //!< Parallelization info
 
+    options opts;                  //!< Run time options
+
     int iter, iter0;               //!< Iteration counter
 
+    int substep;                   //!< Step since the last deep halo exchange
+
+    int nsub, pending = 0;         //!< Steps done at once by evolve_skewed
+
     double dx2, dy2;            //!< delta x and y squared
 
     double start_clock;        //!< Time stamps
 
-    MPI_Init(&argc, &argv);
+    double local[2], residual[2] = {0.0, 0.0}; //!< Largest change and sum
+                               //!< of the squared changes of a step on this
+                               //!< rank and on all of them
+
+    MPI_Request reduction[2];  //!< Reductions of the residual
+
+    int reducing = 0;          //!< Reduction of the residual in progress
+
+    int converged = 0;         //!< Iteration at which the steady state was
+                               //!< reached, 0 if not yet
+
+    long cg_iterations = 0;    //!< Conjugate gradient iterations of the
+                               //!< Crank-Nicolson steps
+
+    double errors[2];          //!< Error of the sine field, see field_error
+
+    double busy = 0.0;         //!< Time spent in the updates since the last
+                               //!< load balance check
+
+    double skipped;            //!< Fraction of the updates skipped in the
+                               //!< quiescent tiles
+
+    field *last;               //!< Field of the last step, previous after
+                               //!< the swap or the single one with -I
+
+    int provided;              //!< Thread support level of the MPI library
+
+    /* Only the master thread calls MPI, outside of the parallel regions */
+    MPI_Init_thread(&argc, &argv, HEAT_THREAD_LEVEL, &provided);
+    if (provided < HEAT_THREAD_LEVEL) {
+        printf("The MPI library does not provide the required level of "
+               "thread support\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
     MPI_Comm_rank(MPI_COMM_WORLD, &parallelization.rank);
     MPI_Comm_size(MPI_COMM_WORLD, &parallelization.size);
 
-    initialize(argc, argv, &current, &previous, &nsteps, &parallelization, &iter0);
+    initialize(argc, argv, &current, &previous, &nsteps, &parallelization,
+               &iter0, &opts);
 
-    /* Output the initial field */
-    write_field(&current, iter0, &parallelization);
-    iter0++;
-
-    /* Largest stable time step */
+    /* Largest stable time step, or the one given with -d. The largest
+     * eigenvalue of the fourth-order stencil is 4/3 of that of the
+     * five-point one. */
     dx2 = current.dx * current.dx;
     dy2 = current.dy * current.dy;
     dt = dx2 * dy2 / (2.0 * a * (dx2 + dy2));
+    if (stencil_radius() == 2)
+        dt *= 0.75;
+    if (opts.dt > 0.0) {
+        if (opts.method == METHOD_EXPLICIT && opts.dt > dt) {
+            if (parallelization.rank == 0)
+                printf("Time step %g exceeds the stability limit %g of the "
+                       "explicit method\n", opts.dt, dt);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        dt = opts.dt;
+    }
+
+    if (opts.benchmark) {
+        benchmark_kernels(&current, &previous, a, dt, opts.benchmark,
+                          &parallelization);
+        benchmark_pitch(&current, &previous, a, dt, opts.benchmark,
+                        &parallelization);
+        benchmark_halo(&current, opts.benchmark, &parallelization);
+        finalize(&current, &previous, &parallelization);
+        MPI_Finalize();
+        return 0;
+    }
+
+    /* Output the initial field */
+    if (parallelization.slice == 0) {
+        write_field(&current, iter0, &parallelization);
+    }
+    iter0++;
+
+    if (opts.method == METHOD_MG) {
+        /* Steady state directly, with at most nsteps multigrid cycles */
+        start_clock = MPI_Wtime();
+        iter = solve_multigrid(&current, opts.tolerance, nsteps, opts.wcycle,
+                               &parallelization);
+        if (parallelization.rank == 0) {
+            printf("Multigrid took %.3f seconds.\n",
+                   MPI_Wtime() - start_clock);
+            printf("Reference value at 5,5: %f\n",
+                   current.data[idx(5 + current.nghost - 1,
+                                    5 + current.nghost - 1,
+                                    current.pitch)]);
+        }
+        write_field(&current, iter0 + iter, &parallelization);
+        finalize(&current, &previous, &parallelization);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (parallelization.slices > 1) {
+        /* The time slices in parallel, the last one has the final field */
+        start_clock = MPI_Wtime();
+        iter = evolve_parareal(&current, a, dt, nsteps, opts.tolerance,
+                               &parallelization);
+        if (parallelization.slice == parallelization.slices - 1) {
+            if (parallelization.rank == 0) {
+                printf("Parareal converged in %d iterations\n", iter);
+                printf("Iteration took %.3f seconds.\n",
+                       MPI_Wtime() - start_clock);
+                printf("Reference value at 5,5: %f\n",
+                       current.data[idx(5 + current.nghost - 1,
+                                        5 + current.nghost - 1,
+                                        current.pitch)]);
+            }
+            write_field(&current, iter0 + nsteps, &parallelization);
+        }
+        finalize(&current, &previous, &parallelization);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (opts.method == METHOD_SPECTRAL) {
+        /* All the nsteps steps at once in the eigenbasis */
+        start_clock = MPI_Wtime();
+        evolve_spectral(&current, a, dt, nsteps, &parallelization);
+        if (parallelization.rank == 0) {
+            printf("Spectral integration took %.3f seconds.\n",
+                   MPI_Wtime() - start_clock);
+            printf("Reference value at 5,5: %f\n",
+                   current.data[idx(5 + current.nghost - 1,
+                                    5 + current.nghost - 1,
+                                    current.pitch)]);
+        }
+        write_field(&current, iter0 + nsteps, &parallelization);
+        finalize(&current, &previous, &parallelization);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (opts.gradient >= 0.0) {
+        /* Coarse level with refined patches, the uniform field is written
+         * from them */
+        start_clock = MPI_Wtime();
+        iter = iter0 + evolve_amr(&current, a, dt, nsteps, opts.gradient,
+                                  iter0, image_interval, restart_interval,
+                                  &parallelization);
+        if (parallelization.rank == 0) {
+            printf("Iteration took %.3f seconds.\n",
+                   MPI_Wtime() - start_clock);
+            printf("Reference value at 5,5: %f\n",
+                   current.data[idx(5 + current.nghost - 1,
+                                    5 + current.nghost - 1,
+                                    current.pitch)]);
+        }
+        write_field(&current, iter, &parallelization);
+        finalize(&current, &previous, &parallelization);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (opts.blocks > 0) {
+        /* Several blocks per rank, the uniform field is written from
+         * them */
+        start_clock = MPI_Wtime();
+        evolve_blocks(&current, a, dt, nsteps, opts.blocks, opts.hilbert,
+                      iter0, image_interval, restart_interval,
+                      &parallelization);
+        if (parallelization.rank == 0) {
+            printf("Iteration took %.3f seconds.\n",
+                   MPI_Wtime() - start_clock);
+            printf("Reference value at 5,5: %f\n",
+                   current.data[idx(5 + current.nghost - 1,
+                                    5 + current.nghost - 1,
+                                    current.pitch)]);
+        }
+        write_field(&current, iter0 + nsteps, &parallelization);
+        finalize(&current, &previous, &parallelization);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (opts.quiescence > 0.0) {
+        active_setup(&current, opts.quiescence);
+    }
+    if (opts.inplace) {
+        inplace_setup(&current);
+    }
 
     /* Get the start time stamp */
     start_clock = MPI_Wtime();
 
+    /* In the steady state mode the change of the field is accumulated by
+     * the updates */
+    if (opts.tolerance > 0.0) {
+        track_residual(1);
+    }
+
     /* Time evolve */
-    for (iter = iter0; iter < iter0 + nsteps; iter++) {
-        exchange_init(&previous, &parallelization);
-        evolve_interior(&current, &previous, a, dt);
-        exchange_finalize(&parallelization);
-        evolve_edges(&current, &previous, a, dt);
+    for (iter = iter0; iter < iter0 + nsteps && !converged; iter++) {
+        if (opts.inplace && iter == iter0 + nsteps - 1) {
+            /* The field written at the end is that of the step before the
+             * last one, which the last update overwrites */
+            write_field(&current, iter0 + nsteps, &parallelization);
+        }
+        if (opts.quiescence > 0.0) {
+            /* Only the tiles that still change are updated */
+            evolve_active(&current, &previous, a, dt, &parallelization);
+        } else if (opts.inplace) {
+            exchange_init(&current, &parallelization);
+            evolve_interior_inplace(&current, a, dt);
+            exchange_finalize(&parallelization);
+            evolve_edges_inplace(&current, a, dt);
+        } else if (opts.method == METHOD_CN) {
+            cg_iterations += evolve_cn(&current, &previous, a, dt,
+                                       &parallelization);
+        } else if (parallelization.halo_depth == 1 && opts.strips > 0) {
+            /* Poll the exchange while updating the interior in strips */
+            exchange_init(&previous, &parallelization);
+            evolve_overlap(&current, &previous, a, dt, opts.strips,
+                           &parallelization);
+        } else if (parallelization.halo_depth == 1) {
+            exchange_init(&previous, &parallelization);
+            busy -= MPI_Wtime();
+            evolve_interior(&current, &previous, a, dt);
+            busy += MPI_Wtime();
+            exchange_finalize(&parallelization);
+            busy -= MPI_Wtime();
+            evolve_edges(&current, &previous, a, dt);
+            busy += MPI_Wtime();
+        } else if (pending > 0) {
+            /* Already advanced by evolve_skewed, only the fields are
+             * swapped below */
+            pending--;
+        } else {
+            /* Exchange all the ghost layers every halo_depth steps and
+             * consume one of them at each step in between */
+            substep = (iter - iter0) % parallelization.halo_depth;
+            if (substep == 0) {
+                exchange_deep(&previous, &parallelization);
+            }
+            if (opts.skew) {
+                /* Advance up to the next exchange, but stop at the next
+                 * output so that the field is available there */
+                nsub = 1;
+                while (substep + nsub < parallelization.halo_depth &&
+                       iter + nsub < iter0 + nsteps &&
+                       (iter + nsub - 1) % image_interval != 0 &&
+                       (iter + nsub - 1) % restart_interval != 0) {
+                    nsub++;
+                }
+                evolve_skewed(&current, &previous, a, dt,
+                              parallelization.halo_depth - 1 - substep, nsub,
+                              &parallelization);
+                pending = nsub - 1;
+            } else {
+                evolve_deep(&current, &previous, a, dt,
+                            parallelization.halo_depth - 1 - substep,
+                            &parallelization);
+            }
+        }
+        if (opts.tolerance > 0.0) {
+            /* The residual of the previous step has been reduced while
+             * this step was computed, start the reduction of this one
+             * unless the previous step already converged. The field
+             * written at the end is then one step past the converged
+             * one. */
+            if (reducing) {
+                MPI_Waitall(2, reduction, MPI_STATUSES_IGNORE);
+                reducing = 0;
+                if (residual[0] < opts.tolerance) {
+                    converged = iter - 1;
+                }
+            }
+            if (!converged) {
+                take_residual(local);
+                MPI_Iallreduce(&local[0], &residual[0], 1, MPI_DOUBLE,
+                               MPI_MAX, parallelization.comm, &reduction[0]);
+                MPI_Iallreduce(&local[1], &residual[1], 1, MPI_DOUBLE,
+                               MPI_SUM, parallelization.comm, &reduction[1]);
+                reducing = 1;
+            }
+        }
         if (iter % image_interval == 0) {
             write_field(&current, iter, &parallelization);
+            if (opts.quiescence > 0.0) {
+                skipped = skipped_fraction(1, &parallelization);
+                if (parallelization.rank == 0)
+                    printf("Step %d skipped %.1f %% of the updates\n",
+                           iter, 100.0 * skipped);
+            }
         }
         /* write a checkpoint now and then for easy restarting */
         if (iter % restart_interval == 0) {
             write_restart(&current, &parallelization, iter);
         }
         /* Swap current field so that it will be used as previous for the next iteration step */
-        swap_fields(&current, &previous);
+        if (!opts.inplace)
+            swap_fields(&current, &previous);
+        /* Move the blocks if the updates took too unequal times, unless
+         * this was the last step */
+        if (opts.balance > 0 && (iter - iter0 + 1) % opts.balance == 0 &&
+            iter < iter0 + nsteps - 1) {
+            rebalance(&current, &previous, busy, opts.imbalance,
+                      &parallelization);
+            busy = 0.0;
+        }
     }
 
+    /* Residual of the last step */
+    if (reducing) {
+        MPI_Waitall(2, reduction, MPI_STATUSES_IGNORE);
+        if (residual[0] < opts.tolerance) {
+            converged = iter - 1;
+        }
+    }
+
+    if (opts.quiescence > 0.0) {
+        skipped = skipped_fraction(0, &parallelization);
+        if (parallelization.rank == 0)
+            printf("Skipped %.1f %% of the updates\n", 100.0 * skipped);
+        active_free();
+    }
+    if (opts.inplace) {
+        inplace_free();
+    }
+    last = opts.inplace ? &current : &previous;
+
     /* Determine the CPU time used for the iteration */
     if (parallelization.rank == 0) {
+        if (converged) {
+            printf("Converged at iteration %d, largest change %e, "
+                   "L2 norm of the change %e\n", converged, residual[0],
+                   sqrt(residual[1]));
+        } else if (opts.tolerance > 0.0) {
+            printf("Not converged in %d iterations, largest change %e, "
+                   "L2 norm of the change %e\n", nsteps, residual[0],
+                   sqrt(residual[1]));
+        }
+        if (opts.method == METHOD_CN && iter > iter0) {
+            printf("Conjugate gradient took %.1f iterations per step\n",
+                   (double) cg_iterations / (iter - iter0));
+        }
         printf("Iteration took %.3f seconds.\n", (MPI_Wtime() - start_clock));
         printf("Reference value at 5,5: %f\n",
-               previous.data[idx(5, 5, current.ny + 2)]);
+               last->data[idx(5 + last->nghost - 1, 5 + last->nghost - 1,
+                              last->pitch)]);
     }
 
-    write_field(&current, iter, &parallelization);
+    /* Accuracy of the smooth test field, the steps are counted from the
+     * initial field also after a restart */
+    if (opts.method == METHOD_EXPLICIT &&
+        field_error(last, a, dt, iter - 1, errors,
+                    &parallelization) == 0 && parallelization.rank == 0) {
+        printf("Error against the exact solution %e, of the spatial "
+               "discretisation %e\n", errors[0], errors[1]);
+    }
+
+    if (!opts.inplace || iter == iter0) {
+        write_field(&current, iter, &parallelization);
+    }
 
     finalize(&current, &previous, &parallelization);
     MPI_Finalize();
@@ -0,0 +1,91 @@
+/* Heat equation solver in 3D with MPI. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+#include "heat3d.h"
+
+int main(int argc, char **argv)
+{
+    double a = 0.5;             //!< Diffusion constant
+    field3d current, previous;  //!< Current and previous temperature fields
+
+    double dt;                  //!< Time step
+    int nsteps;                 //!< Number of time steps
+
+    int image_interval = 500;    //!< Image output interval
+
+    int restart_interval = 200;  //!< Checkpoint output interval
+
+    int plane;                   //!< Plane normal to z in the images
+
+    parallel_data3d parallelization; //!< Parallelization info
+
+    int iter, iter0;               //!< Iteration counter
+
+    double dx2, dy2, dz2;       //!< delta x, y and z squared
+
+    double start_clock;        //!< Time stamps
+
+    int provided;              //!< Thread support level of the MPI library
+
+    /* Only the master thread calls MPI, outside of the parallel regions */
+    MPI_Init_thread(&argc, &argv, HEAT_THREAD_LEVEL, &provided);
+    if (provided < HEAT_THREAD_LEVEL) {
+        printf("The MPI library does not provide the required level of "
+               "thread support\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &parallelization.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &parallelization.size);
+
+    initialize3d(argc, argv, &current, &previous, &nsteps, &plane,
+                 &parallelization, &iter0);
+
+    /* Largest stable time step */
+    dx2 = current.dx * current.dx;
+    dy2 = current.dy * current.dy;
+    dz2 = current.dz * current.dz;
+    dt = 1.0 / (2.0 * a * (1.0 / dx2 + 1.0 / dy2 + 1.0 / dz2));
+
+    /* Output the initial field */
+    write_plane(&current, plane, iter0, &parallelization);
+    iter0++;
+
+    /* Get the start time stamp */
+    start_clock = MPI_Wtime();
+
+    /* Time evolve */
+    for (iter = iter0; iter < iter0 + nsteps; iter++) {
+        /* The faces are exchanged while the interior is updated */
+        exchange_init3d(&previous, &parallelization);
+        evolve_interior3d(&current, &previous, a, dt);
+        exchange_finalize3d(&parallelization);
+        evolve_edges3d(&current, &previous, a, dt);
+        if (iter % image_interval == 0) {
+            write_plane(&current, plane, iter, &parallelization);
+        }
+        /* write a checkpoint now and then for easy restarting */
+        if (iter % restart_interval == 0) {
+            write_restart3d(&current, &parallelization, iter);
+        }
+        /* Swap current field so that it will be used as previous for the next iteration step */
+        swap_fields3d(&current, &previous);
+    }
+
+    /* Determine the CPU time used for the iteration */
+    if (parallelization.rank == 0) {
+        printf("Iteration took %.3f seconds.\n", (MPI_Wtime() - start_clock));
+        printf("Reference value at 5,5,5: %f\n",
+               previous.data[idx3d(5, 5, 5, previous.ny + 2,
+                                   previous.nz + 2)]);
+    }
+
+    write_plane(&previous, plane, iter, &parallelization);
+
+    finalize3d(&current, &previous, &parallelization);
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,691 @@
+/* Geometric multigrid solver for the steady state of heat equation solver
+ *
+ * With the option -m mg the steady state, the solution of the Laplace
+ * equation with the boundary values of the initial field, is computed
+ * directly instead of marching in time. The initial field (generated,
+ * read from a file or from a checkpoint) is the first guess.
+ *
+ * In a direction of even global size n the next level is cell-centred:
+ * a coarse point covers 2 fine points, the residual is restricted by
+ * averaging them and the correction is interpolated linearly from the
+ * two nearest coarse points, with weights 3/4 and 1/4. In a direction of
+ * odd size it is vertex-centred: the n / 2 coarse points lie on the fine
+ * points of odd global index, the residual is restricted with the
+ * weights 1/4, 1/2, 1/4 and the correction is copied or averaged from
+ * two coarse points. Either way the global indices pick the fine points,
+ * so every size coarsens, and a local domain that starts or ends at an
+ * odd global index restricts the ghost layers of the residual too, which
+ * are then exchanged as well. The correction vanishes on the boundary,
+ * which stays where the boundary values of the field are: the ghost
+ * values are the inner ones extrapolated linearly to zero there.
+ * The smoother is red-black Gauss-Seidel, coloured by the global indices
+ * so that the colours match across the ranks, with an exchange of the
+ * ghost layers before each colour. The levels differ in size from the
+ * fields of the time stepping, so the ghost layers are exchanged with
+ * exchange_post and the datatypes of each level, not with the engines of
+ * -e.
+ *
+ * The levels are distributed like the field as long as the local domains
+ * of all the ranks stay at least MG_MIN_LOCAL points wide. The next level
+ * is then agglomerated: gathered on rank 0, which goes on coarsening it
+ * alone while the other ranks wait for the correction, until it is less
+ * than 4 points wide. This coarsest level is solved with the conjugate
+ * gradient method.
+ *
+ * -c v (default) selects V-cycles and -c w W-cycles. The cycles are
+ * repeated until the norm of the residual has decreased by the tolerance
+ * of -t (default MG_TOLERANCE), at most the given number of steps. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+#define MG_MAXLEVELS 32
+#define MG_MIN_LOCAL 8    /* Smallest local width of a distributed level */
+#define MG_SMOOTH 2       /* Pre- and post-smoothing sweeps */
+#ifdef HEAT_FLOAT_STORAGE
+#define MG_TOLERANCE 1e-5
+#else
+#define MG_TOLERANCE 1e-10
+#endif
+
+/* A level of the hierarchy. Only rank 0 holds the agglomerated levels. */
+typedef struct {
+    field u, f, r;             /* Solution or correction, right hand side
+                                * and residual */
+    int distributed;           /* Split over the ranks like the field */
+    int halve;                 /* The next level is half of this one, not
+                                * the same size gathered on rank 0 */
+    int vertex[2];             /* The next level is vertex-centred in the
+                                * direction of the rows or columns */
+    int ghost_r;               /* The restriction reads the ghost layers of
+                                * the residual on some rank */
+    double face[4];            /* Ghost value of the correction over the
+                                * inner one on the boundary up, down, left
+                                * and right */
+    int x0, y0;                /* Global indices of the first inner point */
+    int parity;                /* Parity of the global index of the first
+                                * inner point */
+    int *blocks;               /* On rank 0 for the last distributed level:
+                                * global position and size of the
+                                * restricted block of every rank in the
+                                * agglomerated level, 4 values per rank */
+    int nb[4];                 /* Neighbours up, down, left and right */
+    parallel_data par;         /* Datatypes of the halo exchange */
+} mg_level;
+
+static mg_level levels[MG_MAXLEVELS];
+static int nlevels;
+static int wcycle;
+static parallel_data *world;
+
+/* Allocate a field of a level, ghost layers included and set to zero */
+static void level_field(field *f, int nx, int ny, double dx, double dy)
+{
+    f->nx = nx;
+    f->ny = ny;
+    f->nghost = 1;
+    f->pitch = row_pitch(ny + 2);
+    f->dx = dx;
+    f->dy = dy;
+    f->data = malloc_2d(nx + 2, f->pitch);
+    memset(f->data, 0, (size_t) (nx + 2) * f->pitch * sizeof(real));
+}
+
+/* Set up a level of nx x ny points from the global indices x0, y0 with
+ * the neighbours nb */
+static void level_setup(mg_level *lv, int nx, int ny, int x0, int y0,
+                        double dx, double dy, const int *nb, int allocate_u)
+{
+    int k;
+
+    if (allocate_u)
+        level_field(&lv->u, nx, ny, dx, dy);
+    level_field(&lv->f, nx, ny, dx, dy);
+    level_field(&lv->r, nx, ny, dx, dy);
+    for (k = 0; k < 4; k++)
+        lv->nb[k] = nb[k];
+    lv->x0 = x0;
+    lv->y0 = y0;
+    lv->parity = (x0 + y0) % 2;
+    lv->par = *world;
+    MPI_Type_vector(nx + 2, 1, lv->f.pitch, HEAT_MPI_REAL,
+                    &lv->par.columntype);
+    MPI_Type_contiguous(ny + 2, HEAT_MPI_REAL, &lv->par.rowtype);
+    MPI_Type_commit(&lv->par.columntype);
+    MPI_Type_commit(&lv->par.rowtype);
+}
+
+/* First coarse point and number of them, along one direction, that a
+ * local domain of n points from the global index x0 restricts to: the
+ * coarse points c whose fine point 2 c, or 2 c + 1 on a vertex-centred
+ * level, lies in it */
+static void coarse_range(int x0, int n, int vertex, int *range)
+{
+    if (vertex) {
+        range[0] = x0 / 2;
+        range[1] = (x0 + n) / 2 - range[0];
+    } else {
+        range[0] = (x0 + 1) / 2;
+        range[1] = (x0 + n + 1) / 2 - range[0];
+    }
+}
+
+/* Global position and size of the block of the next level that the local
+ * domain of lv restricts to, or of the domain itself if the next level is
+ * a copy */
+static void coarse_block(const mg_level *lv, int *block)
+{
+    int range[2];
+
+    if (!lv->halve) {
+        block[0] = lv->x0;
+        block[1] = lv->y0;
+        block[2] = lv->u.nx;
+        block[3] = lv->u.ny;
+        return;
+    }
+    coarse_range(lv->x0, lv->u.nx, lv->vertex[0], range);
+    block[0] = range[0];
+    block[2] = range[1];
+    coarse_range(lv->y0, lv->u.ny, lv->vertex[1], range);
+    block[1] = range[0];
+    block[3] = range[1];
+}
+
+/* Build the hierarchy with the field temperature as the finest level */
+static void mg_setup(field *temperature, parallel_data *parallel)
+{
+    int none[4] = {MPI_PROC_NULL, MPI_PROC_NULL, MPI_PROC_NULL,
+                   MPI_PROC_NULL};
+    int nb[4], block[4], local[3], n[2];
+    int l, d, k;
+    double h[2], dist[4];
+    mg_level *lv;
+
+    world = parallel;
+    for (l = 0; l < MG_MAXLEVELS; l++)
+        levels[l].blocks = NULL;
+    nb[0] = parallel->nup;
+    nb[1] = parallel->ndown;
+    nb[2] = parallel->nleft;
+    nb[3] = parallel->nright;
+    /* Global size and spacing of the level, and the distance of its outer
+     * points from the boundary up, down, left and right, one spacing on
+     * the finest level as the boundary values are its ghost values */
+    n[0] = temperature->nx_full;
+    n[1] = temperature->ny_full;
+    h[0] = temperature->dx;
+    h[1] = temperature->dy;
+    for (k = 0; k < 4; k++)
+        dist[k] = h[k / 2];
+
+    /* Finest level, solution in the field itself */
+    lv = &levels[0];
+    lv->u = *temperature;
+    level_setup(lv, temperature->nx, temperature->ny, temperature->x0,
+                temperature->y0, h[0], h[1], nb, 0);
+    lv->distributed = 1;
+
+    for (l = 1; l < MG_MAXLEVELS; l++) {
+        lv = &levels[l - 1];
+        if (!lv->distributed && (n[0] < 4 || n[1] < 4))
+            break;
+        lv->halve = n[0] >= 4 && n[1] >= 4;
+        if (lv->halve) {
+            for (d = 0; d < 2; d++) {
+                /* The outer points move half a spacing inwards on a
+                 * cell-centred level and a whole one on a vertex-centred
+                 * one */
+                lv->vertex[d] = n[d] % 2;
+                dist[2 * d] += h[d] * (lv->vertex[d] ? 1.0 : 0.5);
+                dist[2 * d + 1] += h[d] * (lv->vertex[d] ? 1.0 : 0.5);
+                n[d] /= 2;
+                h[d] *= 2.0;
+            }
+        }
+        if (!lv->distributed && parallel->rank != 0) {
+            levels[l].distributed = 0;
+            continue;
+        }
+        coarse_block(lv, block);
+        lv->ghost_r = 0;
+        for (d = 0; lv->halve && d < 2; d++)
+            lv->ghost_r |= lv->vertex[d] ||
+                ((d ? lv->y0 : lv->x0) % 2 != 0) ||
+                ((d ? lv->y0 + lv->u.ny : lv->x0 + lv->u.nx) % 2 != 0);
+        if (lv->distributed) {
+            /* The decisions on the distributed levels are taken together,
+             * the local sizes differ */
+            local[0] = -lv->ghost_r;
+            local[1] = block[2];
+            local[2] = block[3];
+            MPI_Allreduce(MPI_IN_PLACE, local, 3, MPI_INT, MPI_MIN,
+                          parallel->comm);
+            lv->ghost_r = -local[0];
+        }
+        if (lv->distributed && lv->halve && local[1] >= MG_MIN_LOCAL &&
+            local[2] >= MG_MIN_LOCAL) {
+            /* Distributed coarse level */
+            level_setup(&levels[l], block[2], block[3], block[0], block[1],
+                        h[0], h[1], nb, 1);
+            levels[l].distributed = 1;
+        } else {
+            levels[l].distributed = 0;
+            if (lv->distributed) {
+                /* Agglomerate on rank 0 */
+                if (parallel->rank == 0)
+                    lv->blocks = malloc(4 * parallel->size * sizeof(int));
+                MPI_Gather(block, 4, MPI_INT, lv->blocks, 4, MPI_INT, 0,
+                           parallel->comm);
+            }
+            if (parallel->rank != 0)
+                continue;
+            level_setup(&levels[l], n[0], n[1], 0, 0, h[0], h[1], none, 1);
+        }
+        /* Linear extrapolation to zero at the boundary, which lies
+         * between half a spacing and a spacing beyond the outer points */
+        for (k = 0; k < 4; k++)
+            levels[l].face[k] = (dist[k] - h[k / 2]) / dist[k];
+    }
+    nlevels = l;
+}
+
+/* Free the hierarchy */
+static void mg_free(void)
+{
+    int l;
+
+    for (l = 0; l < nlevels; l++) {
+        free(levels[l].blocks);
+        if (!levels[l].distributed && world->rank != 0)
+            continue;
+        if (l > 0)
+            free_2d(levels[l].u.data);
+        free_2d(levels[l].f.data);
+        free_2d(levels[l].r.data);
+        MPI_Type_free(&levels[l].par.rowtype);
+        MPI_Type_free(&levels[l].par.columntype);
+    }
+}
+
+/* Set the ghost values of u on the physical boundary of a coarse level
+ * to the inner values extrapolated to zero on the boundary, first the
+ * rows and then the columns, so that the corners are extrapolated in
+ * both directions */
+static void reflect(mg_level *lv, field *u)
+{
+    int i, j, width, nx, ny;
+    real *d = u->data;
+    nx = u->nx;
+    ny = u->ny;
+    width = u->pitch;
+
+    if (lv == &levels[0])
+        return;
+    for (j = 0; j < ny + 2; j++) {
+        if (lv->nb[0] == MPI_PROC_NULL)
+            d[idx(0, j, width)] = lv->face[0] * d[idx(1, j, width)];
+        if (lv->nb[1] == MPI_PROC_NULL)
+            d[idx(nx + 1, j, width)] = lv->face[1] * d[idx(nx, j, width)];
+    }
+    for (i = 0; i < nx + 2; i++) {
+        if (lv->nb[2] == MPI_PROC_NULL)
+            d[idx(i, 0, width)] = lv->face[2] * d[idx(i, 1, width)];
+        if (lv->nb[3] == MPI_PROC_NULL)
+            d[idx(i, ny + 1, width)] = lv->face[3] * d[idx(i, ny, width)];
+    }
+}
+
+/* Update the ghost layers of the solution of a level: exchange them with
+ * the neighbours if the level is distributed and reflect the physical
+ * boundary. With corners, the rows are exchanged before the columns so
+ * that the corners come from the diagonal neighbours. */
+static void exchange_level(mg_level *lv, int corners)
+{
+    int rows[4] = {lv->nb[0], lv->nb[1], MPI_PROC_NULL, MPI_PROC_NULL};
+    int columns[4] = {MPI_PROC_NULL, MPI_PROC_NULL, lv->nb[2], lv->nb[3]};
+
+    if (lv->distributed) {
+        if (corners) {
+            exchange_post(&lv->u, &lv->par, rows);
+            MPI_Waitall(8, lv->par.requests, MPI_STATUSES_IGNORE);
+            exchange_post(&lv->u, &lv->par, columns);
+        } else {
+            exchange_post(&lv->u, &lv->par, lv->nb);
+        }
+        MPI_Waitall(8, lv->par.requests, MPI_STATUSES_IGNORE);
+    }
+    reflect(lv, &lv->u);
+}
+
+/* Exchange the ghost layers of the residual of a distributed level,
+ * corners included, if some rank restricts them */
+static void exchange_residual(mg_level *lv)
+{
+    int rows[4] = {lv->nb[0], lv->nb[1], MPI_PROC_NULL, MPI_PROC_NULL};
+    int columns[4] = {MPI_PROC_NULL, MPI_PROC_NULL, lv->nb[2], lv->nb[3]};
+
+    if (!lv->distributed || !lv->ghost_r)
+        return;
+    exchange_post(&lv->r, &lv->par, rows);
+    MPI_Waitall(8, lv->par.requests, MPI_STATUSES_IGNORE);
+    exchange_post(&lv->r, &lv->par, columns);
+    MPI_Waitall(8, lv->par.requests, MPI_STATUSES_IGNORE);
+}
+
+/* Red-black Gauss-Seidel sweeps */
+static void smooth(mg_level *lv, int sweeps)
+{
+    int s, colour, i, j, width;
+    double wx, wy, diag;
+    real *u = lv->u.data;
+    const real *f = lv->f.data;
+    width = lv->u.pitch;
+    wx = 1.0 / (lv->u.dx * lv->u.dx);
+    wy = 1.0 / (lv->u.dy * lv->u.dy);
+    diag = 2.0 * (wx + wy);
+
+    for (s = 0; s < sweeps; s++) {
+        for (colour = 0; colour < 2; colour++) {
+            exchange_level(lv, 0);
+            #pragma omp parallel for private(j) schedule(static)
+            for (i = 1; i <= lv->u.nx; i++) {
+                for (j = 1 + (i + 1 + lv->parity + colour) % 2;
+                     j <= lv->u.ny; j += 2) {
+                    u[idx(i, j, width)] = (f[idx(i, j, width)] +
+                        wx * ((double) u[idx(i - 1, j, width)] +
+                              u[idx(i + 1, j, width)]) +
+                        wy * ((double) u[idx(i, j - 1, width)] +
+                              u[idx(i, j + 1, width)])) / diag;
+                }
+            }
+        }
+    }
+}
+
+/* r = f - A u, returns the local sum of r^2 */
+static double residual(mg_level *lv)
+{
+    int i, j, width;
+    double wx, wy, diag, v, sum = 0.0;
+    const real *u = lv->u.data;
+    width = lv->u.pitch;
+    wx = 1.0 / (lv->u.dx * lv->u.dx);
+    wy = 1.0 / (lv->u.dy * lv->u.dy);
+    diag = 2.0 * (wx + wy);
+
+    exchange_level(lv, 0);
+    #pragma omp parallel for private(j, v) reduction(+:sum) schedule(static)
+    for (i = 1; i <= lv->u.nx; i++) {
+        for (j = 1; j <= lv->u.ny; j++) {
+            v = lv->f.data[idx(i, j, width)] - diag * u[idx(i, j, width)] +
+                wx * ((double) u[idx(i - 1, j, width)] +
+                      u[idx(i + 1, j, width)]) +
+                wy * ((double) u[idx(i, j - 1, width)] +
+                      u[idx(i, j + 1, width)]);
+            lv->r.data[idx(i, j, width)] = v;
+            sum += v * v;
+        }
+    }
+    return sum;
+}
+
+/* Solve the coarsest level with the conjugate gradient method */
+static void coarse_solve(mg_level *lv)
+{
+    field p, q;
+    int i, j, k, width, iter;
+    double wx, wy, diag, rr, rr0, pq, alpha;
+    real *u = lv->u.data, *r = lv->r.data;
+    width = lv->u.pitch;
+    wx = 1.0 / (lv->u.dx * lv->u.dx);
+    wy = 1.0 / (lv->u.dy * lv->u.dy);
+    diag = 2.0 * (wx + wy);
+
+    level_field(&p, lv->u.nx, lv->u.ny, lv->u.dx, lv->u.dy);
+    level_field(&q, lv->u.nx, lv->u.ny, lv->u.dx, lv->u.dy);
+    rr = rr0 = residual(lv);
+    memcpy(p.data, r, (size_t) (lv->u.nx + 2) * width * sizeof(real));
+    for (iter = 0; iter < 4 * (lv->u.nx + lv->u.ny) &&
+         rr > MG_TOLERANCE * MG_TOLERANCE * rr0; iter++) {
+        pq = 0.0;
+        reflect(lv, &p);
+        for (i = 1; i <= lv->u.nx; i++) {
+            for (j = 1; j <= lv->u.ny; j++) {
+                k = idx(i, j, width);
+                q.data[k] = diag * p.data[k] -
+                    wx * ((double) p.data[k - width] + p.data[k + width]) -
+                    wy * ((double) p.data[k - 1] + p.data[k + 1]);
+                pq += (double) p.data[k] * q.data[k];
+            }
+        }
+        alpha = rr / pq;
+        pq = rr;
+        rr = 0.0;
+        for (i = 1; i <= lv->u.nx; i++) {
+            for (j = 1; j <= lv->u.ny; j++) {
+                k = idx(i, j, width);
+                u[k] += alpha * p.data[k];
+                r[k] -= alpha * q.data[k];
+                rr += (double) r[k] * r[k];
+            }
+        }
+        for (i = 1; i <= lv->u.nx; i++) {
+            for (j = 1; j <= lv->u.ny; j++) {
+                k = idx(i, j, width);
+                p.data[k] = r[k] + rr / pq * p.data[k];
+            }
+        }
+    }
+    free_2d(p.data);
+    free_2d(q.data);
+}
+
+/* Weights of the fine points from the global index 2 c of the coarse
+ * point c in the restriction, along one direction */
+static const double restrict_weights[2][3] = {
+    {0.5, 0.5, 0.0},           /* cell-centred */
+    {0.25, 0.5, 0.25}          /* vertex-centred */
+};
+
+/* Restrict the residual of lv into the block of coarse_block in out,
+ * whose rows are stride apart, or copy it if the next level is not
+ * halved */
+static void restrict_block(mg_level *lv, real *out, int stride)
+{
+    int i, j, p, q, fi, fj, np, nq, width, b[4];
+    const double *wx, *wy;
+    const real *r = lv->r.data;
+    double v;
+    width = lv->r.pitch;
+    coarse_block(lv, b);
+    wx = restrict_weights[lv->vertex[0]];
+    wy = restrict_weights[lv->vertex[1]];
+    np = 2 + lv->vertex[0];
+    nq = 2 + lv->vertex[1];
+
+    #pragma omp parallel for private(j, p, q, fi, fj, v) schedule(static)
+    for (i = 0; i < b[2]; i++) {
+        for (j = 0; j < b[3]; j++) {
+            if (!lv->halve) {
+                out[idx(i, j, stride)] = r[idx(i + 1, j + 1, width)];
+                continue;
+            }
+            /* Local index of the first fine point */
+            fi = 2 * (b[0] + i) - lv->x0 + 1;
+            fj = 2 * (b[1] + j) - lv->y0 + 1;
+            v = 0.0;
+            for (p = 0; p < np; p++)
+                for (q = 0; q < nq; q++)
+                    v += wx[p] * wy[q] * r[idx(fi + p, fj + q, width)];
+            out[idx(i, j, stride)] = v;
+        }
+    }
+}
+
+/* The two coarse points c and c + dc, as indices in the block of
+ * coarse_block from its first point first with the ghost layer at 0, and
+ * the weight w of the first one in the interpolation to the fine point
+ * of global index g, along one direction */
+static void prolong_weights(int g, int first, int vertex, int *c, int *dc,
+                            double *w)
+{
+    if (!vertex) {
+        *c = g / 2 - first + 1;
+        *dc = g % 2 ? 1 : -1;
+        *w = 0.75;
+    } else if (g % 2) {
+        /* On a coarse point */
+        *c = (g - 1) / 2 - first + 1;
+        *dc = 0;
+        *w = 1.0;
+    } else {
+        /* Halfway between two */
+        *c = g / 2 - first;
+        *dc = 1;
+        *w = 0.5;
+    }
+}
+
+/* Add the correction c to the solution of lv. c holds the coarse points
+ * of the block of coarse_block with one ghost layer around them, its rows
+ * are stride apart. The correction is interpolated along both directions,
+ * or copied if the next level is not halved. */
+static void prolong_block(mg_level *lv, const real *c, int stride)
+{
+    int i, j, ci, cj, di, dj, width, b[4];
+    double wi, wj;
+    real *u = lv->u.data;
+    width = lv->u.pitch;
+    coarse_block(lv, b);
+
+    if (!lv->halve) {
+        #pragma omp parallel for private(j) schedule(static)
+        for (i = 1; i <= lv->u.nx; i++)
+            for (j = 1; j <= lv->u.ny; j++)
+                u[idx(i, j, width)] += c[idx(i, j, stride)];
+        return;
+    }
+    #pragma omp parallel for private(j, ci, cj, di, dj, wi, wj) \
+        schedule(static)
+    for (i = 1; i <= lv->u.nx; i++) {
+        prolong_weights(lv->x0 + i - 1, b[0], lv->vertex[0], &ci, &di, &wi);
+        for (j = 1; j <= lv->u.ny; j++) {
+            prolong_weights(lv->y0 + j - 1, b[1], lv->vertex[1], &cj, &dj,
+                            &wj);
+            u[idx(i, j, width)] +=
+                wi * (wj * c[idx(ci, cj, stride)] +
+                      (1.0 - wj) * c[idx(ci, cj + dj, stride)]) +
+                (1.0 - wi) * (wj * c[idx(ci + di, cj, stride)] +
+                              (1.0 - wj) * c[idx(ci + di, cj + dj, stride)]);
+        }
+    }
+}
+
+/* Gather the restricted residual of the distributed level lv into the
+ * right hand side of the agglomerated level next on rank 0 */
+static void gather_level(mg_level *lv, mg_level *next)
+{
+    MPI_Datatype block;
+    real *buf;
+    int p, b[4];
+    const int *pb;
+
+    coarse_block(lv, b);
+    if (world->rank != 0) {
+        buf = malloc((size_t) b[2] * b[3] * sizeof(real));
+        restrict_block(lv, buf, b[3]);
+        MPI_Send(buf, b[2] * b[3], HEAT_MPI_REAL, 0, 31, world->comm);
+        free(buf);
+        return;
+    }
+    restrict_block(lv, &next->f.data[idx(1 + b[0], 1 + b[1],
+                                         next->f.pitch)], next->f.pitch);
+    for (p = 1; p < world->size; p++) {
+        pb = &lv->blocks[4 * p];
+        MPI_Type_vector(pb[2], pb[3], next->f.pitch, HEAT_MPI_REAL, &block);
+        MPI_Type_commit(&block);
+        MPI_Recv(&next->f.data[idx(1 + pb[0], 1 + pb[1], next->f.pitch)],
+                 1, block, p, 31, world->comm, MPI_STATUS_IGNORE);
+        MPI_Type_free(&block);
+    }
+}
+
+/* Send every rank its part of the correction of the agglomerated level
+ * next, with one ghost layer, and add it to the distributed level lv */
+static void scatter_level(mg_level *lv, mg_level *next)
+{
+    MPI_Datatype block;
+    real *buf;
+    int p, b[4];
+    const int *pb;
+
+    coarse_block(lv, b);
+    if (world->rank != 0) {
+        buf = malloc((size_t) (b[2] + 2) * (b[3] + 2) * sizeof(real));
+        MPI_Recv(buf, (b[2] + 2) * (b[3] + 2), HEAT_MPI_REAL, 0, 32,
+                 world->comm, MPI_STATUS_IGNORE);
+        prolong_block(lv, buf, b[3] + 2);
+        free(buf);
+        return;
+    }
+    for (p = 1; p < world->size; p++) {
+        pb = &lv->blocks[4 * p];
+        MPI_Type_vector(pb[2] + 2, pb[3] + 2, next->u.pitch, HEAT_MPI_REAL,
+                        &block);
+        MPI_Type_commit(&block);
+        MPI_Send(&next->u.data[idx(pb[0], pb[1], next->u.pitch)],
+                 1, block, p, 32, world->comm);
+        MPI_Type_free(&block);
+    }
+    prolong_block(lv, &next->u.data[idx(b[0], b[1], next->u.pitch)],
+                  next->u.pitch);
+}
+
+/* One V- or W-cycle from level l */
+static void cycle(int l)
+{
+    mg_level *lv = &levels[l], *next = &levels[l + 1];
+    int k, width;
+
+    if (l == nlevels - 1) {
+        coarse_solve(lv);
+        return;
+    }
+    smooth(lv, MG_SMOOTH);
+    residual(lv);
+    exchange_residual(lv);
+
+    /* Coarse grid correction */
+    if (next->distributed || world->rank == 0)
+        memset(next->u.data, 0,
+               (size_t) (next->u.nx + 2) * next->u.pitch * sizeof(real));
+    if (next->distributed) {
+        width = next->f.pitch;
+        restrict_block(lv, &next->f.data[idx(1, 1, width)], width);
+    } else if (lv->distributed) {
+        gather_level(lv, next);
+    } else {
+        width = next->f.pitch;
+        restrict_block(lv, &next->f.data[idx(1, 1, width)], width);
+    }
+    if (next->distributed || world->rank == 0) {
+        for (k = 0; k < (wcycle ? 2 : 1); k++)
+            cycle(l + 1);
+    }
+    if (next->distributed || world->rank == 0)
+        exchange_level(next, 1);
+    if (!next->distributed && lv->distributed)
+        scatter_level(lv, next);
+    else
+        prolong_block(lv, next->u.data, next->u.pitch);
+
+    smooth(lv, MG_SMOOTH);
+}
+
+/* Solve the steady state from the initial field temperature with
+ * multigrid cycles, V-cycles or with w W-cycles, until the norm of the
+ * residual has decreased by tolerance (MG_TOLERANCE if zero) or for at
+ * most maxcycles cycles. Returns the number of cycles. */
+int solve_multigrid(field *temperature, double tolerance, int maxcycles,
+                    int w, parallel_data *parallel)
+{
+    double norm0, norm, previous;
+    int n, l;
+
+    if (tolerance <= 0.0)
+        tolerance = MG_TOLERANCE;
+    wcycle = w;
+    mg_setup(temperature, parallel);
+    for (l = 0; l < nlevels && levels[l].distributed; l++)
+        ;
+    if (parallel->rank == 0)
+        printf("Multigrid with %d levels, %d of them distributed\n",
+               nlevels, l);
+
+    norm = residual(&levels[0]);
+    MPI_Allreduce(MPI_IN_PLACE, &norm, 1, MPI_DOUBLE, MPI_SUM,
+                  parallel->comm);
+    norm0 = norm = sqrt(norm);
+    previous = norm;
+    for (n = 0; n < maxcycles && norm > tolerance * norm0; n++) {
+        cycle(0);
+        previous = norm;
+        norm = residual(&levels[0]);
+        MPI_Allreduce(MPI_IN_PLACE, &norm, 1, MPI_DOUBLE, MPI_SUM,
+                      parallel->comm);
+        norm = sqrt(norm);
+    }
+    if (parallel->rank == 0)
+        printf("Multigrid %s-cycles: %d cycles, relative residual %e, "
+               "last reduction factor %.3f\n", w ? "W" : "V", n,
+               norm0 > 0.0 ? norm / norm0 : 0.0,
+               previous > 0.0 ? norm / previous : 0.0);
+    mg_free();
+    return n;
+}
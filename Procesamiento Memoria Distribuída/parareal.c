@@ -0,0 +1,183 @@
+/* Parareal time parallelization for heat equation solver
+ *
+ * With the option -T slices the ranks are split into slices groups, each
+ * of which decomposes the whole field in space like a normal run (see
+ * initialize). Group s advances the field over the s-th of slices time
+ * intervals. The iteration
+ *
+ *     U_{s+1}^k = G(U_s^k) + F(U_s^{k-1}) - G(U_s^{k-1})
+ *
+ * combines the fine propagator F, the explicit steps of the interval, with
+ * the coarse propagator G, PARAREAL_COARSE backward Euler steps over the
+ * interval (evolve_implicit with theta = 1). The fine propagators of all
+ * the slices run in parallel, only the cheap coarse steps are sequential.
+ * After k iterations the first k slices have the result of the serial
+ * run, so those slices stop working and the iteration ends after at most
+ * slices iterations, or earlier when the largest change of the slice end
+ * values between two iterations falls below the tolerance given with -t
+ * (default PARAREAL_TOLERANCE).
+ *
+ * At the stability limit of the explicit method the checkerboard mode of
+ * the field is not damped by the fine propagator while the coarse one
+ * removes it, and its error travels only one slice per iteration. The
+ * iteration then needs all the slices iterations and gives no speedup,
+ * so -T above one needs the time step, a bit below the limit, with -d.
+ * The same -d gives the same time steps with any number of slices.
+ *
+ * The field at the start of a slice is sent to the next slice by the rank
+ * with the same position in the Cartesian grid, found through a
+ * communicator of the ranks with the same Cartesian rank. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Default of the largest change of a point at the ends of the slices
+ * between two iterations at which the iteration stops, and the number of
+ * backward Euler steps of the coarse propagator over a slice */
+#ifdef HEAT_FLOAT_STORAGE
+#define PARAREAL_TOLERANCE 1e-3
+#else
+#define PARAREAL_TOLERANCE 1e-4
+#endif
+#define PARAREAL_COARSE 4
+
+/* Advance the field from start into out by the coarse propagator */
+static void propagate_coarse(field *out, field *start, field *work,
+                             double a, double dt, int nsteps,
+                             parallel_data *parallel)
+{
+    int step;
+
+    copy_field(start, work);
+    for (step = 0; step < PARAREAL_COARSE; step++) {
+        evolve_implicit(out, work, a, nsteps * dt / PARAREAL_COARSE, 1.0,
+                        parallel);
+        if (step < PARAREAL_COARSE - 1)
+            copy_field(out, work);
+    }
+}
+
+/* Allocate copy as a copy of the field temperature */
+static void allocate_copy(field *copy, field *temperature)
+{
+    *copy = *temperature;
+    allocate_field(copy);
+    copy_field(temperature, copy);
+}
+
+/* Advance the field from start by nsteps explicit steps, the result is
+ * returned in one of the work fields work1 and work2 */
+static field *propagate_fine(field *start, field *work1, field *work2,
+                             double a, double dt, int nsteps,
+                             parallel_data *parallel)
+{
+    field *curr = work2, *prev = work1, *tmp;
+    int step;
+
+    copy_field(start, prev);
+    copy_field(start, curr);
+    for (step = 0; step < nsteps; step++) {
+        exchange_init(prev, parallel);
+        evolve_interior(curr, prev, a, dt);
+        exchange_finalize(parallel);
+        evolve_edges(curr, prev, a, dt);
+        tmp = prev;
+        prev = curr;
+        curr = tmp;
+    }
+    return prev;
+}
+
+/* Advance current by nsteps explicit steps of length dt with the Parareal
+ * iteration. On return current holds the field at the end of the time
+ * slice of this rank, that of the last slice is the final field. Returns
+ * the number of iterations. */
+int evolve_parareal(field *current, double a, double dt, int nsteps,
+                    double tolerance, parallel_data *parallel)
+{
+    field start, fa, fb, fc, ga, gb;
+    field *fine, *gold = &ga, *gnew = &gb, *tmp;
+    MPI_Comm timecomm;
+    int s, n, steps, k, i, j, g, width, count;
+    double change, d;
+    real v;
+
+    if (tolerance <= 0.0)
+        tolerance = PARAREAL_TOLERANCE;
+
+    s = parallel->slice;
+    n = parallel->slices;
+    steps = (int) ((long) nsteps * (s + 1) / n - (long) nsteps * s / n);
+    g = current->nghost;
+    width = current->pitch;
+    count = (current->nx + 2 * g) * width;
+
+    /* The ranks at the same position of all the slices, ordered by the
+     * slice */
+    MPI_Comm_split(MPI_COMM_WORLD, parallel->rank, s, &timecomm);
+
+    allocate_copy(&start, current);
+    allocate_copy(&fa, current);
+    allocate_copy(&fb, current);
+    allocate_copy(&fc, current);
+    allocate_copy(&ga, current);
+    allocate_copy(&gb, current);
+
+    /* Coarse prediction, one slice after the other */
+    if (s > 0)
+        MPI_Recv(start.data, count, HEAT_MPI_REAL, s - 1, 51, timecomm,
+                 MPI_STATUS_IGNORE);
+    propagate_coarse(gold, &start, &fc, a, dt, steps, parallel);
+    copy_field(gold, current);
+    if (s < n - 1)
+        MPI_Send(current->data, count, HEAT_MPI_REAL, s + 1, 51, timecomm);
+
+    for (k = 1; k <= n; k++) {
+        change = 0.0;
+        /* The slices before k - 1 started from the exact field already in
+         * the previous iteration and their end values do not change */
+        if (s >= k - 1) {
+            fine = propagate_fine(&start, &fa, &fb, a, dt, steps, parallel);
+            if (s >= k)
+                MPI_Recv(start.data, count, HEAT_MPI_REAL, s - 1, 51,
+                         timecomm, MPI_STATUS_IGNORE);
+            propagate_coarse(gnew, &start, &fc, a, dt, steps, parallel);
+
+            /* Correction of the coarse step */
+            #pragma omp parallel for private(j, v, d) reduction(max:change) \
+                schedule(static)
+            for (i = g; i < current->nx + g; i++) {
+                for (j = idx(i, g, width); j < idx(i, current->ny + g, width);
+                     j++) {
+                    v = gnew->data[j] + fine->data[j] - gold->data[j];
+                    d = fabs((double) v - current->data[j]);
+                    change = d > change ? d : change;
+                    current->data[j] = v;
+                }
+            }
+            tmp = gold;
+            gold = gnew;
+            gnew = tmp;
+            if (s < n - 1)
+                MPI_Send(current->data, count, HEAT_MPI_REAL, s + 1, 51,
+                         timecomm);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &change, 1, MPI_DOUBLE, MPI_MAX,
+                      MPI_COMM_WORLD);
+        if (change < tolerance)
+            break;
+    }
+
+    deallocate_field(&start);
+    deallocate_field(&fa);
+    deallocate_field(&fb);
+    deallocate_field(&fc);
+    deallocate_field(&ga);
+    deallocate_field(&gb);
+    MPI_Comm_free(&timecomm);
+    return k < n ? k : n;
+}
@@ -5,17 +5,25 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "heat.h"
 #include "pngwriter.h"
 
 #define NSTEPS 500  // Default number of iteration steps
 
+/* Grid spacing given with -g and the smooth initial field of -i sine */
+static double spacing = DX;
+static int sine_field = 0;
+
 /* Initialize the heat equation solver */
 void initialize(int argc, char *argv[], field *current,
                 field *previous, int *nsteps, parallel_data *parallel, 
-                int *iter0)
+                int *iter0, options *opts)
 {
     /*
      * Following combinations of command line arguments are possible:
@@ -23,6 +31,83 @@ void initialize(int argc, char *argv[], field *current,
      * One argument:    read initial field from a given file
      * Two arguments:   initial field from file and number of time steps
      * Three arguments: field dimensions (rows,cols) and number of time steps
+     *
+     * The arguments may be preceded by the following options:
+     * -k depth:        number of ghost layers exchanged at once, the halo
+     *                  is then communicated only every depth steps
+     * -S kernel:       stencil kernel, one of auto (default), portable,
+     *                  avx2 or avx512
+     * -C columns:      width of the column tiles in the interior update,
+     *                  0 disables tiling (default: chosen from L2 size)
+     * -B repeat:       benchmark the interior update with and without
+     *                  tiling, and with padded rows and huge pages,
+     *                  instead of running the simulation
+     * -w:              with -k, advance the steps between the halo
+     *                  exchanges together in a time-skewed sweep
+     * -P strips:       number of strips in which the interior is updated
+     *                  while the halo is exchanged, polling MPI between
+     *                  the strips (default 16, 0 waits for all messages
+     *                  after the interior)
+     * -e engine:       halo exchange engine, one of isend (default),
+     *                  persistent, neighbor, shared or rma, see
+     *                  halo.c (the others than isend need depth 1)
+     * -t tolerance:    run until the largest change of a point in a step
+     *                  falls below tolerance, the number of time steps is
+     *                  then the maximum (needs depth 1)
+     * -m method:       time integration, explicit (default) or cn for
+     *                  Crank-Nicolson, see implicit.c, or mg to compute
+     *                  the steady state with multigrid, see multigrid.c,
+     *                  or spectral for the exact time integration with
+     *                  sine transforms, see spectral.c
+     * -c cycle:        multigrid cycle, v (default) or w
+     * -d dt:           time step (default: the stability limit of the
+     *                  explicit method, which cannot be exceeded with it)
+     * -p PxQ:          process grid of P x Q ranks (default: the one with
+     *                  the smallest halo exchange volume)
+     * -T slices:       split the ranks into slices groups that advance
+     *                  the field over consecutive time intervals with the
+     *                  Parareal iteration, see parareal.c; -t is then
+     *                  the tolerance of the iteration (needs -d)
+     * -o order:        order of the spatial discretisation, 2 (default)
+     *                  for the five-point stencil or 4 for the
+     *                  fourth-order one with two ghost layers, see
+     *                  stencil.c (needs the explicit method and depth 1)
+     * -g spacing:      grid spacing in both directions (default DX)
+     * -i field:        generated initial field, disc (default) or sine
+     *                  for the smooth sin(pi x / Lx) sin(pi y / Ly) with
+     *                  zero boundary values, whose error against the
+     *                  exact solution is shown at the end
+     * -A gradient:     adaptive mesh refinement, the field is advanced on
+     *                  a grid of half the resolution and refined in the
+     *                  patches where neighbouring values differ by
+     *                  gradient times the range of the field, useful
+     *                  from about 0.01 to 0.1, see amr.c (needs odd
+     *                  dimensions, the explicit method, depth 1 and the
+     *                  five-point stencil)
+     * -b steps:        time the updates of every rank and check the load
+     *                  balance every steps steps, see balance.c (needs
+     *                  the explicit method and depth 1, and uses -P 0)
+     * -r ratio:        imbalance, the ratio of the busiest rank to the
+     *                  mean, above which the blocks are moved (default
+     *                  1.1)
+     * -O blocks:       over-decomposition into blocks blocks per rank,
+     *                  each with its own ghost layer, see blocks.c (needs
+     *                  the explicit method, depth 1 and the five-point
+     *                  stencil)
+     * -H:              deal the blocks of -O along a Hilbert curve
+     *                  instead of in row-major order
+     * -a tolerance:    skip the tiles of the local domain whose largest
+     *                  change in a step falls below tolerance until a
+     *                  neighbouring tile or the halo next to them changes,
+     *                  see active.c (needs the explicit method, depth 1
+     *                  and the five-point stencil)
+     * -I:              update a single field in place instead of two,
+     *                  see inplace.c (needs the explicit method, depth 1
+     *                  and the five-point stencil, and uses -P 0)
+     * -W lines:        pad the rows of the fields to whole cache lines
+     *                  and lines more, see row_pitch (default: no
+     *                  padding)
+     * -L:              back the fields with transparent huge pages
      */
 
 
@@ -33,8 +118,335 @@ void initialize(int argc, char *argv[], field *current,
 
     int read_file = 0;
 
+    int opt;
+    char *kernel = "auto";      //!< Name of the stencil kernel
+    int tile = -1;              //!< Width of the column tiles
+    char *engine = "isend";     //!< Name of the halo exchange engine
+    char *method = "explicit";  //!< Name of the time integration method
+    char *initial = "disc";     //!< Name of the generated initial field
+    int order = 2;              //!< Order of the spatial discretisation
+    int padding = -1;           //!< Cache lines added to the rows
+    int huge = 0;               //!< Fields backed by huge pages
+    int world_rank, world_size;
+
     *nsteps = NSTEPS;
     *iter0 = 0;
+    parallel->halo_depth = 1;
+    parallel->grid[0] = parallel->grid[1] = 0;
+    parallel->slices = 1;
+    parallel->slice = 0;
+    parallel->world = MPI_COMM_WORLD;
+    opts->benchmark = 0;
+    opts->skew = 0;
+    opts->strips = 16;
+    opts->tolerance = 0.0;
+    opts->dt = 0.0;
+    opts->wcycle = 0;
+    opts->gradient = -1.0;
+    opts->balance = 0;
+    opts->imbalance = 1.1;
+    opts->blocks = 0;
+    opts->hilbert = 0;
+    opts->quiescence = 0.0;
+    opts->inplace = 0;
+
+    while ((opt = getopt(argc, argv, "k:S:C:B:wP:e:t:m:d:c:T:p:o:g:i:A:b:r:O:Ha:IW:L")) != -1) {
+        switch (opt) {
+        case 'k':
+            /* Depth of the halo */
+            parallel->halo_depth = atoi(optarg);
+            break;
+        case 'S':
+            /* Stencil kernel */
+            kernel = optarg;
+            break;
+        case 'C':
+            /* Column tiles */
+            tile = atoi(optarg);
+            break;
+        case 'B':
+            /* Kernel benchmark */
+            opts->benchmark = atoi(optarg);
+            break;
+        case 'w':
+            /* Time skewing */
+            opts->skew = 1;
+            break;
+        case 'P':
+            /* Strips between progress polls */
+            opts->strips = atoi(optarg);
+            break;
+        case 'e':
+            /* Halo exchange engine */
+            engine = optarg;
+            break;
+        case 't':
+            /* Steady state tolerance */
+            opts->tolerance = atof(optarg);
+            break;
+        case 'm':
+            /* Time integration method */
+            method = optarg;
+            break;
+        case 'd':
+            /* Time step */
+            opts->dt = atof(optarg);
+            break;
+        case 'c':
+            /* Multigrid cycle */
+            if (strcmp(optarg, "v") != 0 && strcmp(optarg, "w") != 0) {
+                printf("Multigrid cycle has to be v or w\n");
+                exit(-1);
+            }
+            opts->wcycle = strcmp(optarg, "w") == 0;
+            break;
+        case 'p':
+            /* Process grid */
+            if (sscanf(optarg, "%dx%d", &parallel->grid[0],
+                       &parallel->grid[1]) != 2 ||
+                parallel->grid[0] < 1 || parallel->grid[1] < 1) {
+                printf("Process grid has to be given as PxQ\n");
+                exit(-1);
+            }
+            break;
+        case 'T':
+            /* Parareal time slices */
+            parallel->slices = atoi(optarg);
+            break;
+        case 'o':
+            /* Order of the stencil */
+            order = atoi(optarg);
+            break;
+        case 'g':
+            /* Grid spacing */
+            spacing = atof(optarg);
+            break;
+        case 'i':
+            /* Generated initial field */
+            initial = optarg;
+            break;
+        case 'b':
+            /* Steps between the load balance checks */
+            opts->balance = atoi(optarg);
+            break;
+        case 'r':
+            /* Largest tolerated load imbalance */
+            opts->imbalance = atof(optarg);
+            break;
+        case 'O':
+            /* Blocks per rank */
+            opts->blocks = atoi(optarg);
+            break;
+        case 'H':
+            /* Blocks along a Hilbert curve */
+            opts->hilbert = 1;
+            break;
+        case 'a':
+            /* Tolerance of the quiescent tiles */
+            opts->quiescence = atof(optarg);
+            if (opts->quiescence < 0.0) {
+                printf("Quiescence tolerance cannot be negative\n");
+                exit(-1);
+            }
+            break;
+        case 'I':
+            /* Single field updated in place */
+            opts->inplace = 1;
+            break;
+        case 'W':
+            /* Padding of the rows */
+            padding = atoi(optarg);
+            if (padding < 0) {
+                printf("Row padding cannot be negative\n");
+                exit(-1);
+            }
+            break;
+        case 'L':
+            /* Huge pages */
+            huge = 1;
+            break;
+        case 'A':
+            /* Gradient of the adaptive mesh refinement */
+            opts->gradient = atof(optarg);
+            if (opts->gradient < 0.0) {
+                printf("Refinement gradient cannot be negative\n");
+                exit(-1);
+            }
+            break;
+        default:
+            printf("Unsupported command line option\n");
+            exit(-1);
+        }
+    }
+    if (parallel->halo_depth < 1) {
+        printf("Halo depth has to be at least one\n");
+        exit(-1);
+    }
+    if (strcmp(method, "explicit") == 0) {
+        opts->method = METHOD_EXPLICIT;
+    } else if (strcmp(method, "cn") == 0) {
+        opts->method = METHOD_CN;
+    } else if (strcmp(method, "mg") == 0) {
+        opts->method = METHOD_MG;
+    } else if (strcmp(method, "spectral") == 0) {
+        opts->method = METHOD_SPECTRAL;
+    } else {
+        printf("Time integration method %s is not supported\n", method);
+        exit(-1);
+    }
+    if (set_stencil_order(order) != 0) {
+        printf("Order of the stencil has to be 2 or 4\n");
+        exit(-1);
+    }
+    if (order == 4 &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1)) {
+        printf("Fourth-order stencil needs the explicit method and halo "
+               "depth one\n");
+        exit(-1);
+    }
+    if (spacing <= 0.0) {
+        printf("Grid spacing has to be positive\n");
+        exit(-1);
+    }
+    if (strcmp(initial, "disc") != 0 && strcmp(initial, "sine") != 0) {
+        printf("Initial field %s is not supported\n", initial);
+        exit(-1);
+    }
+    sine_field = strcmp(initial, "sine") == 0;
+    if (opts->dt < 0.0) {
+        printf("Time step cannot be negative\n");
+        exit(-1);
+    }
+    if (opts->method == METHOD_CN &&
+        (parallel->halo_depth > 1 || strcmp(engine, "shared") == 0)) {
+        printf("Crank-Nicolson needs halo depth one and an engine other "
+               "than shared\n");
+        exit(-1);
+    }
+    if (opts->method == METHOD_MG && parallel->halo_depth > 1) {
+        printf("Multigrid needs halo depth one\n");
+        exit(-1);
+    }
+    if (opts->tolerance < 0.0) {
+        printf("Tolerance cannot be negative\n");
+        exit(-1);
+    }
+    if (opts->tolerance > 0.0 && parallel->halo_depth > 1) {
+        printf("Steady state mode needs halo depth one\n");
+        exit(-1);
+    }
+    if (opts->gradient >= 0.0 &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1 ||
+         order != 2 || opts->tolerance > 0.0 || parallel->slices > 1 ||
+         opts->benchmark)) {
+        printf("Adaptive mesh refinement needs the explicit method with "
+               "halo depth one and the five-point stencil, without steady "
+               "state, Parareal or benchmark\n");
+        exit(-1);
+    }
+    if (opts->balance < 0 || opts->imbalance < 1.0) {
+        printf("Load balance interval cannot be negative and the "
+               "imbalance ratio has to be at least 1\n");
+        exit(-1);
+    }
+    if (opts->balance > 0 &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1 ||
+         parallel->slices > 1 || opts->gradient >= 0.0 ||
+         opts->benchmark)) {
+        printf("Load balancing needs the explicit method with halo depth "
+               "one, without Parareal, refinement or benchmark\n");
+        exit(-1);
+    }
+    if (opts->blocks < 0) {
+        printf("Number of blocks per rank cannot be negative\n");
+        exit(-1);
+    }
+    if (opts->blocks > 0 &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1 ||
+         order != 2 || opts->tolerance > 0.0 || parallel->slices > 1 ||
+         opts->gradient >= 0.0 || opts->balance > 0 || opts->benchmark)) {
+        printf("Over-decomposition needs the explicit method with halo "
+               "depth one and the five-point stencil, without steady "
+               "state, Parareal, refinement, load balancing or "
+               "benchmark\n");
+        exit(-1);
+    }
+    if (opts->quiescence > 0.0 &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1 ||
+         order != 2 || opts->tolerance > 0.0 || parallel->slices > 1 ||
+         opts->gradient >= 0.0 || opts->balance > 0 || opts->blocks > 0 ||
+         opts->benchmark)) {
+        printf("Skipping the quiescent tiles needs the explicit method "
+               "with halo depth one and the five-point stencil, without "
+               "steady state, Parareal, refinement, load balancing, "
+               "over-decomposition or benchmark\n");
+        exit(-1);
+    }
+    if (opts->inplace &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1 ||
+         order != 2 || opts->tolerance > 0.0 || parallel->slices > 1 ||
+         opts->gradient >= 0.0 || opts->balance > 0 || opts->blocks > 0 ||
+         opts->quiescence > 0.0 || opts->benchmark ||
+         strcmp(engine, "shared") == 0)) {
+        printf("In-place update needs the explicit method with halo depth "
+               "one and the five-point stencil, without steady state, "
+               "Parareal, refinement, load balancing, over-decomposition, "
+               "quiescent tiles, benchmark or the shared engine\n");
+        exit(-1);
+    }
+    if (opts->balance > 0 || opts->inplace) {
+        /* The updates are timed apart from the wait for the halo, and the
+         * in-place update needs the whole interior done before the
+         * edges */
+        opts->strips = 0;
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    if (parallel->slices < 1 || world_size % parallel->slices != 0) {
+        printf("Number of time slices has to divide the number of "
+               "processes\n");
+        exit(-1);
+    }
+    if (parallel->slices > 1 &&
+        (opts->method != METHOD_EXPLICIT || parallel->halo_depth > 1 ||
+         strcmp(engine, "shared") == 0 || strcmp(engine, "rma") == 0 ||
+         opts->benchmark)) {
+        printf("Parareal needs the explicit method with halo depth one, "
+               "an engine other than shared or rma and no benchmark\n");
+        exit(-1);
+    }
+    if (parallel->slices > 1 && opts->dt == 0.0) {
+        printf("Parareal needs the time step, a bit below the stability "
+               "limit, with -d\n");
+        exit(-1);
+    }
+    if (parallel->slices > 1) {
+        /* Consecutive ranks form the spatial decomposition of a slice */
+        parallel->slice = world_rank / (world_size / parallel->slices);
+        MPI_Comm_split(MPI_COMM_WORLD, parallel->slice, world_rank,
+                       &parallel->world);
+    }
+    if (opts->strips < 0) {
+        printf("Number of strips cannot be negative\n");
+        exit(-1);
+    }
+    if (select_kernel(kernel) != 0) {
+        printf("Stencil kernel %s is not supported\n", kernel);
+        exit(-1);
+    }
+    if (select_halo(engine) != 0) {
+        printf("Halo exchange engine %s is not supported\n", engine);
+        exit(-1);
+    }
+    if (parallel->halo_depth > 1 && strcmp(engine, "isend") != 0) {
+        printf("Halo depth above one needs the isend engine\n");
+        exit(-1);
+    }
+    set_tile_width(tile < 0 ? cache_tile_width() : tile);
+    set_row_padding(padding);
+    set_huge_pages(huge);
+    argc -= optind - 1;
+    argv += optind - 1;
 
     switch (argc) {
     case 1:
@@ -65,55 +477,125 @@ void initialize(int argc, char *argv[], field *current,
         exit(-1);
     }
 
+    /* The second field is not allocated with -I */
+    previous->data = NULL;
+
    // Check if checkpoint exists
     if (!access(CHECKPOINT, F_OK)) {
         read_restart(current, parallel, iter0);
         set_field_dimensions(previous, current->nx_full, current->ny_full,
                              parallel);
-        allocate_field(previous);
-        if (parallel->rank == 0)
+        if (parallel->rank == 0 && parallel->slice == 0)
             printf("Restarting from an earlier checkpoint saved"
                    " at iteration %d.\n", *iter0);
-        copy_field(current, previous);
+        if (!opts->inplace) {
+            allocate_field(previous);
+            copy_field(current, previous);
+        }
     } else if (read_file) {
         read_field(current, previous, input_file, parallel);
+        if (opts->inplace)
+            deallocate_field(previous);
     } else {
         parallel_setup(parallel, rows, cols);
         set_field_dimensions(current, rows, cols, parallel);
         set_field_dimensions(previous, rows, cols, parallel);
         generate_field(current, parallel);
-        allocate_field(previous);
-        copy_field(current, previous);
+        if (!opts->inplace) {
+            allocate_field(previous);
+            copy_field(current, previous);
+        }
+    }
+
+    if (parallel->rank == 0 && parallel->slice == 0) {
+        printf("Using %s precision\n", PRECISION_NAME);
+        printf("Using %s stencil kernel\n", kernel_name());
+        if (stencil_radius() == 2)
+            printf("Using fourth-order stencil\n");
+        printf("Using %s halo exchange\n", halo_name());
+        if (opts->method == METHOD_CN)
+            printf("Using Crank-Nicolson time integration\n");
+        if (opts->method == METHOD_MG)
+            printf("Using multigrid for the steady state\n");
+        if (opts->method == METHOD_SPECTRAL)
+            printf("Using spectral time integration\n");
+        if (opts->balance > 0)
+            printf("Checking the load balance every %d steps\n",
+                   opts->balance);
+        if (opts->gradient >= 0.0)
+            printf("Using adaptive mesh refinement above gradient %g\n",
+                   opts->gradient);
+        if (opts->quiescence > 0.0)
+            printf("Skipping the tiles that change less than %g in a "
+                   "step\n", opts->quiescence);
+        if (opts->inplace)
+            printf("Updating a single field in place\n");
+        if (padding >= 0)
+            printf("Using rows of %d values, padded by %d cache lines\n",
+                   current->pitch, padding);
+        if (huge)
+            printf("Using transparent huge pages for the fields\n");
+        if (parallel->slices > 1)
+            printf("Using Parareal with %d time slices\n",
+                   parallel->slices);
+#ifdef _OPENMP
+        printf("Using %d OpenMP threads per MPI task\n",
+               omp_get_max_threads());
+#endif
     }
 }
 
+/* Value of the sine field of -i sine at the inner point i, j of this rank.
+ * The boundary values are at the global indices -1 and nx_full. */
+static double sine_mode(field *temperature, int i, int j)
+{
+    return sin(M_PI * (temperature->x0 + i + 1) / (temperature->nx_full + 1)) *
+           sin(M_PI * (temperature->y0 + j + 1) / (temperature->ny_full + 1));
+}
+
 /* Generate initial temperature field.  Pattern is disc with a radius
  * of nx_full / 6 in the center of the grid.
  * Boundary conditions are (different) constant temperatures outside the grid */
 void generate_field(field *temperature, parallel_data *parallel)
 {
-    int i, j, ind, width;
+    int i, j, ind, width, g;
     double radius;
     int dx, dy;
     int dims[2], coords[2], periods[2];
 
+    g = temperature->nghost;
+
     /* Allocate the temperature array, note that
      * we have to allocate also the ghost layers */
-    temperature->data =
-        malloc_2d(temperature->nx + 2, temperature->ny + 2);
+    allocate_field(temperature);
 
     MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
 
+    if (sine_field) {
+        /* Smooth field vanishing on the boundary, the ghost layers stay
+         * zero */
+        width = temperature->pitch;
+        #pragma omp parallel for private(j) schedule(static)
+        for (i = g; i < temperature->nx + g; i++) {
+            for (j = g; j < temperature->ny + g; j++) {
+                temperature->data[idx(i, j, width)] =
+                    sine_mode(temperature, i - g, j - g);
+            }
+        }
+        return;
+    }
+
     /* Radius of the source disc */
     radius = temperature->nx_full / 6.0;
 
-    width = temperature->ny + 2;
-    for (i = 0; i < temperature->nx + 2; i++) {
-        for (j = 0; j < temperature->ny + 2; j++) {
+    width = temperature->pitch;
+    #pragma omp parallel for private(j, dx, dy, ind) schedule(static)
+    for (i = 0; i < temperature->nx + 2 * g; i++) {
+        for (j = 0; j < temperature->ny + 2 * g; j++) {
             /* Distance of point i, j from the origin */
-            dx = i + coords[0] * temperature->nx -
+            dx = i - g + 1 + temperature->x0 -
                  temperature->nx_full / 2 + 1;
-            dy = j + coords[1] * temperature->ny -
+            dy = j - g + 1 + temperature->y0 -
                  temperature->ny_full / 2 + 1;
             ind = idx(i, j, width);
             if (dx * dx + dy * dy < radius * radius) {
@@ -124,38 +606,76 @@ void generate_field(field *temperature, parallel_data *parallel)
         }
     }
 
-    /* Boundary conditions */
+    /* Boundary conditions, only the ghost layer next to the inner
+     * part is used */
     // Left boundary
     if (coords[1] == 0) {
-        for (i = 0; i < temperature->nx + 2; i++) {
-            ind = idx(i, 0, width);
+        for (i = 0; i < temperature->nx + 2 * g; i++) {
+            ind = idx(i, g - 1, width);
             temperature->data[ind] = 20.0;
         }
     }
     // Right boundary
     if (coords[1] == dims[1] - 1) {
-        for (i = 0; i < temperature->nx + 2; i++) {
-            ind = idx(i, temperature->ny + 1, width);
+        for (i = 0; i < temperature->nx + 2 * g; i++) {
+            ind = idx(i, temperature->ny + g, width);
             temperature->data[ind] = 70.0;
         }
     }
     // Upper boundary
     if (coords[0] == 0) {
-        for (j = 0; j < temperature->ny + 2; j++) {
-            ind = idx(0, j, width);
+        for (j = 0; j < temperature->ny + 2 * g; j++) {
+            ind = idx(g - 1, j, width);
             temperature->data[ind] = 85.0;
         }
     }
     // Lower boundary
     if (coords[0] == dims[0] - 1) {
-        for (j = 0; j < temperature->ny + 2; j++) {
-            ind = idx(temperature->nx + 1, j, width);
+        for (j = 0; j < temperature->ny + 2 * g; j++) {
+            ind = idx(temperature->nx + g, j, width);
             temperature->data[ind] = 5.0;
         }
     }
 
 }
 
+/* Error of the field after nsteps explicit steps of length dt from the
+ * sine field of -i sine. errors[0] is the largest difference from the
+ * exact solution exp(-lambda t) u0 and errors[1] that from the explicit
+ * steps with the exact eigenvalue lambda, (1 - dt lambda)^nsteps u0, which
+ * leaves out the error of the time integration. Both are relative to the
+ * initial amplitude one. Returns -1 without the sine field. */
+int field_error(field *temperature, double a, double dt, int nsteps,
+                double *errors, parallel_data *parallel)
+{
+    int i, j, g, width;
+    double lambda, lx, ly, exact, steps, u0;
+
+    if (!sine_field)
+        return -1;
+    g = temperature->nghost;
+    width = temperature->pitch;
+    lx = (temperature->nx_full + 1) * temperature->dx;
+    ly = (temperature->ny_full + 1) * temperature->dy;
+    lambda = a * M_PI * M_PI * (1.0 / (lx * lx) + 1.0 / (ly * ly));
+    exact = exp(-lambda * nsteps * dt);
+    steps = pow(1.0 - dt * lambda, nsteps);
+
+    errors[0] = errors[1] = 0.0;
+    for (i = 0; i < temperature->nx; i++) {
+        for (j = 0; j < temperature->ny; j++) {
+            u0 = sine_mode(temperature, i, j);
+            errors[0] = fmax(errors[0], fabs(temperature->data[idx(
+                i + g, j + g, width)] - exact * u0));
+            errors[1] = fmax(errors[1], fabs(temperature->data[idx(
+                i + g, j + g, width)] - steps * u0));
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, errors, 2, MPI_DOUBLE, MPI_MAX,
+                  parallel->comm);
+    return 0;
+}
+
 /* Set dimensions of the field. Note that the nx is the size of the first
  * dimension and ny the second. */
 void set_field_dimensions(field *temperature, int nx, int ny,
@@ -165,90 +685,172 @@ void set_field_dimensions(field *temperature, int nx, int ny,
     int dims[2], coords[2], periods[2];
 
     MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
-    nx_local = nx / dims[0];
-    ny_local = ny / dims[1];
+    temperature->x0 = parallel->cuts[0][coords[0]];
+    temperature->y0 = parallel->cuts[1][coords[1]];
+    nx_local = parallel->cuts[0][coords[0] + 1] - temperature->x0;
+    ny_local = parallel->cuts[1][coords[1] + 1] - temperature->y0;
 
-    temperature->dx = DX;
-    temperature->dy = DY;
+    temperature->dx = spacing;
+    temperature->dy = spacing;
     temperature->nx = nx_local;
     temperature->ny = ny_local;
+    temperature->nghost = parallel->halo_depth * stencil_radius();
+    temperature->pitch = row_pitch(ny_local + 2 * temperature->nghost);
     temperature->nx_full = nx;
     temperature->ny_full = ny;
 }
 
+/* Number of values sent in one halo exchange by all the ranks of a
+ * dims[0] x dims[1] grid over an nx x ny field with g ghost layers. The
+ * column datatypes include the corners. */
+static long halo_volume(const int *dims, int nx, int ny, int g)
+{
+    return 2L * g * (dims[0] - 1) * (ny + 2L * g * dims[1]) +
+           2L * g * (dims[1] - 1) * (nx + 2L * g * dims[0]);
+}
+
+/* Choose the process grid of size ranks for an nx x ny field with g ghost
+ * layers: the factorisation with the smallest halo volume whose local
+ * domains hold at least g points in both directions. Among equal volumes
+ * the one with more rows of ranks wins, as with MPI_Dims_create. Returns
+ * -1 if there is no such factorisation. */
+static int choose_grid(int size, int nx, int ny, int g, int *dims)
+{
+    long volume, best = -1;
+    int p, trial[2];
+
+    for (p = size; p >= 1; p--) {
+        if (size % p != 0)
+            continue;
+        trial[0] = p;
+        trial[1] = size / p;
+        if (nx / trial[0] < g || ny / trial[1] < g || nx < trial[0] ||
+            ny < trial[1])
+            continue;
+        volume = halo_volume(trial, nx, ny, g);
+        if (best < 0 || volume < best) {
+            best = volume;
+            dims[0] = trial[0];
+            dims[1] = trial[1];
+        }
+    }
+    return best < 0 ? -1 : 0;
+}
+
 void parallel_setup(parallel_data *parallel, int nx, int ny)
 {
     int nx_local;
     int ny_local;
+    int g, k;
     int world_size;
     int dims[2] = {0, 0};
     int periods[2] = { 0, 0 };
+    int coords[2];
 
-    /* Set grid dimensions */
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
-    MPI_Dims_create(world_size, 2, dims);
-    nx_local = nx / dims[0];
-    ny_local = ny / dims[1];
+    /* Set grid dimensions, given with -p or the ones with the smallest
+     * halo volume. The grid does not need to be divisible by the process
+     * grid, the local domains then differ by one point. */
+    MPI_Comm_size(parallel->world, &world_size);
+    g = parallel->halo_depth * stencil_radius();
+    if (parallel->grid[0] > 0) {
+        dims[0] = parallel->grid[0];
+        dims[1] = parallel->grid[1];
+        if (dims[0] * dims[1] != world_size) {
+            printf("Process grid %d x %d does not match the %d processes\n",
+                   dims[0], dims[1], world_size);
+            MPI_Abort(MPI_COMM_WORLD, -2);
+        }
+    } else if (choose_grid(world_size, nx, ny, g, dims) != 0) {
+        MPI_Dims_create(world_size, 2, dims);
+    }
 
-    if (nx_local * dims[0] != nx) {
-        printf("Cannot divide grid evenly to processors in x-direction "
-               "%d x %d != %d\n", nx_local, dims[0], nx);
+    if (nx < dims[0] || ny < dims[1]) {
+        printf("Cannot divide grid %d x %d to processors %d x %d\n",
+               nx, ny, dims[0], dims[1]);
         MPI_Abort(MPI_COMM_WORLD, -2);
     }
-    if (ny_local * dims[1] != ny) {
-        printf("Cannot divide grid evenly to processors in y-direction "
-               "%d x %d != %d\n", ny_local, dims[1], ny);
+    if (g > nx / dims[0] || g > ny / dims[1]) {
+        printf("Halo depth %d is larger than the local domain %d x %d\n",
+               g, nx / dims[0], ny / dims[1]);
         MPI_Abort(MPI_COMM_WORLD, -2);
     }
 
     /* Create cartesian communicator */
-    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &parallel->comm);
+    MPI_Cart_create(parallel->world, 2, dims, periods, 1, &parallel->comm);
     MPI_Cart_shift(parallel->comm, 0, 1, &parallel->nup, &parallel->ndown);
     MPI_Cart_shift(parallel->comm, 1, 1, &parallel->nleft,
                    &parallel->nright);
 
     MPI_Comm_size(parallel->comm, &parallel->size);
     MPI_Comm_rank(parallel->comm, &parallel->rank);
+    MPI_Cart_coords(parallel->comm, parallel->rank, 2, coords);
 
-    if (parallel->rank == 0) {
+    /* Equal split to start with, rebalance may move the cuts later */
+    parallel->cuts[0] = malloc((dims[0] + dims[1] + 2) * sizeof(int));
+    parallel->cuts[1] = parallel->cuts[0] + dims[0] + 1;
+    for (k = 0; k <= dims[0]; k++)
+        parallel->cuts[0][k] = block_start(nx, dims[0], k);
+    for (k = 0; k <= dims[1]; k++)
+        parallel->cuts[1][k] = block_start(ny, dims[1], k);
+    nx_local = parallel->cuts[0][coords[0] + 1] - parallel->cuts[0][coords[0]];
+    ny_local = parallel->cuts[1][coords[1] + 1] - parallel->cuts[1][coords[1]];
+
+    if (parallel->rank == 0 && parallel->slice == 0) {
         printf("Using domain decomposition %d x %d\n", dims[0], dims[1]);
         printf("Local domain size %d x %d\n", nx_local, ny_local);
+        printf("Halo exchange volume %ld values (%.2f MB) per exchange\n",
+               halo_volume(dims, nx, ny, g),
+               halo_volume(dims, nx, ny, g) * sizeof(real) / 1.0e6);
     }
 
-    /* Create datatypes for halo exchange */
-    MPI_Type_vector(nx_local + 2, 1, ny_local + 2, MPI_DOUBLE,
+    parallel_datatypes(parallel, nx, ny);
+
+    /* Neighbours on the same node for the shared memory engine */
+    halo_setup(parallel);
+}
+
+/* Create the datatypes of the halo exchange and of the I/O for the block
+ * of this rank between the cuts of an nx x ny field */
+void parallel_datatypes(parallel_data *parallel, int nx, int ny)
+{
+    int nx_local, ny_local, g, pitch;
+    int dims[2], periods[2], coords[2];
+
+    MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
+    g = parallel->halo_depth * stencil_radius();
+    nx_local = parallel->cuts[0][coords[0] + 1] - parallel->cuts[0][coords[0]];
+    ny_local = parallel->cuts[1][coords[1] + 1] - parallel->cuts[1][coords[1]];
+    pitch = row_pitch(ny_local + 2 * g);
+
+    /* Create datatypes for halo exchange, each of them covers all the
+     * g ghost layers */
+    MPI_Type_vector(nx_local + 2 * g, g, pitch, HEAT_MPI_REAL,
                     &parallel->columntype);
-    MPI_Type_contiguous(ny_local + 2, MPI_DOUBLE, &parallel->rowtype);
+    MPI_Type_vector(g, ny_local + 2 * g, pitch, HEAT_MPI_REAL,
+                    &parallel->rowtype);
     MPI_Type_commit(&parallel->columntype);
     MPI_Type_commit(&parallel->rowtype);
 
-    /* Create datatype for subblock needed in text I/O
-     *   Rank 0 uses datatype for receiving data into full array while
-     *   other ranks use datatype for sending the inner part of array */
-    int sizes[2] = {nx_local + 2, ny_local + 2};
+    /* Create datatype for subblock needed in text I/O, the inner part of
+     * the local array. Rank 0 builds the datatypes of the blocks of the
+     * other ranks in the full array when it needs them, as their sizes
+     * differ. */
+    int sizes[2] = {nx_local + 2 * g, pitch};
     int subsizes[2] = { nx_local, ny_local };
-    int offsets[2] = {1, 1};
-    if (parallel->rank == 0) {
-        sizes[0] = nx;
-        sizes[1] = ny;
-        offsets[0] = 0;
-        offsets[1] = 0;
-    }
+    int offsets[2] = {g, g};
 
     MPI_Type_create_subarray(2, sizes, subsizes, offsets, MPI_ORDER_C,
-                             MPI_DOUBLE, &parallel->subarraytype);
+                             HEAT_MPI_REAL, &parallel->subarraytype);
     MPI_Type_commit(&parallel->subarraytype);
 
     /* Create datatypes for restart I/O
      * For boundary ranks also the ghost layer (boundary condition) 
      * is written */
 
-    int coords[2];
-    MPI_Cart_coords(parallel->comm, parallel->rank, 2, coords);
     sizes[0] = nx + 2;
     sizes[1] = ny + 2;
-    offsets[0] = 1 + coords[0] * nx_local;
-    offsets[1] = 1 + coords[1] * ny_local;
+    offsets[0] = 1 + parallel->cuts[0][coords[0]];
+    offsets[1] = 1 + parallel->cuts[1][coords[1]];
     if (coords[0] == 0) {
        offsets[0] -= 1;
        subsizes[0] += 1;
@@ -265,38 +867,48 @@ void parallel_setup(parallel_data *parallel, int nx, int ny)
     }
 
     MPI_Type_create_subarray(2, sizes, subsizes, offsets, MPI_ORDER_C,
-                             MPI_DOUBLE, &parallel->filetype);
+                             HEAT_MPI_REAL, &parallel->filetype);
     MPI_Type_commit(&parallel->filetype);
 
-    sizes[0] = nx_local + 2;
-    sizes[1] = ny_local + 2;
-    offsets[0] = 1;
-    offsets[1] = 1;
+    sizes[0] = nx_local + 2 * g;
+    sizes[1] = pitch;
+    offsets[0] = g;
+    offsets[1] = g;
     if (coords[0] == 0) {
-       offsets[0] = 0;
+       offsets[0] = g - 1;
     }
     if (coords[1] == 0) {
-       offsets[1] = 0;
+       offsets[1] = g - 1;
     }
 
     MPI_Type_create_subarray(2, sizes, subsizes, offsets, MPI_ORDER_C,
-                             MPI_DOUBLE, &parallel->restarttype);
+                             HEAT_MPI_REAL, &parallel->restarttype);
     MPI_Type_commit(&parallel->restarttype);
-
 }
 
-/* Deallocate the 2D arrays of temperature fields */
-void finalize(field *temperature1, field *temperature2,
-              parallel_data *parallel)
+/* Free the datatypes of parallel_datatypes */
+void free_datatypes(parallel_data *parallel)
 {
-    free_2d(temperature1->data);
-    free_2d(temperature2->data);
-
     MPI_Type_free(&parallel->rowtype);
     MPI_Type_free(&parallel->columntype);
     MPI_Type_free(&parallel->subarraytype);
     MPI_Type_free(&parallel->restarttype);
     MPI_Type_free(&parallel->filetype);
+}
+
+/* Deallocate the 2D arrays of temperature fields */
+void finalize(field *temperature1, field *temperature2,
+              parallel_data *parallel)
+{
+    deallocate_field(temperature1);
+    deallocate_field(temperature2);
+    cn_free();
+
+    free_datatypes(parallel);
+    free(parallel->cuts[0]);
+    halo_free();
+    if (parallel->world != MPI_COMM_WORLD)
+        MPI_Comm_free(&parallel->world);
 
 }
 
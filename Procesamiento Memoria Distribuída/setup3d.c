@@ -0,0 +1,356 @@
+/* Setup routines for the 3D heat equation solver */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "heat3d.h"
+
+#define NSTEPS 500  // Default number of iteration steps
+
+/* Initialize the 3D heat equation solver */
+void initialize3d(int argc, char *argv[], field3d *current,
+                  field3d *previous, int *nsteps, int *plane,
+                  parallel_data3d *parallel, int *iter0)
+{
+    /*
+     * Following combinations of command line arguments are possible:
+     * No arguments:    use default field dimensions and number of time steps
+     * Four arguments:  field dimensions (x, y, z) and number of time steps
+     *
+     * The arguments may be preceded by the following options:
+     * -p PxQxR:        process grid of P x Q x R ranks (default: the one
+     *                  with the smallest halo exchange volume)
+     * -z plane:        index of the plane normal to z written to the
+     *                  images (default: the middle one)
+     */
+
+    int nx = 200;               //!< Field dimensions with default values
+    int ny = 200;
+    int nz = 200;
+
+    int opt;
+
+    *nsteps = NSTEPS;
+    *iter0 = 0;
+    *plane = -1;
+    parallel->grid[0] = parallel->grid[1] = parallel->grid[2] = 0;
+
+    while ((opt = getopt(argc, argv, "p:z:")) != -1) {
+        switch (opt) {
+        case 'p':
+            /* Process grid */
+            if (sscanf(optarg, "%dx%dx%d", &parallel->grid[0],
+                       &parallel->grid[1], &parallel->grid[2]) != 3 ||
+                parallel->grid[0] < 1 || parallel->grid[1] < 1 ||
+                parallel->grid[2] < 1) {
+                printf("Process grid has to be given as PxQxR\n");
+                exit(-1);
+            }
+            break;
+        case 'z':
+            /* Plane of the images */
+            *plane = atoi(optarg);
+            break;
+        default:
+            printf("Unsupported command line option\n");
+            exit(-1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    switch (argc) {
+    case 1:
+        /* Use default values */
+        break;
+    case 5:
+        /* Field dimensions */
+        nx = atoi(argv[1]);
+        ny = atoi(argv[2]);
+        nz = atoi(argv[3]);
+        /* Number of time steps */
+        *nsteps = atoi(argv[4]);
+        break;
+    default:
+        printf("Unsupported number of command line arguments\n");
+        exit(-1);
+    }
+
+    // Check if checkpoint exists
+    if (!access(CHECKPOINT3D, F_OK)) {
+        read_restart3d(current, parallel, iter0);
+        set_field_dimensions3d(previous, current->nx_full, current->ny_full,
+                               current->nz_full, parallel);
+        allocate_field3d(previous);
+        if (parallel->rank == 0)
+            printf("Restarting from an earlier checkpoint saved"
+                   " at iteration %d.\n", *iter0);
+        copy_field3d(current, previous);
+    } else {
+        parallel_setup3d(parallel, nx, ny, nz);
+        set_field_dimensions3d(current, nx, ny, nz, parallel);
+        set_field_dimensions3d(previous, nx, ny, nz, parallel);
+        generate_field3d(current, parallel);
+        allocate_field3d(previous);
+        copy_field3d(current, previous);
+    }
+
+    if (*plane < 0)
+        *plane = current->nz_full / 2;
+    if (*plane >= current->nz_full) {
+        printf("Image plane %d is outside of the field\n", *plane);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    if (parallel->rank == 0) {
+        printf("Using %s precision\n", PRECISION_NAME);
+#ifdef _OPENMP
+        printf("Using %d OpenMP threads per MPI task\n",
+               omp_get_max_threads());
+#endif
+    }
+}
+
+/* Generate initial temperature field. Pattern is a sphere with a radius
+ * of nx_full / 6 in the center of the grid. Boundary conditions are
+ * (different) constant temperatures outside the six faces of the grid. */
+void generate_field3d(field3d *temperature, parallel_data3d *parallel)
+{
+    int i, j, k, height, width;
+    long ind;
+    double radius;
+    int dx, dy, dz;
+
+    allocate_field3d(temperature);
+
+    /* Radius of the source sphere */
+    radius = temperature->nx_full / 6.0;
+
+    height = temperature->ny + 2;
+    width = temperature->nz + 2;
+    #pragma omp parallel for private(j, k, dx, dy, dz, ind) schedule(static)
+    for (i = 0; i < temperature->nx + 2; i++) {
+        for (j = 0; j < temperature->ny + 2; j++) {
+            for (k = 0; k < temperature->nz + 2; k++) {
+                /* Distance of point i, j, k from the origin */
+                dx = i + temperature->x0 - temperature->nx_full / 2 + 1;
+                dy = j + temperature->y0 - temperature->ny_full / 2 + 1;
+                dz = k + temperature->z0 - temperature->nz_full / 2 + 1;
+                ind = idx3d(i, j, k, height, width);
+                if (dx * dx + dy * dy + dz * dz < radius * radius) {
+                    temperature->data[ind] = 5.0;
+                } else {
+                    temperature->data[ind] = 65.0;
+                }
+            }
+        }
+    }
+
+    /* Boundary conditions on the faces of the grid, the lower and upper
+     * face along x, y and z */
+    for (i = 0; i < temperature->nx + 2; i++) {
+        for (j = 0; j < temperature->ny + 2; j++) {
+            for (k = 0; k < temperature->nz + 2; k++) {
+                ind = idx3d(i, j, k, height, width);
+                if (i == 0 && parallel->coords[0] == 0)
+                    temperature->data[ind] = 85.0;
+                if (i == temperature->nx + 1 &&
+                    parallel->coords[0] == parallel->dims[0] - 1)
+                    temperature->data[ind] = 5.0;
+                if (j == 0 && parallel->coords[1] == 0)
+                    temperature->data[ind] = 20.0;
+                if (j == temperature->ny + 1 &&
+                    parallel->coords[1] == parallel->dims[1] - 1)
+                    temperature->data[ind] = 70.0;
+                if (k == 0 && parallel->coords[2] == 0)
+                    temperature->data[ind] = 40.0;
+                if (k == temperature->nz + 1 &&
+                    parallel->coords[2] == parallel->dims[2] - 1)
+                    temperature->data[ind] = 50.0;
+            }
+        }
+    }
+}
+
+/* Set dimensions of the field from the block of this rank */
+void set_field_dimensions3d(field3d *temperature, int nx, int ny, int nz,
+                            parallel_data3d *parallel)
+{
+    int *dims = parallel->dims, *coords = parallel->coords;
+
+    temperature->x0 = block_start(nx, dims[0], coords[0]);
+    temperature->y0 = block_start(ny, dims[1], coords[1]);
+    temperature->z0 = block_start(nz, dims[2], coords[2]);
+    temperature->nx = block_start(nx, dims[0], coords[0] + 1) -
+                      temperature->x0;
+    temperature->ny = block_start(ny, dims[1], coords[1] + 1) -
+                      temperature->y0;
+    temperature->nz = block_start(nz, dims[2], coords[2] + 1) -
+                      temperature->z0;
+
+    temperature->dx = DX;
+    temperature->dy = DY;
+    temperature->dz = DZ;
+    temperature->nx_full = nx;
+    temperature->ny_full = ny;
+    temperature->nz_full = nz;
+}
+
+/* Number of values sent in one halo exchange by all the ranks of a
+ * dims[0] x dims[1] x dims[2] grid over an nx x ny x nz field */
+static long halo_volume3d(const int *dims, int nx, int ny, int nz)
+{
+    return 2L * (dims[0] - 1) * ny * nz + 2L * (dims[1] - 1) * nx * nz +
+           2L * (dims[2] - 1) * nx * ny;
+}
+
+/* Choose the process grid of size ranks for an nx x ny x nz field: the
+ * factorisation with the smallest halo volume that gives every rank at
+ * least one point in all directions. Among equal volumes the one with
+ * more ranks along the first dimensions wins. Returns -1 if there is no
+ * such factorisation. */
+static int choose_grid3d(int size, int nx, int ny, int nz, int *dims)
+{
+    long volume, best = -1;
+    int p, q, trial[3];
+
+    for (p = size; p >= 1; p--) {
+        if (size % p != 0)
+            continue;
+        for (q = size / p; q >= 1; q--) {
+            if ((size / p) % q != 0)
+                continue;
+            trial[0] = p;
+            trial[1] = q;
+            trial[2] = size / p / q;
+            if (nx < trial[0] || ny < trial[1] || nz < trial[2])
+                continue;
+            volume = halo_volume3d(trial, nx, ny, nz);
+            if (best < 0 || volume < best) {
+                best = volume;
+                dims[0] = trial[0];
+                dims[1] = trial[1];
+                dims[2] = trial[2];
+            }
+        }
+    }
+    return best < 0 ? -1 : 0;
+}
+
+void parallel_setup3d(parallel_data3d *parallel, int nx, int ny, int nz)
+{
+    int world_size, d;
+    int *dims = parallel->dims, *coords = parallel->coords;
+    int periods[3] = {0, 0, 0};
+    int local[3], sizes[3], subsizes[3], offsets[3], full[3];
+
+    /* Set grid dimensions, given with -p or the ones with the smallest
+     * halo volume */
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    dims[0] = dims[1] = dims[2] = 0;
+    if (parallel->grid[0] > 0) {
+        for (d = 0; d < 3; d++)
+            dims[d] = parallel->grid[d];
+        if (dims[0] * dims[1] * dims[2] != world_size) {
+            printf("Process grid %d x %d x %d does not match the %d "
+                   "processes\n", dims[0], dims[1], dims[2], world_size);
+            MPI_Abort(MPI_COMM_WORLD, -2);
+        }
+    } else if (choose_grid3d(world_size, nx, ny, nz, dims) != 0) {
+        MPI_Dims_create(world_size, 3, dims);
+    }
+
+    if (nx < dims[0] || ny < dims[1] || nz < dims[2]) {
+        printf("Cannot divide grid %d x %d x %d to processors "
+               "%d x %d x %d\n", nx, ny, nz, dims[0], dims[1], dims[2]);
+        MPI_Abort(MPI_COMM_WORLD, -2);
+    }
+
+    /* Create cartesian communicator */
+    MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 1, &parallel->comm);
+    for (d = 0; d < 3; d++)
+        MPI_Cart_shift(parallel->comm, d, 1, &parallel->nb[2 * d],
+                       &parallel->nb[2 * d + 1]);
+    MPI_Comm_size(parallel->comm, &parallel->size);
+    MPI_Comm_rank(parallel->comm, &parallel->rank);
+    MPI_Cart_coords(parallel->comm, parallel->rank, 3, coords);
+
+    full[0] = nx;
+    full[1] = ny;
+    full[2] = nz;
+    for (d = 0; d < 3; d++) {
+        local[d] = block_start(full[d], dims[d], coords[d] + 1) -
+                   block_start(full[d], dims[d], coords[d]);
+        sizes[d] = local[d] + 2;
+    }
+
+    if (parallel->rank == 0) {
+        printf("Using domain decomposition %d x %d x %d\n", dims[0],
+               dims[1], dims[2]);
+        printf("Local domain size %d x %d x %d\n", local[0], local[1],
+               local[2]);
+        printf("Halo exchange volume %ld values (%.2f MB) per exchange\n",
+               halo_volume3d(dims, nx, ny, nz),
+               halo_volume3d(dims, nx, ny, nz) * sizeof(real) / 1.0e6);
+    }
+
+    /* Create datatypes for the halo exchange, the inner part of a face
+     * normal to direction d starting from the first point of the buffer */
+    for (d = 0; d < 3; d++) {
+        subsizes[0] = local[0];
+        subsizes[1] = local[1];
+        subsizes[2] = local[2];
+        subsizes[d] = 1;
+        offsets[0] = offsets[1] = offsets[2] = 0;
+        MPI_Type_create_subarray(3, sizes, subsizes, offsets, MPI_ORDER_C,
+                                 HEAT_MPI_REAL, &parallel->facetype[d]);
+        MPI_Type_commit(&parallel->facetype[d]);
+    }
+
+    /* Create datatypes for restart I/O
+     * For boundary ranks also the ghost layer (boundary condition)
+     * is written */
+    for (d = 0; d < 3; d++) {
+        subsizes[d] = local[d];
+        offsets[d] = 1 + block_start(full[d], dims[d], coords[d]);
+        if (coords[d] == 0) {
+            offsets[d] -= 1;
+            subsizes[d] += 1;
+        }
+        if (coords[d] == dims[d] - 1) {
+            subsizes[d] += 1;
+        }
+        full[d] += 2;
+    }
+    MPI_Type_create_subarray(3, full, subsizes, offsets, MPI_ORDER_C,
+                             HEAT_MPI_REAL, &parallel->filetype);
+    MPI_Type_commit(&parallel->filetype);
+
+    for (d = 0; d < 3; d++)
+        offsets[d] = coords[d] == 0 ? 0 : 1;
+    MPI_Type_create_subarray(3, sizes, subsizes, offsets, MPI_ORDER_C,
+                             HEAT_MPI_REAL, &parallel->restarttype);
+    MPI_Type_commit(&parallel->restarttype);
+}
+
+/* Deallocate the 3D arrays of temperature fields */
+void finalize3d(field3d *temperature1, field3d *temperature2,
+                parallel_data3d *parallel)
+{
+    int d;
+
+    free(temperature1->data);
+    free(temperature2->data);
+
+    for (d = 0; d < 3; d++)
+        MPI_Type_free(&parallel->facetype[d]);
+    MPI_Type_free(&parallel->restarttype);
+    MPI_Type_free(&parallel->filetype);
+    MPI_Comm_free(&parallel->comm);
+}
@@ -0,0 +1,345 @@
+/* Spectral integrator for heat equation solver
+ *
+ * With the option -m spectral the field at time T = nsteps * dt is
+ * computed directly in the eigenbasis of the five-point Laplacian, whose
+ * eigenvectors with zero boundary values are the products of sines. The
+ * boundary values do not change, so with L u = L0 u + b, where L0 is the
+ * Laplacian with zero boundary values and b holds the boundary values
+ * next to the edges, the solution of du/dt = a L u is
+ *
+ *     u(T) = u_s + exp(a L0 T) (u(0) - u_s),     u_s = -L0^-1 b,
+ *
+ * and for the mode (p, q) with the eigenvalue l of L0
+ *
+ *     u(T)_pq = e u(0)_pq + (e - 1) / l b_pq,    e = exp(a l T).
+ *
+ * The time integration is exact, so the result differs from that of the
+ * explicit method only by the error of its time discretisation.
+ *
+ * The two dimensional discrete sine transform (DST-I) is done as one
+ * dimensional transforms of the rows and then of the columns. For each
+ * direction the blocks of the ranks on the same row (column) of the
+ * Cartesian grid are redistributed with MPI_Alltoallv, so that every rank
+ * holds some of the complete rows (columns), and distributed back after
+ * the transforms. A transform of length n is computed with a complex FFT
+ * of the odd extension of length 2(n+1), two real lines at a time as the
+ * real and imaginary parts. Lengths that are not powers of two use
+ * Bluestein's algorithm with a power of two FFT. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <mpi.h>
+
+#include "heat.h"
+
+/* Plan of the sine transform of length n */
+typedef struct {
+    int n;                     /* Length of the transform */
+    int m;                     /* Length 2(n+1) of the odd extension */
+    int p;                     /* Length of the FFTs, m if it is a power of
+                                * two, otherwise that of the convolution of
+                                * Bluestein's algorithm */
+    double complex *chirp;     /* exp(-i pi k^2 / m), NULL if m = p */
+    double complex *filter;    /* FFT of the conjugate chirp */
+} dst_plan;
+
+/* In place radix-2 FFT of length n (a power of two), with the sign of the
+ * exponent given by sign */
+static void fft(double complex *x, int n, int sign)
+{
+    double complex t, w, wl;
+    int i, j, k, len;
+
+    for (i = 1, j = 0; i < n; i++) {
+        k = n >> 1;
+        for (; j & k; k >>= 1)
+            j ^= k;
+        j ^= k;
+        if (i < j) {
+            t = x[i];
+            x[i] = x[j];
+            x[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        wl = cexp(sign * 2.0 * M_PI * I / len);
+        for (i = 0; i < n; i += len) {
+            w = 1.0;
+            for (k = 0; k < len / 2; k++) {
+                t = w * x[i + k + len / 2];
+                x[i + k + len / 2] = x[i + k] - t;
+                x[i + k] += t;
+                w *= wl;
+            }
+        }
+    }
+}
+
+static void plan_create(dst_plan *plan, int n)
+{
+    int k;
+    double phase;
+
+    plan->n = n;
+    plan->m = 2 * (n + 1);
+    plan->chirp = plan->filter = NULL;
+    if ((plan->m & (plan->m - 1)) == 0) {
+        plan->p = plan->m;
+        return;
+    }
+    for (plan->p = 1; plan->p < 2 * plan->m - 1; plan->p <<= 1)
+        ;
+    plan->chirp = malloc(plan->m * sizeof(double complex));
+    plan->filter = calloc(plan->p, sizeof(double complex));
+    for (k = 0; k < plan->m; k++) {
+        /* k^2 mod 2m keeps the phase accurate for large k */
+        phase = M_PI * (double) (((long) k * k) % (2 * plan->m)) / plan->m;
+        plan->chirp[k] = cexp(-I * phase);
+        plan->filter[k] = conj(plan->chirp[k]);
+        if (k > 0)
+            plan->filter[plan->p - k] = conj(plan->chirp[k]);
+    }
+    fft(plan->filter, plan->p, -1);
+}
+
+static void plan_destroy(dst_plan *plan)
+{
+    free(plan->chirp);
+    free(plan->filter);
+}
+
+/* Forward DFT of length m of z, with the work array of length p */
+static void dft(dst_plan *plan, double complex *z, double complex *work)
+{
+    int k;
+
+    if (plan->chirp == NULL) {
+        fft(z, plan->m, -1);
+        return;
+    }
+    /* Bluestein: the DFT as a convolution with the chirp */
+    for (k = 0; k < plan->m; k++)
+        work[k] = z[k] * plan->chirp[k];
+    for (; k < plan->p; k++)
+        work[k] = 0.0;
+    fft(work, plan->p, -1);
+    for (k = 0; k < plan->p; k++)
+        work[k] *= plan->filter[k];
+    fft(work, plan->p, 1);
+    for (k = 0; k < plan->m; k++)
+        z[k] = work[k] * plan->chirp[k] / plan->p;
+}
+
+/* Unnormalized sine transforms y_k = sum_j x_j sin(pi (j+1) (k+1) / (n+1))
+ * of count lines of length n, stride apart, in place */
+static void dst_lines(dst_plan *plan, double *lines, int count, int stride)
+{
+    int l;
+
+    #pragma omp parallel
+    {
+        double complex *z, *work;
+        double *a, *b;
+        int j, n = plan->n;
+
+        z = malloc(plan->m * sizeof(double complex));
+        work = malloc(plan->p * sizeof(double complex));
+        #pragma omp for schedule(static)
+        for (l = 0; l < count; l += 2) {
+            /* Odd extensions of two lines as the real and imaginary
+             * parts, their DFTs are -2i y_a and -2i y_b */
+            a = &lines[(long) l * stride];
+            b = l + 1 < count ? &lines[(long) (l + 1) * stride] : NULL;
+            z[0] = z[n + 1] = 0.0;
+            for (j = 0; j < n; j++) {
+                z[j + 1] = a[j] + I * (b ? b[j] : 0.0);
+                z[plan->m - 1 - j] = -z[j + 1];
+            }
+            dft(plan, z, work);
+            for (j = 0; j < n; j++) {
+                a[j] = -0.5 * cimag(z[j + 1]);
+                if (b)
+                    b[j] = 0.5 * creal(z[j + 1]);
+            }
+        }
+        free(z);
+        free(work);
+    }
+}
+
+/* Sine transform along the rows of the nx x ny block of a, whose rows are
+ * split over the size ranks of comm, with the same nx but possibly
+ * different ny: the rows of the block are divided among the ranks, which
+ * assemble and transform the complete rows */
+static void dst_rows(double *a, int nx, int ny, MPI_Comm comm,
+                     dst_plan *plan)
+{
+    int size, rank, s, i, rows, n;
+    int *scounts, *sdispls, *rcounts, *rdispls, *widths, *offsets;
+    double *recv, *full;
+
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+    scounts = malloc(6 * size * sizeof(int));
+    sdispls = scounts + size;
+    rcounts = scounts + 2 * size;
+    rdispls = scounts + 3 * size;
+    widths = scounts + 4 * size;
+    offsets = scounts + 5 * size;
+
+    /* Parts of the rows on the ranks */
+    MPI_Allgather(&ny, 1, MPI_INT, widths, 1, MPI_INT, comm);
+    for (n = 0, s = 0; s < size; s++) {
+        offsets[s] = n;
+        n += widths[s];
+    }
+    rows = block_start(nx, size, rank + 1) - block_start(nx, size, rank);
+    for (s = 0; s < size; s++) {
+        scounts[s] = (block_start(nx, size, s + 1) -
+                      block_start(nx, size, s)) * ny;
+        sdispls[s] = block_start(nx, size, s) * ny;
+        rcounts[s] = rows * widths[s];
+        rdispls[s] = rows * offsets[s];
+    }
+    recv = malloc((size_t) rows * n * sizeof(double));
+    full = malloc((size_t) rows * n * sizeof(double));
+
+    /* Assemble the complete rows, transform and distribute back */
+    MPI_Alltoallv(a, scounts, sdispls, MPI_DOUBLE, recv, rcounts, rdispls,
+                  MPI_DOUBLE, comm);
+    for (s = 0; s < size; s++)
+        for (i = 0; i < rows; i++)
+            memcpy(&full[(long) i * n + offsets[s]],
+                   &recv[rdispls[s] + i * widths[s]],
+                   widths[s] * sizeof(double));
+    dst_lines(plan, full, rows, n);
+    for (s = 0; s < size; s++)
+        for (i = 0; i < rows; i++)
+            memcpy(&recv[rdispls[s] + i * widths[s]],
+                   &full[(long) i * n + offsets[s]],
+                   widths[s] * sizeof(double));
+    MPI_Alltoallv(recv, rcounts, rdispls, MPI_DOUBLE, a, scounts, sdispls,
+                  MPI_DOUBLE, comm);
+
+    free(recv);
+    free(full);
+    free(scounts);
+}
+
+/* Transpose the nx x ny array a into t */
+static void transpose(double *t, const double *a, int nx, int ny)
+{
+    int i, j;
+
+    #pragma omp parallel for private(j) schedule(static)
+    for (j = 0; j < ny; j++)
+        for (i = 0; i < nx; i++)
+            t[(long) j * nx + i] = a[(long) i * ny + j];
+}
+
+/* Two dimensional sine transform of the local nx x ny block a of the
+ * distributed field */
+static void dst_2d(double *a, double *t, int nx, int ny, MPI_Comm rowcomm,
+                   MPI_Comm colcomm, dst_plan *rowplan, dst_plan *colplan)
+{
+    dst_rows(a, nx, ny, rowcomm, rowplan);
+    transpose(t, a, nx, ny);
+    dst_rows(t, ny, nx, colcomm, colplan);
+    transpose(a, t, ny, nx);
+}
+
+/* Advance temperature by nsteps steps of length dt, with the diffusion
+ * constant a, in a single spectral step */
+void evolve_spectral(field *temperature, double a, double dt, int nsteps,
+                     parallel_data *parallel)
+{
+    MPI_Comm rowcomm, colcomm;
+    dst_plan rowplan, colplan;
+    double *u, *b, *t;
+    double wx, wy, lx, l, e, time;
+    int remain[2];
+    int nx, ny, nx_full, ny_full, g, width, i, j, p, q;
+    const real *d;
+
+    nx = temperature->nx;
+    ny = temperature->ny;
+    nx_full = temperature->nx_full;
+    ny_full = temperature->ny_full;
+    g = temperature->nghost;
+    width = temperature->pitch;
+    d = temperature->data;
+    wx = 1.0 / (temperature->dx * temperature->dx);
+    wy = 1.0 / (temperature->dy * temperature->dy);
+    time = dt * nsteps;
+
+    remain[0] = 0;
+    remain[1] = 1;
+    MPI_Cart_sub(parallel->comm, remain, &rowcomm);
+    remain[0] = 1;
+    remain[1] = 0;
+    MPI_Cart_sub(parallel->comm, remain, &colcomm);
+    plan_create(&rowplan, ny_full);
+    plan_create(&colplan, nx_full);
+
+    /* Inner values and the boundary term b, nonzero only next to the
+     * physical boundary */
+    u = malloc((size_t) nx * ny * sizeof(double));
+    b = malloc((size_t) nx * ny * sizeof(double));
+    t = malloc((size_t) nx * ny * sizeof(double));
+    for (i = 0; i < nx; i++) {
+        for (j = 0; j < ny; j++) {
+            u[i * ny + j] = d[idx(i + g, j + g, width)];
+            b[i * ny + j] = 0.0;
+        }
+    }
+    for (j = 0; j < ny; j++) {
+        if (parallel->nup == MPI_PROC_NULL)
+            b[j] += wx * d[idx(g - 1, j + g, width)];
+        if (parallel->ndown == MPI_PROC_NULL)
+            b[(nx - 1) * ny + j] += wx * d[idx(nx + g, j + g, width)];
+    }
+    for (i = 0; i < nx; i++) {
+        if (parallel->nleft == MPI_PROC_NULL)
+            b[i * ny] += wy * d[idx(i + g, g - 1, width)];
+        if (parallel->nright == MPI_PROC_NULL)
+            b[i * ny + ny - 1] += wy * d[idx(i + g, ny + g, width)];
+    }
+
+    dst_2d(u, t, nx, ny, rowcomm, colcomm, &rowplan, &colplan);
+    dst_2d(b, t, nx, ny, rowcomm, colcomm, &rowplan, &colplan);
+
+    /* Exact decay of the modes, with the normalization of the inverse
+     * transform */
+    #pragma omp parallel for private(j, p, q, lx, l, e) schedule(static)
+    for (i = 0; i < nx; i++) {
+        p = temperature->x0 + i + 1;
+        lx = sin(M_PI * p / (2.0 * (nx_full + 1)));
+        lx = -4.0 * wx * lx * lx;
+        for (j = 0; j < ny; j++) {
+            q = temperature->y0 + j + 1;
+            l = sin(M_PI * q / (2.0 * (ny_full + 1)));
+            l = lx - 4.0 * wy * l * l;
+            e = exp(a * l * time);
+            u[i * ny + j] = (e * u[i * ny + j] +
+                             (e - 1.0) / l * b[i * ny + j]) *
+                4.0 / ((nx_full + 1.0) * (ny_full + 1.0));
+        }
+    }
+
+    /* The sine transform is its own inverse up to the normalization */
+    dst_2d(u, t, nx, ny, rowcomm, colcomm, &rowplan, &colplan);
+    for (i = 0; i < nx; i++)
+        for (j = 0; j < ny; j++)
+            temperature->data[idx(i + g, j + g, width)] = u[i * ny + j];
+
+    free(u);
+    free(b);
+    free(t);
+    plan_destroy(&rowplan);
+    plan_destroy(&colplan);
+    MPI_Comm_free(&rowcomm);
+    MPI_Comm_free(&colcomm);
+}
@@ -0,0 +1,414 @@
+/* Row kernels of the five-point stencil for heat equation solver
+ *
+ * All the update routines in core.c call evolve_row, which dispatches to
+ * an explicitly vectorized kernel (AVX2 or AVX-512) or to the portable
+ * one. The kernel is chosen at start-up from the features of the CPU, or
+ * by the user with the option -S.
+ *
+ * The kernels use the precomputed coefficients cx = a*dt/dx^2 and
+ * cy = a*dt/dy^2 instead of dividing at every point, and they all evaluate
+ * the update in the same order without fused multiply-adds, so that the
+ * results of the different kernels are bitwise identical. Compared to the
+ * original formulation u + a*dt*((...)/dx^2 + (...)/dy^2) the update of
+ * a single point differs by at most a couple of units in the last place,
+ * the relative difference in the field stays below 1e-13 for the default
+ * runs.
+ *
+ * With single precision storage (make PRECISION=single or mixed) there
+ * are no hand-written kernels: the portable loop is compiled for AVX2 and
+ * AVX-512 and vectorized by the compiler. In the mixed mode the loop
+ * converts the values to double precision and rounds only the result.
+ *
+ * evolve_row_residual does the same update and accumulates also the
+ * largest absolute change of a point and the sum of the squared changes,
+ * used by the convergence check of the steady state mode (option -t).
+ * The change is taken from the registers while the point is updated, so
+ * no additional pass over the field is needed.
+ *
+ * With the option -o 4 the rows are updated with the fourth-order stencil
+ *
+ *     u_xx = (-u[i-2] + 16 u[i-1] - 30 u[i] + 16 u[i+1] - u[i+2]) / 12dx^2
+ *
+ * in both directions, which reads two points on each side (stencil radius
+ * two). Its kernels are the portable loop compiled for AVX2 and AVX-512,
+ * selected together with the five-point ones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <mpi.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "heat.h"
+
+/* Precision of the arithmetic of the stencil */
+#ifdef HEAT_SINGLE
+typedef float accum;
+#else
+typedef double accum;
+#endif
+
+/* The kernels update n points of a row. If res is not NULL, res[0] is
+ * raised to the largest absolute change of the points and the squared
+ * changes are added to res[1]. */
+typedef void (*row_kernel)(real *restrict curr, const real *restrict prev,
+                           int width, int n, double cx, double cy,
+                           double *res);
+
+/* Change of point j in one step */
+static inline __attribute__((always_inline))
+accum point_change(const real *restrict prev, const real *restrict up,
+                   const real *restrict down, int j, accum ax, accum ay)
+{
+    accum c2 = 2 * (accum) prev[j];
+
+    return ax * (((accum) down[j] - c2) + up[j]) +
+           ay * (((accum) prev[j+1] - c2) + prev[j-1]);
+}
+
+/* Loop of the portable kernel */
+static inline __attribute__((always_inline))
+void row_loop(real *restrict curr, const real *restrict prev, int width,
+              int n, double cx, double cy, double *res)
+{
+    const real *restrict up = prev - width;
+    const real *restrict down = prev + width;
+    const accum ax = cx, ay = cy;
+    accum d, dmax = 0, dsum = 0;
+    int j;
+
+    if (res == NULL) {
+        for (j = 0; j < n; j++) {
+            curr[j] = prev[j] + point_change(prev, up, down, j, ax, ay);
+        }
+        return;
+    }
+    for (j = 0; j < n; j++) {
+        d = point_change(prev, up, down, j, ax, ay);
+        curr[j] = prev[j] + d;
+        dsum += d * d;
+        d = d < 0 ? -d : d;
+        dmax = d > dmax ? d : dmax;
+    }
+    if (dmax > res[0])
+        res[0] = dmax;
+    res[1] += dsum;
+}
+
+/* Portable kernel, also used for the remainders of the SIMD kernels */
+static void row_portable(real *restrict curr, const real *restrict prev,
+                         int width, int n, double cx, double cy, double *res)
+{
+    row_loop(curr, prev, width, n, cx, cy, res);
+}
+
+/* Change of point j in one step of the fourth-order stencil, ax and ay
+ * are cx / 12 and cy / 12 */
+static inline __attribute__((always_inline))
+accum point_change4(const real *restrict prev, const real *restrict up,
+                    const real *restrict down, const real *restrict up2,
+                    const real *restrict down2, int j, accum ax, accum ay)
+{
+    accum c30 = 30 * (accum) prev[j];
+
+    return ax * ((16 * ((accum) up[j] + down[j]) - c30) -
+                 ((accum) up2[j] + down2[j])) +
+           ay * ((16 * ((accum) prev[j-1] + prev[j+1]) - c30) -
+                 ((accum) prev[j-2] + prev[j+2]));
+}
+
+/* Loop of the fourth-order kernels */
+static inline __attribute__((always_inline))
+void row4_loop(real *restrict curr, const real *restrict prev, int width,
+               int n, double cx, double cy, double *res)
+{
+    const real *restrict up = prev - width;
+    const real *restrict down = prev + width;
+    const real *restrict up2 = prev - 2 * width;
+    const real *restrict down2 = prev + 2 * width;
+    const accum ax = cx / 12.0, ay = cy / 12.0;
+    accum d, dmax = 0, dsum = 0;
+    int j;
+
+    if (res == NULL) {
+        for (j = 0; j < n; j++) {
+            curr[j] = prev[j] + point_change4(prev, up, down, up2, down2, j,
+                                              ax, ay);
+        }
+        return;
+    }
+    for (j = 0; j < n; j++) {
+        d = point_change4(prev, up, down, up2, down2, j, ax, ay);
+        curr[j] = prev[j] + d;
+        dsum += d * d;
+        d = d < 0 ? -d : d;
+        dmax = d > dmax ? d : dmax;
+    }
+    if (dmax > res[0])
+        res[0] = dmax;
+    res[1] += dsum;
+}
+
+static void row4_portable(real *restrict curr, const real *restrict prev,
+                          int width, int n, double cx, double cy, double *res)
+{
+    row4_loop(curr, prev, width, n, cx, cy, res);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__((target("avx2")))
+static void row4_avx2(real *restrict curr, const real *restrict prev,
+                      int width, int n, double cx, double cy, double *res)
+{
+    row4_loop(curr, prev, width, n, cx, cy, res);
+}
+
+__attribute__((target("avx512f")))
+static void row4_avx512(real *restrict curr, const real *restrict prev,
+                        int width, int n, double cx, double cy, double *res)
+{
+    row4_loop(curr, prev, width, n, cx, cy, res);
+}
+
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(HEAT_FLOAT_STORAGE)
+
+__attribute__((target("avx2")))
+static void row_avx2(real *restrict curr, const real *restrict prev,
+                     int width, int n, double cx, double cy, double *res)
+{
+    row_loop(curr, prev, width, n, cx, cy, res);
+}
+
+__attribute__((target("avx512f")))
+static void row_avx512(real *restrict curr, const real *restrict prev,
+                       int width, int n, double cx, double cy, double *res)
+{
+    row_loop(curr, prev, width, n, cx, cy, res);
+}
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+/* Body of the AVX2 loop, LOAD is the load used for the center, up and
+ * down rows and RES accumulates the change x of the points */
+#define AVX2_LOOP(LOAD, RES)                                             \
+    for (; j + 4 <= n; j += 4) {                                         \
+        c = LOAD(&prev[j]);                                              \
+        c2 = _mm256_add_pd(c, c);                                        \
+        x = _mm256_add_pd(_mm256_sub_pd(LOAD(&down[j]), c2),             \
+                          LOAD(&up[j]));                                 \
+        y = _mm256_add_pd(_mm256_sub_pd(_mm256_loadu_pd(&prev[j+1]), c2),\
+                          _mm256_loadu_pd(&prev[j-1]));                  \
+        x = _mm256_add_pd(_mm256_mul_pd(vcx, x), _mm256_mul_pd(vcy, y)); \
+        _mm256_store_pd(&curr[j], _mm256_add_pd(c, x));                  \
+        RES                                                              \
+    }
+
+#define AVX2_RES                                                         \
+        rmax = _mm256_max_pd(rmax, _mm256_andnot_pd(sign, x));           \
+        rsum = _mm256_add_pd(rsum, _mm256_mul_pd(x, x));
+
+__attribute__((target("avx2")))
+static void row_avx2(double *restrict curr, const double *restrict prev,
+                     int width, int n, double cx, double cy, double *res)
+{
+    const double *restrict up = prev - width;
+    const double *restrict down = prev + width;
+    __m256d vcx = _mm256_set1_pd(cx);
+    __m256d vcy = _mm256_set1_pd(cy);
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d rmax = _mm256_setzero_pd(), rsum = _mm256_setzero_pd();
+    __m256d c, c2, x, y;
+    double lanes[4];
+    int j, k;
+
+    /* Peel until the stores are aligned */
+    j = ((32 - (uintptr_t) curr % 32) % 32) / sizeof(double);
+    if (j > n || (uintptr_t) curr % sizeof(double))
+        j = n;
+    /* The portable kernel is not VEX encoded, clear the upper halves of
+     * the vector registers first to avoid the penalty of the transition,
+     * which is paid at every call with short rows */
+    _mm256_zeroupper();
+    row_portable(curr, prev, width, j, cx, cy, res);
+
+    if (res == NULL) {
+        if ((uintptr_t) &prev[j] % 32 == 0 && width % 4 == 0) {
+            AVX2_LOOP(_mm256_load_pd, )
+        } else {
+            AVX2_LOOP(_mm256_loadu_pd, )
+        }
+    } else {
+        if ((uintptr_t) &prev[j] % 32 == 0 && width % 4 == 0) {
+            AVX2_LOOP(_mm256_load_pd, AVX2_RES)
+        } else {
+            AVX2_LOOP(_mm256_loadu_pd, AVX2_RES)
+        }
+        _mm256_storeu_pd(lanes, rmax);
+        for (k = 0; k < 4; k++)
+            if (lanes[k] > res[0])
+                res[0] = lanes[k];
+        _mm256_storeu_pd(lanes, rsum);
+        res[1] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+
+    /* Remainder */
+    _mm256_zeroupper();
+    row_portable(&curr[j], &prev[j], width, n - j, cx, cy, res);
+}
+
+#define AVX512_LOOP(LOAD, RES)                                           \
+    for (; j + 8 <= n; j += 8) {                                         \
+        c = LOAD(&prev[j]);                                              \
+        c2 = _mm512_add_pd(c, c);                                        \
+        x = _mm512_add_pd(_mm512_sub_pd(LOAD(&down[j]), c2),             \
+                          LOAD(&up[j]));                                 \
+        y = _mm512_add_pd(_mm512_sub_pd(_mm512_loadu_pd(&prev[j+1]), c2),\
+                          _mm512_loadu_pd(&prev[j-1]));                  \
+        x = _mm512_add_pd(_mm512_mul_pd(vcx, x), _mm512_mul_pd(vcy, y)); \
+        _mm512_store_pd(&curr[j], _mm512_add_pd(c, x));                  \
+        RES                                                              \
+    }
+
+#define AVX512_RES                                                       \
+        rmax = _mm512_max_pd(rmax, _mm512_abs_pd(x));                    \
+        rsum = _mm512_add_pd(rsum, _mm512_mul_pd(x, x));
+
+__attribute__((target("avx512f")))
+static void row_avx512(double *restrict curr, const double *restrict prev,
+                       int width, int n, double cx, double cy, double *res)
+{
+    const double *restrict up = prev - width;
+    const double *restrict down = prev + width;
+    __m512d vcx = _mm512_set1_pd(cx);
+    __m512d vcy = _mm512_set1_pd(cy);
+    __m512d rmax = _mm512_setzero_pd(), rsum = _mm512_setzero_pd();
+    __m512d c, c2, x, y;
+    double m;
+    int j;
+
+    /* Peel until the stores are aligned */
+    j = ((64 - (uintptr_t) curr % 64) % 64) / sizeof(double);
+    if (j > n || (uintptr_t) curr % sizeof(double))
+        j = n;
+    _mm256_zeroupper();
+    row_portable(curr, prev, width, j, cx, cy, res);
+
+    if (res == NULL) {
+        if ((uintptr_t) &prev[j] % 64 == 0 && width % 8 == 0) {
+            AVX512_LOOP(_mm512_load_pd, )
+        } else {
+            AVX512_LOOP(_mm512_loadu_pd, )
+        }
+    } else {
+        if ((uintptr_t) &prev[j] % 64 == 0 && width % 8 == 0) {
+            AVX512_LOOP(_mm512_load_pd, AVX512_RES)
+        } else {
+            AVX512_LOOP(_mm512_loadu_pd, AVX512_RES)
+        }
+        m = _mm512_reduce_max_pd(rmax);
+        if (m > res[0])
+            res[0] = m;
+        res[1] += _mm512_reduce_add_pd(rsum);
+    }
+
+    /* Remainder */
+    _mm256_zeroupper();
+    row_portable(&curr[j], &prev[j], width, n - j, cx, cy, res);
+}
+
+#endif
+
+static row_kernel kernel = row_portable;
+static row_kernel kernel4 = row4_portable;
+static const char *selected = "portable";
+
+/* Radius of the stencil in use, 1 for the five-point stencil and 2 for
+ * the fourth-order one */
+static int radius = 1;
+
+/* Choose the row kernel. name can be "auto", "portable", "avx2" or
+ * "avx512"; "auto" (or NULL) picks the widest one supported by the CPU.
+ * Returns 0 on success and -1 if the kernel is unknown or not supported. */
+int select_kernel(const char *name)
+{
+    int autoselect = (name == NULL || strcmp(name, "auto") == 0);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if ((autoselect || strcmp(name, "avx512") == 0) &&
+        __builtin_cpu_supports("avx512f")) {
+        kernel = row_avx512;
+        kernel4 = row4_avx512;
+        selected = "avx512";
+        return 0;
+    }
+    if ((autoselect || strcmp(name, "avx2") == 0) &&
+        __builtin_cpu_supports("avx2")) {
+        kernel = row_avx2;
+        kernel4 = row4_avx2;
+        selected = "avx2";
+        return 0;
+    }
+#endif
+    if (autoselect || strcmp(name, "portable") == 0) {
+        kernel = row_portable;
+        kernel4 = row4_portable;
+        selected = "portable";
+        return 0;
+    }
+    return -1;
+}
+
+/* Name of the kernel in use */
+const char *kernel_name(void)
+{
+    return selected;
+}
+
+/* Choose the order of the spatial discretisation, 2 for the five-point
+ * stencil or 4. Returns 0 on success and -1 if the order is not
+ * supported. */
+int set_stencil_order(int order)
+{
+    if (order != 2 && order != 4)
+        return -1;
+    radius = order / 2;
+    return 0;
+}
+
+/* Number of points read on each side of the updated point, and so the
+ * number of ghost layers consumed by a step */
+int stencil_radius(void)
+{
+    return radius;
+}
+
+/* Update n consecutive points starting from curr using the values in
+ * prev, the rows above and below are width elements apart */
+void evolve_row(real *curr, const real *prev, int width, int n,
+                double cx, double cy)
+{
+    if (radius == 2)
+        kernel4(curr, prev, width, n, cx, cy, NULL);
+    else
+        kernel(curr, prev, width, n, cx, cy, NULL);
+}
+
+/* As evolve_row, and accumulate the change of the points into res: res[0]
+ * is raised to the largest absolute change and the squared changes are
+ * added to res[1] */
+void evolve_row_residual(real *curr, const real *prev, int width, int n,
+                         double cx, double cy, double *res)
+{
+    if (radius == 2)
+        kernel4(curr, prev, width, n, cx, cy, res);
+    else
+        kernel(curr, prev, width, n, cx, cy, res);
+}
@@ -5,22 +5,82 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include <mpi.h>
 
 #include "heat.h"
 
-/* Utility routine for allocating a two dimensional array */
-double *malloc_2d(int nx, int ny)
+#define CACHE_LINE 64
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+/* Cache lines added to the rows of the fields, negative for rows without
+ * padding, see row_pitch */
+static int padding = -1;
+
+/* Back the arrays of at least a huge page with transparent huge pages */
+static int huge_pages = 0;
+
+/* Utility routine for allocating a two dimensional array. The array is
+ * aligned to a cache line so that the vectorized kernels can use aligned
+ * accesses. With huge pages enabled the large arrays are aligned to a
+ * huge page and the kernel is asked to back them with huge pages, which
+ * takes effect when the pages are first touched. */
+real *malloc_2d(int nx, int ny)
+{
+    void *array;
+    size_t size = (size_t) nx * ny * sizeof(real);
+    size_t align = CACHE_LINE;
+
+    if (huge_pages && size >= HUGE_PAGE)
+        align = HUGE_PAGE;
+    if (posix_memalign(&array, align, size) != 0) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == HUGE_PAGE)
+        madvise(array, size, MADV_HUGEPAGE);
+#endif
+
+    return (real *) array;
+}
+
+/* Set the padding of the rows of the fields in cache lines, negative for
+ * none. Returns the previous padding. */
+int set_row_padding(int lines)
+{
+    int old = padding;
+    padding = lines;
+    return old;
+}
+
+/* Enable (on != 0) or disable the huge pages of malloc_2d. Returns the
+ * previous setting. */
+int set_huge_pages(int on)
 {
-    double *array;
+    int old = huge_pages;
+    huge_pages = on;
+    return old;
+}
 
-    array = (double *) malloc(nx * ny * sizeof(double));
+/* Distance in elements between the rows of a field whose rows, ghost
+ * layers included, are width elements wide. Without padding it is the
+ * width. With padding the width is rounded up to whole cache lines, so
+ * that every row starts at a cache line, and the given number of cache
+ * lines is added: with an odd number of cache lines in total the rows of
+ * a power-of-two-like width no longer start at the same offset of a page
+ * and do not all fall into the same cache sets. The pitch depends only
+ * on the width, so the ranks know the pitch of their neighbours. */
+int row_pitch(int width)
+{
+    int line = CACHE_LINE / sizeof(real);
 
-    return array;
+    if (padding < 0)
+        return width;
+    return (width + line - 1) / line * line + padding * line;
 }
 
 /* Utility routine for deallocating a two dimensional array */
-void free_2d(double *array)
+void free_2d(real *array)
 {
     free(array);
 }
@@ -29,16 +89,24 @@ void free_2d(double *array)
 /* Copy data on temperature1 into temperature2 */
 void copy_field(field *temperature1, field *temperature2)
 {
+    int i, width;
+
     assert(temperature1->nx == temperature2->nx);
     assert(temperature1->ny == temperature2->ny);
-    memcpy(temperature2->data, temperature1->data,
-           (temperature1->nx + 2) * (temperature1->ny + 2) * sizeof(double));
+    assert(temperature1->nghost == temperature2->nghost);
+    assert(temperature1->pitch == temperature2->pitch);
+    width = temperature1->pitch;
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < temperature1->nx + 2 * temperature1->nghost; i++) {
+        memcpy(&temperature2->data[idx(i, 0, width)],
+               &temperature1->data[idx(i, 0, width)], width * sizeof(real));
+    }
 }
 
 /* Swap the data of fields temperature1 and temperature2 */
 void swap_fields(field *temperature1, field *temperature2)
 {
-    double *tmp;
+    real *tmp;
     tmp = temperature1->data;
     temperature1->data = temperature2->data;
     temperature2->data = tmp;
@@ -47,11 +115,32 @@ void swap_fields(field *temperature1, field *temperature2)
 /* Allocate memory for a temperature field and initialise it to zero */
 void allocate_field(field *temperature)
 {
+    int i, width;
+
     // Allocate also ghost layers
-    temperature->data =
-        malloc_2d(temperature->nx + 2, temperature->ny + 2);
+    if (halo_engine() == HALO_SHARED)
+        temperature->data = halo_alloc(temperature);
+    else
+        temperature->data =
+            malloc_2d(temperature->nx + 2 * temperature->nghost,
+                      temperature->pitch);
+
+    // Initialize to zero, the rows are touched first by the same threads
+    // that update them so that the pages are placed on their NUMA node
+    width = temperature->pitch;
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < temperature->nx + 2 * temperature->nghost; i++) {
+        memset(&temperature->data[idx(i, 0, width)], 0,
+               width * sizeof(real));
+    }
+}
 
-    // Initialize to zero
-    memset(temperature->data, 0.0,
-           (temperature->nx + 2) * (temperature->ny + 2) * sizeof(double));
+/* Deallocate the memory of a temperature field */
+void deallocate_field(field *temperature)
+{
+    if (halo_engine() == HALO_SHARED)
+        halo_dealloc(temperature->data);
+    else
+        free_2d(temperature->data);
+    temperature->data = NULL;
 }
@@ -0,0 +1,57 @@
+/* Utility functions for the 3D heat equation solver */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <mpi.h>
+
+#include "heat3d.h"
+
+/* Copy data on temperature1 into temperature2 */
+void copy_field3d(field3d *temperature1, field3d *temperature2)
+{
+    int i;
+    long plane;
+
+    assert(temperature1->nx == temperature2->nx);
+    assert(temperature1->ny == temperature2->ny);
+    assert(temperature1->nz == temperature2->nz);
+    plane = (long) (temperature1->ny + 2) * (temperature1->nz + 2);
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < temperature1->nx + 2; i++) {
+        memcpy(&temperature2->data[i * plane],
+               &temperature1->data[i * plane], plane * sizeof(real));
+    }
+}
+
+/* Swap the data of fields temperature1 and temperature2 */
+void swap_fields3d(field3d *temperature1, field3d *temperature2)
+{
+    real *tmp;
+    tmp = temperature1->data;
+    temperature1->data = temperature2->data;
+    temperature2->data = tmp;
+}
+
+/* Allocate memory for a temperature field and initialise it to zero. The
+ * planes are touched first by the same threads that update them. */
+void allocate_field3d(field3d *temperature)
+{
+    int i;
+    long plane;
+    void *array = NULL;
+
+    /* Aligned to a cache line like the 2D arrays */
+    plane = (long) (temperature->ny + 2) * (temperature->nz + 2);
+    if (posix_memalign(&array, 64,
+                       (temperature->nx + 2) * plane * sizeof(real)) != 0) {
+        printf("Cannot allocate the 3D field\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    temperature->data = (real *) array;
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < temperature->nx + 2; i++) {
+        memset(&temperature->data[i * plane], 0, plane * sizeof(real));
+    }
+}